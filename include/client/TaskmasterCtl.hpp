@@ -4,11 +4,14 @@
 #include "UnixSocketClient.hpp"
 
 #include <common/CommandManager.hpp>
+#include <common/Protocol.hpp>
 #include <csignal>
 #include <functional>
 #include <string>
 #include <vector>
 
+#define CTL_READ_BUFFER_SIZE 65536
+
 typedef struct client_command_s client_command_t;
 struct client_command_s {
   std::string name;
@@ -22,6 +25,7 @@ public:
   explicit TaskmasterCtl(std::string prompt_string);
   ~TaskmasterCtl();
   void loop();
+  void run_batch(const std::vector<std::string> &command_lines);
   void run_command(const std::string &command_line);
 
 private:
@@ -29,18 +33,26 @@ private:
   size_t _usage_max_len;
   std::string _prompt_string;
   bool _is_running;
+  bool _batch;
   UnixSocketClient _socket;
+  FrameDecoder _decoder;
+  uint32_t _next_request_id;
+  std::string _outgoing;
+  std::vector<uint32_t> _pending;
   struct sigaction _default_sigint_handler;
 
   void set_sigint_handler();
   void reset_sigint_handler();
-  void send_command(const std::vector<std::string> &args) const;
-  void send_and_receive(const std::vector<std::string> &args) const;
+  uint32_t send_command(const std::vector<std::string> &args);
+  void send_frames(const std::string &frames) const;
+  void send_and_receive(const std::vector<std::string> &args);
   void attach(const std::vector<std::string> &args);
   void quit(const std::vector<std::string> &);
   void print_usage(const std::vector<std::string> &) const;
   static void print_header();
-  void receive_response() const;
+  void receive_response(uint32_t request_id);
+  void receive_responses();
+  bool receive_frame(frame_t &frame);
   size_t get_usage_max_len() const;
   std::unordered_map<std::string, cmd_callback_t> get_commands_callback();
 };
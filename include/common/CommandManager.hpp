@@ -14,6 +14,10 @@
 #define CMD_HELP_STR "help"
 #define CMD_ATTACH_STR "attach"
 #define CMD_DETACH_STR "detach"
+#define CMD_TAIL_STR "tail"
+#define CMD_LOGLEVEL_STR "loglevel"
+#define CMD_REEXEC_STR "reexec"
+#define CMD_STATS_STR "stats"
 #define CMD_UNKNOWN_STR "unknown"
 
 typedef std::function<void(const std::vector<std::string> &)> cmd_callback_t;
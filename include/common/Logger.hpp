@@ -1,12 +1,37 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
+#include "common/MpscRing.hpp"
+
+#include <atomic>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <sys/types.h>
 
 #ifdef DEBUG
 #define LOG_TO_STDOUT
 #endif
 
+/*
+ * Check the level before evaluating the message, so a disabled level builds
+ * no string at all.
+ */
+#define LOG_AT(level, message)                                                 \
+  do {                                                                         \
+    Logger &logger_ = Logger::get_instance();                                  \
+    if (logger_.is_enabled(level)) {                                           \
+      logger_.log(level, message);                                             \
+    }                                                                          \
+  } while (0)
+#define LOG_DEBUG(message) LOG_AT(Logger::Level::Debug, message)
+#define LOG_INFO(message) LOG_AT(Logger::Level::Info, message)
+#define LOG_WARN(message) LOG_AT(Logger::Level::Warning, message)
+#define LOG_ERROR(message) LOG_AT(Logger::Level::Error, message)
+
+#define LOG_LINE_MAX 512
+#define LOG_RING_SIZE 2048
+#define LOG_BATCH_SIZE 64
+
 class Logger {
 public:
   enum class Level { Debug, Info, Warning, Error };
@@ -16,22 +41,62 @@ public:
   ~Logger();
 
   static void init(const std::string &log_file_path);
+  static void init(int fd);
   static Logger &get_instance();
 
+  void start_async();
+  void stop_async();
+
+  bool is_enabled(Level level) const {
+    return level >= _level.load(std::memory_order_relaxed);
+  }
+  Level get_level() const;
+  int get_fd() const;
+  void set_level(Level level);
+  static bool parse_level(std::string name, Level &level);
+
   void log(Level level, const std::string &message);
   void debug(const std::string &message);
   void info(const std::string &message);
   void warn(const std::string &message);
   void error(const std::string &message);
 
+  uint64_t get_dropped() const;
+
 private:
+  typedef struct log_slot_s {
+    Level level;
+    size_t length;
+    char line[LOG_LINE_MAX];
+  } log_slot_t;
+
   explicit Logger(const std::string &log_file_path);
+  explicit Logger(int fd);
 
+  void log_sync(Level level, pid_t pid, const std::string &message);
+  void writer_loop();
+  void wake_writer();
+  void report_dropped();
+  void echo(Level level, const char *line, size_t length) const;
+  static size_t format_prefix(char *buffer, size_t size, Level level,
+                              pid_t pid);
+  static size_t format_line(char *buffer, Level level, pid_t pid,
+                            const std::string &message);
   std::string log_level_to_color(Level level) const;
   static std::unique_ptr<Logger> _instance;
   static std::once_flag _init_flag;
   int _fd{};
   std::mutex _mutex;
+  std::unique_ptr<MpscRing<log_slot_t>> _ring;
+  std::thread _writer;
+  pid_t _writer_pid;
+  int _wake_fd;
+  std::atomic<Level> _level;
+  std::atomic<bool> _async;
+  std::atomic<bool> _stopping;
+  std::atomic<bool> _writer_sleeping;
+  std::atomic<uint64_t> _dropped;
+  uint64_t _reported_dropped;
 };
 
 std::ostream &operator<<(std::ostream &os, const Logger::Level &level);
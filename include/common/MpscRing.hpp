@@ -0,0 +1,101 @@
+#ifndef MPSCRING_HPP
+#define MPSCRING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/*
+ * Bounded lock-free queue of preallocated slots, for many producers and a
+ * single consumer. Producers fill a slot in place, the consumer reads slots
+ * in place and releases them once done, so nothing is allocated or copied
+ * by the queue itself.
+ *
+ * Each slot carries a sequence number telling whether it is free for the
+ * producer at a given position, or ready for the consumer.
+ */
+template <typename T> class MpscRing {
+public:
+  /**
+   * @param capacity number of slots, must be a power of two
+   */
+  explicit MpscRing(size_t capacity)
+      : _slots(new slot_t[capacity]),
+        _mask(capacity - 1),
+        _enqueue_pos(0),
+        _dequeue_pos(0) {
+    for (size_t i = 0; i < capacity; i++) {
+      _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief Claim a slot, fill it with fill(T &) and publish it.
+   *
+   * @return false if the ring is full
+   */
+  template <typename F> bool try_push(F &&fill) {
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    slot_t *slot;
+
+    while (true) {
+      slot = &_slots[pos & _mask];
+      const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                        static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    fill(slot->value);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Consumer side: return the index-th slot after the last released
+   *        one, or nullptr if it is not published yet.
+   */
+  T *peek(size_t index) {
+    const size_t pos = _dequeue_pos + index;
+    slot_t &slot = _slots[pos & _mask];
+
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+      return nullptr;
+    }
+    return &slot.value;
+  }
+
+  /**
+   * @brief Consumer side: hand the first count peeked slots back to the
+   *        producers.
+   */
+  void release(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      const size_t pos = _dequeue_pos + i;
+      _slots[pos & _mask].sequence.store(pos + _mask + 1,
+                                         std::memory_order_release);
+    }
+    _dequeue_pos += count;
+  }
+
+private:
+  typedef struct slot_s {
+    std::atomic<size_t> sequence;
+    T value;
+  } slot_t;
+
+  std::unique_ptr<slot_t[]> _slots;
+  const size_t _mask;
+  alignas(64) std::atomic<size_t> _enqueue_pos;
+  alignas(64) size_t _dequeue_pos;
+};
+
+#endif // MPSCRING_HPP
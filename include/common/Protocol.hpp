@@ -0,0 +1,53 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Everything sent on the control socket is a frame: a fixed size header
+ * followed by `length` bytes of payload. Integers are in network byte order.
+ *
+ *   +------------+----------------+---------+-----------------+
+ *   | length (4) | request_id (4) | type (1)| payload         |
+ *   +------------+----------------+---------+-----------------+
+ *
+ * Each request is answered by any number of Response frames carrying its id,
+ * then by exactly one End frame. Output frames carry the output of attached
+ * processes, with the id of the attach request.
+ */
+#define FRAME_HEADER_SIZE 9
+#define FRAME_MAX_PAYLOAD (1 << 20)
+
+enum class FrameType : uint8_t { Request = 1, Response, Output, End };
+
+typedef struct frame_s {
+  FrameType type;
+  uint32_t request_id;
+  std::string payload;
+} frame_t;
+
+void encode_frame_header(char *header, FrameType type, uint32_t request_id,
+                         size_t length);
+std::string encode_frame(FrameType type, uint32_t request_id,
+                         const std::string &payload);
+
+/*
+ * Reassemble frames from a byte stream, whatever the way it was split by the
+ * reads: a frame may come in several reads, and a read may hold several.
+ */
+class FrameDecoder {
+
+public:
+  FrameDecoder();
+
+  void feed(const char *data, size_t size);
+  bool next_frame(frame_t &frame);
+
+private:
+  std::string _buffer;
+  size_t _offset;
+};
+
+#endif // PROTOCOL_HPP
@@ -12,6 +12,7 @@
 class UnixSocket : public Socket {
 public:
   explicit UnixSocket(const std::string &path_name);
+  UnixSocket(int fd, const std::string &path_name);
 
   sockaddr_un get_sockaddr() const;
 
@@ -1,24 +1,73 @@
 #ifndef CLIENTSESSION_HPP
 #define CLIENTSESSION_HPP
 
+#include "common/Protocol.hpp"
 #include "common/socket/Socket.hpp"
+#include "server/ConfigParser.hpp"
+#include "server/PollFds.hpp"
 
+#include <deque>
 #include <string>
+#include <vector>
+extern "C" {
+#include <sys/uio.h>
+}
 
+#define CLIENT_FLUSH_IOV_MAX 16
+#define CLIENT_READ_BUFFER_SIZE 65536
+
+/*
+ * The client socket is non-blocking. Whatever cannot be written right away
+ * is queued, and flushed once the socket is writable again (EPOLLOUT).
+ *
+ * Responses are framed (see Protocol.hpp) and go to the request being run,
+ * set by begin_request(). end_request() then closes the response, unless it
+ * was deferred to be answered later.
+ */
 class ClientSession : public Socket {
 
 public:
-  explicit ClientSession(int client_fd);
+  ClientSession(int client_fd, PollFds &poll_fds,
+                const server_config_t &server_config);
 
-  std::string recv_command() const;
-  void send_response(const std::string &response) const;
+  std::vector<frame_t> recv_requests();
+  void begin_request(uint32_t request_id);
+  void end_request();
+  void defer_response();
+  void send_response(const std::string &response);
+  void send_response(uint32_t request_id, const std::string &response);
+  void end_response(uint32_t request_id);
+  void send_output(const struct iovec *iov, int iovcnt);
+  bool flush();
 
-  bool get_reload_request() const;
-  void set_reload_request(bool reload);
+  uint32_t get_request_id() const;
+  uint32_t get_output_request_id() const;
+  void set_output_request(uint32_t request_id);
+  void set_server_config(const server_config_t &server_config);
 
 private:
-  static char _buffer[SOCKET_BUFFER_SIZE];
-  bool _reload_request;
+  typedef struct chunk_s {
+    std::string data;
+    bool droppable;
+  } chunk_t;
+
+  static char _buffer[CLIENT_READ_BUFFER_SIZE];
+  PollFds *_poll_fds;
+  FrameDecoder _decoder;
+  uint32_t _request_id;
+  bool _response_deferred;
+  uint32_t _output_request_id;
+  std::deque<chunk_t> _outbound;
+  size_t _outbound_size;
+  size_t _outbound_offset;
+  size_t _max_outbound;
+  OverflowPolicy _overflow_policy;
+  size_t _dropped;
+  bool _closing;
+
+  void enqueue(const struct iovec *iov, int iovcnt, bool droppable);
+  bool make_room(size_t len);
+  void close_session();
 };
 
 #endif // CLIENTSESSION_HPP
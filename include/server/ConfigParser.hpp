@@ -1,6 +1,9 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include "common/Logger.hpp"
+
+#include <chrono>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -11,6 +14,8 @@ extern "C" {
 
 enum class AutoRestart { True, False, Unexpected };
 
+enum class OverflowPolicy { DropOldest, DropNewest, Disconnect };
+
 struct WordexpDestructor {
   void operator()(wordexp_t *p) const;
 };
@@ -22,22 +27,46 @@ typedef struct {
   std::string workingdir;
   std::string stdout;
   std::string stderr;
+  size_t output_buffer;
   int stopsignal;
   unsigned long numprocs;
-  unsigned long starttime;
+  std::chrono::milliseconds starttime;
   unsigned long startretries;
-  unsigned long stoptime;
+  std::chrono::milliseconds stoptime;
+  unsigned long max_concurrent_starts;
+  double start_rate;
+  std::chrono::milliseconds start_jitter;
+  unsigned long restart_batch;
   mode_t umask;
   bool autostart;
   AutoRestart autorestart;
   std::vector<std::pair<std::string, std::string>> env;
+  // Daemon environment merged with `env`, built once per config and shared
+  // by every instance. envp points into envp_entries, which is never resized
+  std::vector<std::string> envp_entries;
+  std::vector<char *> envp;
   std::vector<uint8_t> exitcodes;
 } process_config_t;
 
+typedef struct {
+  size_t client_queue_size;
+  OverflowPolicy client_overflow;
+  Logger::Level loglevel;
+  unsigned long max_concurrent_starts;
+  double start_rate;
+  unsigned long workers;
+  // How often the workers read /proc for the running processes, 0 to disable
+  std::chrono::milliseconds sample_interval;
+  // Unix socket path or loopback host:port of the metrics, empty to disable
+  std::string metrics;
+} server_config_t;
+
 class ConfigParser {
 public:
   explicit ConfigParser(std::string config_path);
   std::unordered_map<std::string, process_config_t> parse() const;
+  server_config_t parse_server() const;
+  const std::string &get_config_path() const;
 
 private:
   std::string _config_path;
@@ -0,0 +1,68 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "server/Process.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Latency histogram with fixed buckets, updated with relaxed atomics so
+ * that neither the workers observing it nor a scrape ever block.
+ */
+class Histogram {
+public:
+  // Upper bounds of the buckets in seconds, +Inf is implied
+  Histogram(std::initializer_list<double> bounds);
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  void observe(std::chrono::microseconds duration);
+  void write(std::ostream &os, const std::string &name,
+             const std::string &labels) const;
+
+private:
+  std::vector<uint64_t> _bounds; // microseconds
+  std::unique_ptr<std::atomic<uint64_t>[]> _buckets;
+  std::atomic<uint64_t> _sum; // microseconds
+};
+
+/*
+ * Counters of a program, shared by its group and its processes. They are
+ * kept across reloads, and reset when the daemon restarts.
+ */
+typedef struct program_metrics_s {
+  std::atomic<uint64_t> starts{0};
+  // Starts following an exit: autorestarts, retries and `restart`
+  std::atomic<uint64_t> restarts{0};
+  std::atomic<uint64_t> unexpected_exits{0};
+  std::atomic<uint64_t> aborts{0};
+  std::atomic<uint64_t> stdout_bytes{0};
+  std::atomic<uint64_t> stderr_bytes{0};
+  // From the clone() of the child to its execve()
+  Histogram spawn_latency{0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                          0.01,   0.025,   0.05,   0.1,   0.25};
+  // From the stop signal to the exit of the child
+  Histogram stop_latency{0.01, 0.05, 0.1, 0.25, 0.5, 1,
+                         2.5,  5,    10,  30,   60};
+} program_metrics_t;
+
+/*
+ * What a scrape reports for a program, gathered by the main thread.
+ */
+typedef struct {
+  std::string name;
+  const program_metrics_t *metrics;
+  size_t states[static_cast<size_t>(Process::State::Stopped) + 1];
+  size_t attached_clients;
+} program_metrics_view_t;
+
+std::string render_metrics(const std::vector<program_metrics_view_t> &programs);
+
+#endif // METRICS_HPP
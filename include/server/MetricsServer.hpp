@@ -0,0 +1,51 @@
+#ifndef METRICSSERVER_HPP
+#define METRICSSERVER_HPP
+
+#include "server/PollFds.hpp"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#define METRICS_MAX_CONNECTIONS 16
+#define METRICS_MAX_REQUEST_SIZE 8192
+
+/*
+ * Minimal HTTP/1.0 server answering each GET with the metrics rendered by
+ * the main thread, then closing the connection. Its fds are handled by the
+ * event loop of the main thread: a scrape never takes a worker mutex.
+ */
+class MetricsServer {
+public:
+  typedef std::function<std::string()> render_t;
+
+  MetricsServer(const std::string &address, PollFds &poll_fds,
+                render_t render);
+  ~MetricsServer();
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  void accept_connection();
+  void handle_connection(const PollFds::event_t &event);
+  const std::string &get_address() const;
+
+private:
+  typedef struct {
+    std::string request;
+    std::string response;
+    size_t sent;
+  } connection_t;
+
+  std::string _address;
+  std::string _unix_path; // unlinked on destruction, empty for TCP
+  int _fd;
+  PollFds &_poll_fds;
+  render_t _render;
+  std::unordered_map<int, connection_t> _connections;
+
+  void respond(int fd, connection_t &connection);
+  bool flush(int fd, connection_t &connection);
+  void close_connection(int fd);
+};
+
+#endif // METRICSSERVER_HPP
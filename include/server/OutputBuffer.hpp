@@ -0,0 +1,32 @@
+#ifndef OUTPUTBUFFER_HPP
+#define OUTPUTBUFFER_HPP
+
+#include <string>
+#include <vector>
+extern "C" {
+#include <sys/uio.h>
+}
+
+/*
+ * Fixed-size ring of the most recent output of a process. The storage is
+ * allocated once, output is read straight into it and then forwarded from
+ * it, so keeping a backlog costs no extra copy.
+ */
+class OutputBuffer {
+public:
+  explicit OutputBuffer(size_t capacity);
+
+  int reserve(struct iovec (&iov)[2], size_t len);
+  void commit(size_t len);
+  std::string tail(size_t bytes) const;
+
+  size_t get_capacity() const;
+  size_t get_size() const;
+
+private:
+  std::vector<char> _data;
+  size_t _head;
+  size_t _size;
+};
+
+#endif // OUTPUTBUFFER_HPP
@@ -1,39 +1,60 @@
 #ifndef POLLFDS_HPP
 #define POLLFDS_HPP
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <unordered_map>
 #include <vector>
 
+#define POLLFDS_MAX_EVENTS 64
+
 class PollFds {
 public:
   enum class FdType {
     Server,
     Client,
-    Process,
+    ProcessStdout,
+    ProcessStderr,
     WakeUp,
+    ChildExit,
+    MetricsServer,
+    MetricsClient,
   };
 
   typedef struct metadata_s {
     FdType type;
-    bool stale;
+    void *owner;
   } metadata_t;
 
-  typedef struct snapshot_s {
-    std::vector<pollfd> poll_fds;
-    std::vector<metadata_t> metadata;
-  } snapshot_t;
+  typedef struct entry_s {
+    int fd;
+    uint32_t events;
+    metadata_t metadata;
+    std::atomic<bool> stale;
+    bool removed;
+  } entry_t;
+
+  typedef struct event_s {
+    uint32_t events;
+    entry_t *entry;
+  } event_t;
 
   PollFds();
+  ~PollFds();
 
-  void add_poll_fd(pollfd fd, metadata_t metadata);
+  void add_poll_fd(int fd, uint32_t events, metadata_t metadata);
   void remove_poll_fd(int fd);
   void stale_poll_fd(int fd);
+  void modify_poll_fd(int fd, uint32_t events);
+  std::vector<int> remove_owner_fds(const void *owner);
 
-  snapshot_t get_snapshot();
+  int wait(std::vector<event_t> &events, int timeout);
 
 private:
-  std::vector<pollfd> _poll_fds;
-  std::vector<metadata_t> _metadata;
+  int _epoll_fd;
+  std::unordered_map<int, std::unique_ptr<entry_t>> _entries;
+  std::vector<std::unique_ptr<entry_t>> _removed_entries;
   std::mutex _mutex;
 };
 
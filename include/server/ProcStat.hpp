@@ -0,0 +1,32 @@
+#ifndef PROCSTAT_HPP
+#define PROCSTAT_HPP
+
+#include <cstdint>
+#include <sys/types.h>
+
+/*
+ * Fields of /proc/<pid>/stat, see proc_pid_stat(5). Times are in clock ticks.
+ */
+typedef struct proc_stat_s {
+  uint64_t utime;
+  uint64_t stime;
+  long num_threads;
+  uint64_t starttime; // since boot
+  uint64_t vsize;     // bytes
+} proc_stat_t;
+
+/*
+ * /proc/<pid>/statm, in pages, see proc_pid_statm(5).
+ */
+typedef struct proc_statm_s {
+  uint64_t size;
+  uint64_t resident;
+  uint64_t shared;
+} proc_statm_t;
+
+bool read_proc_stat(pid_t pid, proc_stat_t &stat);
+bool read_proc_statm(pid_t pid, proc_statm_t &statm);
+uint64_t ticks_to_microseconds(uint64_t ticks);
+uint64_t pages_to_bytes(uint64_t pages);
+
+#endif // PROCSTAT_HPP
@@ -2,21 +2,51 @@
 #define PROCESS_HPP
 
 #include "server/ConfigParser.hpp"
+#include "server/OutputBuffer.hpp"
 #include <chrono>
+#include <cstdint>
 #include <memory>
 #include <string>
 
 #define PIPE_READ 0
 #define PIPE_WRITE 1
+#define OUTPUT_CHUNK_SIZE 65536
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+class ClientSession;
+struct reexec_process_s;
+struct program_metrics_s;
 
 class Process {
 public:
   typedef struct {
     bool running;
     bool killed;
-    int exitstatus;
+    int exitstatus; // -1 if killed by a signal
+    int termsig;    // 0 if it exited
   } status_t;
 
+  // Resource usage of the last run, from wait4() once it exited
+  typedef struct {
+    uint64_t user_time;   // microseconds
+    uint64_t system_time; // microseconds
+    uint64_t max_rss;     // KiB
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+  } usage_t;
+
+  // Last read of /proc while it runs, see TaskManager::sample_processes()
+  typedef struct {
+    std::chrono::steady_clock::time_point timestamp; // epoch if never sampled
+    uint64_t user_time;                               // microseconds
+    uint64_t system_time;                             // microseconds
+    double cpu_percent; // since the previous sample
+    uint64_t rss;       // bytes
+    uint64_t shared;    // bytes
+    uint64_t vsize;     // bytes
+    long threads;
+  } sample_t;
+
   enum class State {
     Waiting,
     Starting,
@@ -32,64 +62,98 @@ public:
     None,
   };
 
-  Process(std::shared_ptr<const process_config_t> process_config, int stdout_fd,
-          int stderr_fd);
+  Process(std::shared_ptr<const process_config_t> process_config,
+          std::shared_ptr<program_metrics_s> metrics, size_t instance,
+          int stdout_fd, int stderr_fd);
 
   void start();
+  void prepare_start();
+  void finish_start(pid_t pid);
+  void release_pipes();
+  static pid_t spawn(const process_config_t &config, int stdout_fd,
+                     int stderr_fd);
   void stop(int sig);
   void kill();
   void update_status(void);
   bool check_autorestart() const;
   bool exited_unexpectedly() const;
 
-  ssize_t read_stdout();
-  ssize_t read_stderr();
-  void attach_client(int fd);
-  void detach_client(int fd);
+  ssize_t read_stdout(int read_fd);
+  ssize_t read_stderr(int read_fd);
+  void attach_client(ClientSession *client);
+  bool detach_client(ClientSession *client);
   void send_message_to_client(const std::string &message);
-  void close_outputs();
+  std::string tail_output(size_t bytes) const;
   std::string str() const;
+  void save_state(reexec_process_s &state) const;
+  void restore_state(const reexec_process_s &state,
+                     const std::vector<ClientSession *> &attached_clients);
 
   const process_config_t &get_process_config() const;
+  std::shared_ptr<const process_config_t> get_shared_process_config() const;
+  size_t get_instance() const;
+  program_metrics_s &get_metrics() const;
+  size_t get_num_attached_clients() const;
   pid_t get_pid() const;
+  int get_pidfd() const;
   std::chrono::steady_clock::time_point get_start_timestamp() const;
+  std::chrono::steady_clock::time_point get_stop_timestamp() const;
   size_t get_num_retries() const;
   State get_state() const;
   State get_previous_state() const;
+  bool is_start_queued() const;
+  bool is_retired() const;
   status_t get_status() const;
+  usage_t get_usage() const;
+  sample_t get_sample() const;
   Command get_pending_command() const;
   const int *get_stdout_pipe() const;
   const int *get_stderr_pipe() const;
-  unsigned long get_runtime(void);
-  unsigned long get_stoptime(void);
+  std::chrono::milliseconds get_runtime(void) const;
+  std::chrono::milliseconds get_stoptime(void) const;
 
   void set_num_retries(size_t startretries);
   void set_state(State state);
   void set_previous_state(State state);
+  void set_start_queued(bool start_queued);
+  void set_retired(bool retired);
   void set_pending_command(Command command);
+  void set_process_config(std::shared_ptr<const process_config_t> config);
+  void set_output_fds(int stdout_fd, int stderr_fd);
+  void set_pidfd(int pidfd);
+  void set_sample(const sample_t &sample);
 
 private:
-  void setup();
-  void setup_env() const;
-  void setup_workingdir() const;
-  void setup_umask() const;
-  void setup_outputs();
+  int send_signal(int sig) const;
   ssize_t forward_output(int read_fd, int output_fd);
+  ssize_t copy_output(int read_fd, int output_fd);
+  ssize_t buffer_output(int read_fd, int output_fd);
 
   std::shared_ptr<const process_config_t> _process_config;
+  // Shared with its group, see Metrics.hpp
+  std::shared_ptr<program_metrics_s> _metrics;
+  size_t _instance;
   pid_t _pid;
+  // Set while the child is not a child of this daemon, see set_pidfd()
+  int _pidfd;
   std::chrono::steady_clock::time_point _start_timestamp;
   std::chrono::steady_clock::time_point _stop_timestamp;
   size_t _num_retries;
   State _state;
   State _previous_state;
   status_t _status;
+  usage_t _usage;
+  sample_t _sample;
   Command _pending_command;
   int _stdout_pipe[2];
   int _stderr_pipe[2];
   int _stdout_fd;
   int _stderr_fd;
-  std::vector<int> _attached_client;
+  std::vector<ClientSession *> _attached_client;
+  OutputBuffer _output_buffer;
+  bool _splice_output;
+  bool _start_queued;
+  bool _retired;
 };
 
 std::ostream &operator<<(std::ostream &os, const Process &process);
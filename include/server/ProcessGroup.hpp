@@ -1,21 +1,30 @@
 #ifndef PROCESSGROUP_HPP
 #define PROCESSGROUP_HPP
 
+#include "server/Metrics.hpp"
 #include "server/Process.hpp"
-#include <vector>
+#include <deque>
 
 class ProcessGroup {
-  using GroupType = std::vector<Process>;
+  // A deque keeps the processes in place when instances are added or removed
+  using GroupType = std::deque<Process>;
   using GroupIterator = GroupType::iterator;
   using GroupConstIterator = GroupType::const_iterator;
 
 public:
   explicit ProcessGroup(process_config_t &&config);
+  ProcessGroup(process_config_t &&config, int stdout_fd, int stderr_fd);
   ~ProcessGroup();
 
   process_config_t const &get_process_config() const;
+  const program_metrics_t &get_metrics() const;
+  int get_stdout_fd() const;
+  int get_stderr_fd() const;
+  void set_process_config(process_config_t &&config);
+  size_t size() const;
+  Process &back();
+  void pop_back();
 
-  void stop(int sig);
   void start();
   std::string str() const;
 
@@ -27,8 +36,9 @@ public:
   GroupConstIterator cend() const;
 
 private:
-  std::vector<Process> _process_vector;
+  GroupType _process_vector;
   std::shared_ptr<const process_config_t> _config;
+  std::shared_ptr<program_metrics_t> _metrics;
   int _stdout_fd;
   int _stderr_fd;
 };
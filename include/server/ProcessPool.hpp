@@ -3,7 +3,7 @@
 
 #include "server/ProcessGroup.hpp"
 
-#include <mutex>
+#include <unordered_map>
 
 class ProcessPool {
   using PoolType = std::unordered_map<std::string, ProcessGroup>;
@@ -11,20 +11,23 @@ class ProcessPool {
   using ConstPoolIterator = PoolType::const_iterator;
 
 public:
+  using NodeType = PoolType::node_type;
+
   ProcessPool();
   ProcessPool(std::unordered_map<std::string, process_config_t> &&config_map);
 
   ProcessPool &operator=(ProcessPool &&other) noexcept;
 
   void emplace(process_config_t &&process_config);
+  void emplace(process_config_t &&process_config, int stdout_fd,
+               int stderr_fd);
   PoolIterator erase(PoolIterator it);
   PoolIterator find(std::string const &key);
-  PoolType::node_type extract(std::string const &key);
+  NodeType extract(std::string const &key);
   void move_from(ProcessPool &other, std::string const &key);
   bool empty() const;
 
   std::unordered_map<std::string, ProcessGroup> &get_pool();
-  std::mutex &get_mutex();
 
   PoolIterator begin();
   ConstPoolIterator begin() const;
@@ -35,7 +38,6 @@ public:
 
 private:
   std::unordered_map<std::string, ProcessGroup> _process_pool;
-  std::mutex _mutex;
 };
 
 std::ostream &operator<<(std::ostream &os, const ProcessPool &process_pool);
@@ -0,0 +1,70 @@
+#ifndef REEXECSTATE_HPP
+#define REEXECSTATE_HPP
+
+#include "common/Protocol.hpp"
+#include "server/Process.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Set by `reexec` to the memfd the state is written to
+#define REEXEC_STATE_FD_ENV "TASKMASTERD_STATE_FD"
+
+/*
+ * What a daemon hands over to the binary it re-executes into: the fds it
+ * inherits (listening socket, clients, output files and pipes) and the state
+ * of the processes, whose children keep running across the execve.
+ */
+typedef struct reexec_client_s {
+  int fd;
+  uint32_t output_request_id;
+} reexec_client_t;
+
+typedef struct reexec_group_s {
+  std::string name;
+  std::string stdout_path;
+  int stdout_fd;
+  std::string stderr_path;
+  int stderr_fd;
+} reexec_group_t;
+
+typedef struct reexec_process_s {
+  std::string group_name;
+  size_t instance;
+  pid_t pid;
+  Process::State state;
+  Process::State previous_state;
+  Process::Command pending_command;
+  size_t num_retries;
+  bool start_queued;
+  Process::status_t status;
+  std::chrono::steady_clock::time_point start_timestamp;
+  std::chrono::steady_clock::time_point stop_timestamp;
+  int stdout_pipe;
+  int stderr_pipe;
+  std::vector<int> attached_clients;
+} reexec_process_t;
+
+typedef struct reexec_state_s {
+  int pidfile_fd;
+  int log_fd;
+  int server_fd;
+  // The `reexec` request, answered by the new daemon, and the requests the
+  // client pipelined after it, run by the new daemon
+  int request_client_fd;
+  uint32_t request_id;
+  std::vector<frame_t> pending_requests;
+  std::vector<reexec_client_t> clients;
+  std::vector<reexec_group_t> groups;
+  std::vector<reexec_process_t> processes;
+  // Children whose process was destroyed, killed but not reaped yet
+  std::vector<pid_t> orphans;
+} reexec_state_t;
+
+int write_reexec_state(const reexec_state_t &state);
+reexec_state_t read_reexec_state(int fd);
+std::vector<int> get_reexec_fds(const reexec_state_t &state);
+
+#endif // REEXECSTATE_HPP
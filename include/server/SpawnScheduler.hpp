@@ -0,0 +1,80 @@
+#ifndef SPAWNSCHEDULER_HPP
+#define SPAWNSCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Process;
+
+/*
+ * Decides when processes entering the Starting state are actually spawned,
+ * so that starting a large group does not launch every instance at once.
+ *
+ * A process holds a start slot from its admission until it leaves the
+ * Starting state. At most max_concurrent_starts slots are held and at most
+ * start_rate processes are admitted per second, both globally and per group
+ * (0 means unlimited). Each process also waits a random delay of up to the
+ * start_jitter of its group before it can be admitted. Processes are admitted
+ * in the order they were queued.
+ *
+ * Each worker has its own scheduler, used with the worker mutex held. The
+ * global limits are shared by all of them through lock-free counters.
+ */
+class SpawnScheduler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  typedef struct spawn_limits_s {
+    std::atomic<unsigned long> max_concurrent_starts{0};
+    std::atomic<clock::rep> start_interval{0};
+    std::atomic<unsigned long> starting{0};
+    std::atomic<clock::rep> next_start{clock::time_point::min()
+                                           .time_since_epoch()
+                                           .count()};
+    std::atomic<bool> slot_wanted{false};
+    // Notify pipes of the workers, woken up when a global slot is released
+    std::vector<int> wake_up_fds;
+  } spawn_limits_t;
+
+  explicit SpawnScheduler(spawn_limits_t &global);
+
+  static void set_limits(spawn_limits_t &global,
+                         unsigned long max_concurrent_starts,
+                         double start_rate);
+  void enqueue(Process *process, clock::time_point now);
+  void release(Process *process);
+  void admit(clock::time_point now, std::vector<Process *> &admitted);
+  int get_timeout(clock::time_point now) const;
+
+private:
+  typedef struct {
+    unsigned long starting;
+    clock::time_point next_start;
+  } limiter_t;
+
+  typedef struct {
+    Process *process;
+    clock::time_point not_before;
+  } queued_t;
+
+  spawn_limits_t &_global;
+  std::unordered_map<std::string, limiter_t> _groups;
+  std::list<queued_t> _queue;
+  std::unordered_set<Process *> _starting;
+  clock::time_point _next_admission;
+  std::minstd_rand _random;
+
+  bool take_global_slot(clock::time_point now);
+  void release_global_slot();
+  static clock::duration rate_to_interval(double rate);
+  static void take_slot(limiter_t &limiter, clock::duration interval,
+                        clock::time_point now);
+};
+
+#endif // SPAWNSCHEDULER_HPP
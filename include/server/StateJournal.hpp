@@ -0,0 +1,71 @@
+#ifndef STATEJOURNAL_HPP
+#define STATEJOURNAL_HPP
+
+#include "server/Process.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define JOURNAL_MAGIC "TMJRNL01"
+#define JOURNAL_MIN_SIZE (64 * 1024)
+
+/*
+ * The state of a process as last journaled, which a daemon started after a
+ * crash restores, see TaskManager::recover_process().
+ */
+typedef struct journal_entry_s {
+  std::string group_name;
+  size_t instance;
+  pid_t pid;
+  // Tells the child from a process that reused its pid, filled by the journal
+  uint64_t pid_start_time;
+  Process::State state;
+  Process::Command pending_command;
+  size_t num_retries;
+  bool start_queued;
+  std::chrono::steady_clock::time_point start_timestamp;
+  std::chrono::steady_clock::time_point stop_timestamp;
+} journal_entry_t;
+
+/*
+ * Append-only journal of the process states, mapped in memory: an entry is
+ * in the page cache, and outlives a crash of the daemon, as soon as it is
+ * copied. When full, the latest entries are compacted into a new file renamed
+ * over the old one.
+ *
+ * Written by the workers as their processes go through the FSM, with their
+ * mutex held.
+ */
+class StateJournal {
+public:
+  explicit StateJournal(const std::string &path);
+  ~StateJournal();
+  StateJournal(const StateJournal &) = delete;
+  StateJournal &operator=(const StateJournal &) = delete;
+
+  std::vector<journal_entry_t> get_entries();
+  void update(const journal_entry_t &entry);
+  void remove(const std::string &group_name, size_t instance);
+  static uint64_t get_pid_start_time(pid_t pid);
+
+private:
+  std::mutex _mutex;
+  std::string _path;
+  std::string _boot_id;
+  int _fd;
+  char *_map;
+  size_t _size;
+  size_t _offset;
+  std::unordered_map<std::string, journal_entry_t> _entries;
+
+  void load();
+  void compact();
+  void append(const journal_entry_t &entry, uint8_t type);
+  void unmap();
+};
+
+#endif // STATEJOURNAL_HPP
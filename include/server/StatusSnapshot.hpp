@@ -0,0 +1,57 @@
+#ifndef STATUSSNAPSHOT_HPP
+#define STATUSSNAPSHOT_HPP
+
+#include "server/Process.hpp"
+#include "server/ProcessGroup.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Immutable copies of the state of the processes. Each worker publishes a
+ * snapshot of its groups after the iterations that changed them, so `status`
+ * is served without taking the worker mutex.
+ */
+typedef struct {
+  pid_t pid;
+  Process::State state;
+  bool queued;
+  bool exited;
+  bool exited_unexpectedly;
+  bool killed;
+  bool aborted;
+  int termsig;
+  Process::usage_t usage;   // of the last run, once stopped
+  Process::sample_t sample; // while it runs
+} process_status_t;
+
+typedef struct {
+  std::string name;
+  unsigned long numprocs;
+  std::vector<process_status_t> processes;
+} group_status_t;
+
+typedef struct {
+  // Not bumped when only the samples changed: the short status is unchanged
+  uint64_t version;
+  // Groups that did not change are shared with the previous snapshot
+  std::unordered_map<std::string, std::shared_ptr<const group_status_t>>
+      groups;
+} status_snapshot_t;
+
+process_status_t make_process_status(const Process &process);
+std::shared_ptr<const group_status_t>
+make_group_status(const ProcessGroup &process_group);
+
+void write_process_status(std::ostream &os, const process_status_t &status,
+                          bool verbose);
+void write_group_status(std::ostream &os, const group_status_t &status,
+                        bool verbose);
+std::ostream &operator<<(std::ostream &os, const process_status_t &status);
+std::ostream &operator<<(std::ostream &os, const group_status_t &status);
+
+#endif // STATUSSNAPSHOT_HPP
@@ -2,44 +2,172 @@
 #define TASKMANAGER_HPP
 
 #include "PollFds.hpp"
+#include "common/MpscRing.hpp"
 #include "server/Process.hpp"
 #include "server/ProcessPool.hpp"
+#include "server/SpawnScheduler.hpp"
+#include "server/StateJournal.hpp"
+#include "server/StatusSnapshot.hpp"
+#include "server/TimerQueue.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-#define WAKE_UP_STRING "x"
+#define COMMAND_QUEUE_SIZE 1024
 
+/*
+ * A worker thread running the FSM of a shard of the process groups. Each
+ * worker owns the timers, child reaping and start scheduling of its
+ * processes, under its own mutex.
+ */
 class TaskManager {
 public:
-  explicit TaskManager(ProcessPool &process_pool, PollFds &poll_fds);
+  typedef struct {
+    uint64_t rollout_id;
+    std::string message;
+  } rollout_result_t;
+
+  explicit TaskManager(PollFds &poll_fds,
+                       SpawnScheduler::spawn_limits_t &spawn_limits);
   ~TaskManager();
 
   void start();
   void stop();
+  void suspend();
+  void notify() const;
+  bool queue_command(const std::string &process_name, long instance,
+                     Process::Command command, unsigned long batch,
+                     uint64_t rollout_id);
   bool is_thread_alive() const;
+  static bool is_pidfd_supported();
 
   void set_wake_up_fd(int wake_up_fd);
+  void set_journal(StateJournal *journal);
+  void set_sample_interval(std::chrono::milliseconds sample_interval);
+  void assign_process_group(ProcessGroup &process_group);
+  void release_process_group(ProcessGroup &process_group);
+  void release_process(Process &process);
+  void retire_process_group(ProcessGroup &process_group);
+  void retire_process(Process &process);
+  void reinstate_process(Process &process);
+  void refresh_status(const ProcessGroup &process_group);
+  void adopt_process(Process &process);
+  void adopt_orphan(pid_t pid);
+  std::vector<pid_t> get_orphans() const;
+  bool recover_process(Process *process, const journal_entry_t &entry);
+  std::vector<rollout_result_t> take_rollout_results();
+  std::mutex &get_mutex();
+  std::shared_ptr<const status_snapshot_t> get_status_snapshot() const;
 
 private:
-  ProcessPool &_process_pool;
+  typedef struct {
+    std::string process_name;
+    long instance; // -1 for every process of the group
+    Process::Command command;
+    unsigned long batch; // restart the group this many processes at a time
+    uint64_t rollout_id;
+  } command_t;
+
+  typedef struct {
+    uint64_t id;
+    unsigned long batch_size;
+    std::vector<Process *> batch; // restarted, not running yet
+    std::deque<Process *> queued; // restarted once the batch is running
+  } rollout_t;
+
+  typedef struct {
+    pid_t pid;
+    Process *process;
+    int pidfd;
+  } child_t;
+
+  typedef struct {
+    Process *process;
+    std::shared_ptr<const process_config_t> config;
+    int stdout_pipe[2];
+    int stderr_pipe[2];
+    pid_t pid;
+    std::chrono::microseconds latency;
+  } spawn_t;
+
+  typedef struct {
+    Process *process;
+    pid_t pid;
+    Process::sample_t previous;
+    Process::sample_t sample;
+    bool sampled; // false if it exited before it was read
+  } probe_t;
+
+  std::mutex _mutex;
+  std::unordered_map<std::string, ProcessGroup *> _process_groups;
+  std::atomic<bool> _sweep_requested;
   std::thread _worker_thread;
   std::atomic<bool> _stop_token;
+  std::atomic<bool> _suspended;
   PollFds &_poll_fds;
   int _wake_up_fd;
+  PollFds _event_fds;
+  int _notify_pipe[2];
+  MpscRing<command_t> _commands;
+  std::unordered_map<pid_t, child_t> _children;
+  int _sigchld_fd;
+  TimerQueue _timers;
+  std::vector<Process *> _ready;
+  std::vector<Process *> _retired;
+  SpawnScheduler _scheduler;
+  std::vector<spawn_t> _spawns;
+  std::chrono::milliseconds _sample_interval;
+  std::chrono::steady_clock::time_point _next_sample;
+  std::vector<probe_t> _probes;
+  std::shared_ptr<const status_snapshot_t> _status_snapshot;
+  std::unordered_set<std::string> _dirty_groups;
+  // Only their samples changed, see publish_status()
+  std::unordered_set<std::string> _sampled_groups;
+  std::unordered_map<std::string, rollout_t> _rollouts;
+  std::vector<rollout_result_t> _rollout_results;
+  StateJournal *_journal;
 
   void work();
   void fsm(Process &process);
+  bool step(Process &process);
   void exit_gracefully();
+  void apply_pending_commands();
+  void start_rollout(ProcessGroup &process_group, unsigned long batch_size,
+                     uint64_t rollout_id);
+  void restart_next_batch(rollout_t &rollout);
+  void advance_rollouts();
+  void end_rollout(const std::string &process_name,
+                   const std::string &message);
+  void leave_rollout(const Process &process);
+  void wait_for_events(std::vector<PollFds::event_t> &events, int timeout);
+  void handle_events(const std::vector<PollFds::event_t> &events,
+                     std::vector<Process *> &exited_processes);
+  void publish_status();
+  void prepare_spawns();
+  void spawn_admitted();
+  void finish_spawns();
+  void prepare_samples(std::chrono::steady_clock::time_point now);
+  void sample_processes();
+  void finish_samples();
+  int get_sample_timeout(std::chrono::steady_clock::time_point now) const;
+  void journal_process(const Process &process);
+  void register_child(pid_t pid, Process *process);
+  void watch_child(pid_t pid, Process *process, int pidfd);
+  Process *reap_child(pid_t pid);
+  void reap_children(std::vector<Process *> &exited_processes);
 
   void fsm_run_task(Process &process, const process_config_t &config);
   static void fsm_transit_state(Process &process,
                                 const process_config_t &config);
   static void fsm_waiting_task();
   void fsm_starting_task(Process &process, const process_config_t &config);
-  static void fsm_running_task(Process &process);
-  static void fsm_exiting_task(Process &process,
-                               const process_config_t &config);
+  static void fsm_running_task();
+  void fsm_exiting_task(Process &process, const process_config_t &config);
   void fsm_stopped_task(Process &process);
   bool exit_process_gracefully(Process &process);
 };
@@ -4,43 +4,98 @@
 #include "PollFds.hpp"
 #include "UnixSocketServer.hpp"
 #include "server/ClientSession.hpp"
+#include "server/MetricsServer.hpp"
 #include "server/Process.hpp"
 #include "server/ProcessPool.hpp"
+#include "server/ReexecState.hpp"
+#include "server/StateJournal.hpp"
 #include "server/TaskManager.hpp"
 
 #include <common/CommandManager.hpp>
-#include <sys/poll.h>
+#include <deque>
+#include <memory>
 #include <unordered_map>
 
 #define TASKMASTER_PIDFILE "/var/run/taskmasterd.pid"
+// Owned by the daemon user, which renames files in it
+#define TASKMASTER_STATE_DIR "/var/run/taskmasterd"
+#define TASKMASTER_JOURNAL TASKMASTER_STATE_DIR "/journal"
 
 class Taskmaster {
 public:
-  explicit Taskmaster(const ConfigParser &config);
+  Taskmaster(const ConfigParser &config, int pidfile_fd,
+             const reexec_state_t *state);
   void loop();
 
 private:
+  typedef struct target_s {
+    std::string group_name;
+    long instance; // -1 for every process of the group
+  } target_t;
+
+  typedef struct rollout_s {
+    int client_fd; // -1 once the client disconnected
+    uint32_t request_id;
+    size_t pending; // groups still being restarted
+    std::string response;
+  } rollout_t;
+
   ConfigParser _config;
+  server_config_t _server_config;
   CommandManager _command_manager;
   ProcessPool _process_pool;
+  // Groups removed by a reload, destroyed once their processes stopped
+  std::vector<ProcessPool::NodeType> _retired_groups;
   PollFds _poll_fds;
   int _wake_up_pipe[2];
-  std::vector<ClientSession> _client_sessions;
+  std::unordered_map<int, ClientSession> _client_sessions;
   ClientSession *_current_client{};
+  // Requests of _current_client read along with the one being run
+  std::deque<frame_t> _pending_requests;
   UnixSocketServer _server_socket;
-  TaskManager _task_manager;
+  SpawnScheduler::spawn_limits_t _spawn_limits;
+  // Outlives the workers writing to it
+  std::unique_ptr<StateJournal> _journal;
+  std::vector<std::unique_ptr<TaskManager>> _task_managers;
+  std::unique_ptr<MetricsServer> _metrics_server;
+  std::vector<uint64_t> _status_versions;
+  std::string _status_text;
+  // Rolling restarts, answered once every group they restart is done
+  std::unordered_map<uint64_t, rollout_t> _rollouts;
+  uint64_t _next_rollout_id;
   bool _running;
+  int _pidfile_fd;
+  // Resolved at startup: after an upgrade, /proc/self/exe is the old binary
+  std::string _exe_path;
 
-  void handle_poll_fds(const PollFds::snapshot_t &poll_fds_snapshot);
-  void handle_client_command(const pollfd &poll_fd);
+  void handle_poll_fds(const std::vector<PollFds::event_t> &events);
+  void handle_client_command(const PollFds::event_t &event);
+  void run_requests(ClientSession &client_session,
+                    std::deque<frame_t> requests);
   void handle_connection();
   void handle_wake_up(int fd);
-  void handle_process_output(const pollfd &poll_fd, bool stale);
+  void handle_process_output(const PollFds::event_t &event);
+  std::string render_metrics() const;
   int32_t reload_config();
+  int32_t reload_process_group(ProcessGroup &process_group,
+                               process_config_t &&config);
+  void collect_retired();
+  void collect_rollouts();
+  bool can_reexec();
+  reexec_state_t save_state();
+  void restore_state(const reexec_state_t &state);
+  void recover_state();
+  void release_process_outputs(ProcessGroup &process_group);
+  void release_process_output(const Process &process);
   void disconnect_client(int fd);
-  void request_command(const std::vector<std::string> &args,
-                       Process::Command command);
+  void request_command(const std::vector<std::string> &names,
+                       Process::Command command, bool rolling,
+                       unsigned long batch);
+  std::vector<target_t> resolve_targets(const std::vector<std::string> &names);
+  void detach_client(int fd);
   void remove_client_session(int fd);
+  TaskManager &get_task_manager(const std::string &process_name);
+  size_t get_task_manager_index(const std::string &process_name) const;
   static void set_sighup_handler();
 
   // Callback
@@ -53,9 +108,12 @@ private:
   void help(const std::vector<std::string> &args);
   void attach(const std::vector<std::string> &args);
   void detach(const std::vector<std::string> &args);
+  void tail(const std::vector<std::string> &args);
+  void loglevel(const std::vector<std::string> &args);
+  void reexec(const std::vector<std::string> &args);
+  void stats(const std::vector<std::string> &args);
 
   // Getters
-  std::vector<ClientSession>::iterator get_client_session_from_fd(int fd);
   std::unordered_map<std::string, cmd_callback_t> get_commands_callback();
 };
 
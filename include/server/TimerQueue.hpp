@@ -0,0 +1,46 @@
+#ifndef TIMERQUEUE_HPP
+#define TIMERQUEUE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+class Process;
+
+/*
+ * Min-heap of steady_clock deadlines, with at most one armed timer per
+ * process. Re-arming or cancelling a timer is O(1): stale heap entries are
+ * skipped when they reach the top.
+ */
+class TimerQueue {
+public:
+  using clock = std::chrono::steady_clock;
+
+  TimerQueue();
+
+  void arm(Process *process, clock::time_point deadline);
+  void cancel(Process *process);
+  void pop_expired(clock::time_point now, std::vector<Process *> &expired);
+  int get_timeout(clock::time_point now);
+
+private:
+  typedef struct entry_s {
+    clock::time_point deadline;
+    Process *process;
+    uint64_t generation;
+
+    bool operator>(const entry_s &other) const;
+  } entry_t;
+
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<entry_t>>
+      _heap;
+  std::unordered_map<Process *, uint64_t> _armed;
+  uint64_t _generation;
+
+  bool is_armed(const entry_t &timer) const;
+  void discard_cancelled();
+};
+
+#endif // TIMERQUEUE_HPP
@@ -0,0 +1,87 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Each power of two is split in 2^TRACE_SUB_BUCKET_BITS buckets, so a
+// percentile is within 1/16 of the actual duration
+#define TRACE_SUB_BUCKET_BITS 4
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BUCKET_BITS)
+#define TRACE_BUCKETS ((64 - TRACE_SUB_BUCKET_BITS + 1) * TRACE_SUB_BUCKETS)
+
+/*
+ * The hot paths timed by ScopedTimer.
+ */
+enum class TracePoint {
+  WorkerSweep,   // a pass of a worker over its ready processes
+  PollIteration, // the events of one epoll_wait() of the main thread
+  ClientCommand,
+  ForwardOutput,
+  ProcessSpawn,
+  Count,
+};
+
+/*
+ * Latency histograms of the daemon internals, shown by `stats`.
+ *
+ * Each thread records into its own HDR-style histograms (log-linear
+ * buckets), written only by that thread with relaxed atomics: recording takes
+ * no lock and shares no cache line. `stats` merges them. A reset bumps a
+ * generation, and each thread clears its histograms the next time it records.
+ */
+class Tracer {
+public:
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  static Tracer &get_instance();
+
+  void record(TracePoint point, std::chrono::nanoseconds duration);
+  std::string report();
+  void reset();
+
+private:
+  typedef struct thread_histograms_s {
+    std::atomic<uint64_t> generation;
+    std::atomic<uint64_t> counts[static_cast<size_t>(TracePoint::Count)]
+                                [TRACE_BUCKETS];
+    std::atomic<uint64_t> max[static_cast<size_t>(TracePoint::Count)];
+  } thread_histograms_t;
+
+  Tracer();
+
+  thread_histograms_t &get_thread_histograms();
+
+  std::atomic<uint64_t> _generation;
+  std::mutex _mutex;
+  // Kept once their thread exits, so the report never reads freed memory
+  std::vector<std::shared_ptr<thread_histograms_t>> _threads;
+};
+
+/*
+ * Record the time spent in a scope.
+ */
+class ScopedTimer {
+public:
+  explicit ScopedTimer(TracePoint point)
+      : _point(point), _start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    Tracer::get_instance().record(_point,
+                                  std::chrono::steady_clock::now() - _start);
+  }
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  TracePoint _point;
+  std::chrono::steady_clock::time_point _start;
+};
+
+#endif // TRACER_HPP
@@ -8,6 +8,7 @@
 class UnixSocketServer : public UnixSocket {
 public:
   explicit UnixSocketServer(const std::string &path_name);
+  UnixSocketServer(int fd, const std::string &path_name);
   ~UnixSocketServer();
 
   int accept_client();
@@ -0,0 +1,7 @@
+#ifndef WAKEUP_HPP
+#define WAKEUP_HPP
+
+// Written to the pipes that wake a worker or the main thread up
+#define WAKE_UP_STRING "x"
+
+#endif // WAKEUP_HPP
@@ -7,18 +7,22 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <sstream>
-#include <sys/poll.h>
 #include <unistd.h>
+#include <unordered_set>
+#include <utility>
 
 volatile sig_atomic_t sigint_received_g = 0;
 
 static void sigint_handler(int);
+static std::string trim(const std::string &str);
 
 TaskmasterCtl::TaskmasterCtl(std::string prompt_string)
     : _command_manager(get_commands_callback()),
       _prompt_string(std::move(prompt_string)),
       _is_running(true),
-      _socket(SOCKET_PATH_NAME) {
+      _batch(false),
+      _socket(SOCKET_PATH_NAME),
+      _next_request_id(1) {
   _usage_max_len = get_usage_max_len();
   _socket.connect();
 }
@@ -43,6 +47,27 @@ void TaskmasterCtl::loop() {
   }
 }
 
+/**
+ * @brief Run the command lines without waiting for each response: all the
+ *        requests are sent at once, then the responses are printed in the
+ *        order of the commands.
+ */
+void TaskmasterCtl::run_batch(const std::vector<std::string> &command_lines) {
+  _batch = true;
+  for (const auto &command_line : command_lines) {
+    if (!_is_running) {
+      break;
+    }
+    const std::string command = trim(command_line);
+    if (!command.empty() && command.front() != '#') {
+      run_command(command);
+    }
+  }
+  send_frames(std::exchange(_outgoing, {}));
+  receive_responses();
+  _batch = false;
+}
+
 void TaskmasterCtl::run_command(const std::string &command_line) {
   _command_manager.run_command(command_line);
 }
@@ -53,39 +78,84 @@ void TaskmasterCtl::set_sigint_handler() {
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = 0;
   if (sigaction(SIGINT, &sa, &_default_sigint_handler) == -1) {
-    Logger::get_instance().error(std::string("sigaction: ") + strerror(errno));
+    LOG_ERROR(std::string("sigaction: ") + strerror(errno));
     exit(EXIT_FAILURE);
   }
 }
 
 void TaskmasterCtl::reset_sigint_handler() {
   if (sigaction(SIGINT, &_default_sigint_handler, nullptr) == -1) {
-    Logger::get_instance().error(std::string("sigaction: ") + strerror(errno));
+    LOG_ERROR(std::string("sigaction: ") + strerror(errno));
     exit(EXIT_FAILURE);
   }
 }
 
-void TaskmasterCtl::send_command(const std::vector<std::string> &args) const {
-  std::string sent_command = join(args, " ");
-  if (_socket.write(sent_command + '\n') == -1) {
-    Logger::get_instance().error("Failed to send command: `" + sent_command +
-                                 "`:" + strerror(errno));
-    throw std::runtime_error(std::string("send") + strerror(errno));
+/**
+ * @brief Send the command line as a request frame. In batch mode, the frame
+ *        is only queued, run_batch() sends them all at once.
+ *
+ * @return the id of the request, the response carries it
+ */
+uint32_t TaskmasterCtl::send_command(const std::vector<std::string> &args) {
+  const std::string sent_command = join(args, " ");
+  const uint32_t request_id = _next_request_id++;
+  const std::string frame =
+      encode_frame(FrameType::Request, request_id, sent_command);
+
+  if (_batch) {
+    _outgoing += frame;
+  } else {
+    send_frames(frame);
+  }
+  LOG_INFO("Command `" + sent_command + "` sent (id=" +
+           std::to_string(request_id) + ')');
+  return request_id;
+}
+
+void TaskmasterCtl::send_frames(const std::string &frames) const {
+  size_t sent = 0;
+
+  while (sent < frames.size()) {
+    ssize_t ret = _socket.write(frames.data() + sent, frames.size() - sent);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR(std::string("Failed to send commands: ") + strerror(errno));
+      throw std::runtime_error(std::string("send") + strerror(errno));
+    }
+    sent += ret;
   }
-  Logger::get_instance().info("Command `" + sent_command + "` sent");
 }
 
-void TaskmasterCtl::send_and_receive(
-    const std::vector<std::string> &args) const {
-  send_command(args);
-  receive_response();
+void TaskmasterCtl::send_and_receive(const std::vector<std::string> &args) {
+  const uint32_t request_id = send_command(args);
+
+  if (_batch) {
+    _pending.push_back(request_id);
+  } else {
+    receive_response(request_id);
+  }
 }
 
+/*
+ * The response to the attach request holds the backlog, the output that
+ * follows comes in Output frames until SIGINT interrupts the read.
+ */
 void TaskmasterCtl::attach(const std::vector<std::string> &args) {
-  send_command(args);
+  frame_t frame;
+
+  if (_batch) {
+    std::cerr << "attach is not available in batch mode" << std::endl;
+    return;
+  }
+  const uint32_t request_id = send_command(args);
   set_sigint_handler();
-  while (sigint_received_g == 0) {
-    receive_response();
+  receive_response(request_id);
+  while (sigint_received_g == 0 && receive_frame(frame)) {
+    if (frame.type == FrameType::Output && frame.request_id == request_id) {
+      std::cout << frame.payload << std::flush;
+    }
   }
   send_and_receive({CMD_DETACH_STR, args[1]});
   reset_sigint_handler();
@@ -123,33 +193,89 @@ void TaskmasterCtl::print_header() {
                "programs.\n\n";
 }
 
-void TaskmasterCtl::receive_response() const {
-  char buffer[SOCKET_BUFFER_SIZE];
-  pollfd poll_fd = {_socket.get_fd(), POLLIN, 0};
-  int timeout = 3000;
-  ssize_t ret;
+/**
+ * @brief Print the response to the request until its End frame. Frames
+ *        of other requests, like the output of a previous attach, are
+ *        skipped.
+ */
+void TaskmasterCtl::receive_response(const uint32_t request_id) {
+  frame_t frame;
 
   while (true) {
-    int poll_ret = poll(&poll_fd, 1, timeout);
-    Logger::get_instance().debug("Poll returned " + std::to_string(poll_ret));
-    if (poll_ret <= 0) {
+    if (!receive_frame(frame)) {
+      if (sigint_received_g != 0) {
+        return;
+      }
+      continue;
+    }
+    if (frame.request_id != request_id) {
+      continue;
+    }
+    if (frame.type == FrameType::End) {
       return;
     }
-    Logger::get_instance().debug("Revents= " + std::to_string(poll_fd.revents));
-    if ((poll_fd.revents & POLLIN) != 0) {
-      ret = _socket.read(buffer, SOCKET_BUFFER_SIZE);
-      Logger::get_instance().debug("read= " + std::to_string(ret));
-      if (ret == -1) {
-        if (errno != EINTR) {
-          Logger::get_instance().error(
-              std::string("Failed to read response: ") + strerror(errno));
+    std::cout << frame.payload;
+  }
+}
+
+/*
+ * Responses to pipelined requests may complete out of order, a reload is
+ * answered once it is done. The first pending response is printed as it
+ * comes, the following ones are kept until all those before them ended.
+ */
+void TaskmasterCtl::receive_responses() {
+  std::unordered_map<uint32_t, std::string> responses;
+  std::unordered_set<uint32_t> ended;
+  size_t next = 0;
+  frame_t frame;
+
+  while (next < _pending.size()) {
+    if (!receive_frame(frame)) {
+      continue;
+    }
+    if (frame.type == FrameType::End) {
+      ended.insert(frame.request_id);
+    } else if (frame.request_id == _pending[next]) {
+      std::cout << frame.payload;
+    } else {
+      responses[frame.request_id] += frame.payload;
+    }
+    while (next < _pending.size() && ended.count(_pending[next]) != 0) {
+      if (++next < _pending.size()) {
+        auto response = responses.find(_pending[next]);
+        if (response != responses.end()) {
+          std::cout << response->second;
+          responses.erase(response);
         }
-        return;
       }
-      std::cout << std::string(buffer, ret);
     }
-    timeout = 0;
   }
+  _pending.clear();
+}
+
+/**
+ * @brief Block until a whole frame is received.
+ *
+ * @return false if the read was interrupted by a signal
+ */
+bool TaskmasterCtl::receive_frame(frame_t &frame) {
+  char buffer[CTL_READ_BUFFER_SIZE];
+
+  while (!_decoder.next_frame(frame)) {
+    ssize_t ret = _socket.read(buffer, CTL_READ_BUFFER_SIZE);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        return false;
+      }
+      LOG_ERROR(std::string("Failed to read response: ") + strerror(errno));
+      throw std::runtime_error(std::string("read: ") + strerror(errno));
+    }
+    if (ret == 0) {
+      throw std::runtime_error("receive_frame: server closed the connection");
+    }
+    _decoder.feed(buffer, ret);
+  }
+  return true;
 }
 
 size_t TaskmasterCtl::get_usage_max_len() const {
@@ -196,10 +322,35 @@ TaskmasterCtl::get_commands_callback() {
       {CMD_ATTACH_STR,
        [this](const std::vector<std::string> &args) { attach(args); }},
       {CMD_DETACH_STR, nullptr},
+      {CMD_TAIL_STR,
+       [this](const std::vector<std::string> &args) {
+         send_and_receive(args);
+       }},
+      {CMD_LOGLEVEL_STR,
+       [this](const std::vector<std::string> &args) {
+         send_and_receive(args);
+       }},
+      {CMD_REEXEC_STR,
+       [this](const std::vector<std::string> &args) {
+         send_and_receive(args);
+       }},
+      {CMD_STATS_STR,
+       [this](const std::vector<std::string> &args) {
+         send_and_receive(args);
+       }},
   };
 }
 
 static void sigint_handler(int) {
   sigint_received_g = 1;
   std::cout << std::endl;
-}
\ No newline at end of file
+}
+
+static std::string trim(const std::string &str) {
+  const size_t begin = str.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  const size_t end = str.find_last_not_of(" \t");
+  return str.substr(begin, end - begin + 1);
+}
@@ -1,18 +1,54 @@
 #include "client/TaskmasterCtl.hpp"
 
 #include <common/Logger.hpp>
+#include <common/utils.hpp>
+#include <cstring>
 #include <iostream>
 #include <ostream>
+#include <unistd.h>
 
+static std::vector<std::string> read_script(std::istream &input);
+
+/*
+ * Without arguments, the shell is interactive, unless the standard input is
+ * not a terminal: it is then read as a script, one command per line.
+ * `-c 'cmd; cmd'` runs the commands separated by semicolons.
+ */
 int main(int argc, char **argv) {
-  (void)argc;
-  (void)argv;
+  std::vector<std::string> command_lines;
+  bool batch = false;
+
+  if (argc == 3 && std::strcmp(argv[1], "-c") == 0) {
+    command_lines = split(argv[2], ';');
+    batch = true;
+  } else if (argc == 1 && !isatty(STDIN_FILENO)) {
+    command_lines = read_script(std::cin);
+    batch = true;
+  } else if (argc != 1) {
+    std::cerr << "usage: " << argv[0] << " [-c 'command; ...']" << std::endl;
+    return EXIT_FAILURE;
+  }
   Logger::init("./client.log");
   try {
     TaskmasterCtl ctl = TaskmasterCtl("$> ");
-    ctl.loop();
+    if (batch) {
+      ctl.run_batch(command_lines);
+    } else {
+      ctl.loop();
+    }
   } catch (const std::runtime_error &e) {
-    Logger::get_instance().error(e.what());
+    LOG_ERROR(e.what());
+    return batch ? EXIT_FAILURE : EXIT_SUCCESS;
   }
   return 0;
 }
+
+static std::vector<std::string> read_script(std::istream &input) {
+  std::vector<std::string> command_lines;
+  std::string line;
+
+  while (std::getline(input, line)) {
+    command_lines.push_back(line);
+  }
+  return command_lines;
+}
@@ -1,6 +1,8 @@
 #include "common/CommandManager.hpp"
 #include "common/Logger.hpp"
 
+#include <algorithm>
+#include <cstdint>
 #include <common/utils.hpp>
 #include <iostream>
 
@@ -12,26 +14,28 @@ CommandManager::CommandManager(
     const std::unordered_map<std::string, cmd_callback_t> &commands_callback) {
   add_command({
       CMD_STATUS_STR,
-      {},
-      "Show the status of all programs from the config file",
+      {"[-v]", "[program_name...]"},
+      "Show the status of the programs, all of them by default, with their "
+      "CPU and memory usage with -v",
       get_command_callback(CMD_STATUS_STR, commands_callback),
   });
   add_command({
       CMD_START_STR,
-      {"<program_name>"},
-      "Start the specified program",
+      {"<program_name>..."},
+      "Start the specified programs",
       get_command_callback(CMD_START_STR, commands_callback),
   });
   add_command({
       CMD_STOP_STR,
-      {"<program_name>"},
-      "Stop the specified program",
+      {"<program_name>..."},
+      "Stop the specified programs",
       get_command_callback(CMD_STOP_STR, commands_callback),
   });
   add_command({
       CMD_RESTART_STR,
-      {"<program_name>"},
-      "Restart the specified program",
+      {"[--rolling]", "[--batch n]", "<program_name>..."},
+      "Restart the specified programs, a batch of processes at a time with "
+      "--rolling",
       get_command_callback(CMD_RESTART_STR, commands_callback),
   });
   add_command({
@@ -70,6 +74,30 @@ CommandManager::CommandManager(
       "Leave the attached process session and return to the CLI",
       get_command_callback(CMD_DETACH_STR, commands_callback),
   });
+  add_command({
+      CMD_TAIL_STR,
+      {"<program_name>", "[bytes]"},
+      "Show the last output of a program, kept in memory",
+      get_command_callback(CMD_TAIL_STR, commands_callback),
+  });
+  add_command({
+      CMD_LOGLEVEL_STR,
+      {"[debug|info|warning|error]"},
+      "Show or set the minimum level of the daemon logs",
+      get_command_callback(CMD_LOGLEVEL_STR, commands_callback),
+  });
+  add_command({
+      CMD_REEXEC_STR,
+      {},
+      "Re-execute the daemon binary (upgrade), keeping the programs running",
+      get_command_callback(CMD_REEXEC_STR, commands_callback),
+  });
+  add_command({
+      CMD_STATS_STR,
+      {"[reset]"},
+      "Show the p50/p99/max latencies of the daemon internals, or reset them",
+      get_command_callback(CMD_STATS_STR, commands_callback),
+  });
 }
 
 void CommandManager::run_command(const std::string &command_line) {
@@ -86,7 +114,7 @@ void CommandManager::run_command(const std::string &command_line) {
     }
   } else {
     const std::string error_msg = "Unknown command: `" + cmd_name + '`';
-    Logger::get_instance().info(error_msg);
+    LOG_INFO(error_msg);
     std::cerr << error_msg << std::endl;
   }
 }
@@ -95,13 +123,25 @@ void CommandManager::add_command(const command_t &command) {
   _commands_map.emplace(command.name, command);
 }
 
+/*
+ * Arguments written as `[arg]` in the command definition are optional, and
+ * a last argument written as `arg...` can be repeated.
+ */
 bool CommandManager::is_valid_args(const command_t &command,
                                    const std::vector<std::string> &args) {
-  if (command.args.size() + 1 != args.size()) {
-    Logger::get_instance().info("Command `" + command.name + "` needs " +
-                                std::to_string(command.args.size()) +
-                                " arguments, but is called with " +
-                                std::to_string(args.size()) + " arguments");
+  const bool variadic = !command.args.empty() &&
+                        command.args.back().find("...") != std::string::npos;
+  const size_t max_args = variadic ? SIZE_MAX : command.args.size();
+  const size_t min_args =
+      std::count_if(command.args.begin(), command.args.end(),
+                    [](const std::string &arg) { return arg.front() != '['; });
+
+  if (args.size() - 1 < min_args || args.size() - 1 > max_args) {
+    LOG_INFO("Command `" + command.name + "` needs " +
+             std::to_string(min_args) + " to " +
+             (variadic ? "any number of" : std::to_string(max_args)) +
+             " arguments, but is called with " + std::to_string(args.size()) +
+             " arguments");
     std::cerr << "Invalid number of arguments" << std::endl
               << "Usage: " << command.name;
     for (const auto &arg : command.args) {
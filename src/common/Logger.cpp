@@ -2,11 +2,15 @@
 
 #include "common/socket/Socket.hpp"
 
-#include <iomanip>
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
+#include <sys/eventfd.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define COLOR_RESET "\033[0m"
@@ -23,17 +27,40 @@
 #define WARN_COLOR COLOR_YELLOW
 #define ERROR_COLOR COLOR_RED
 
+static const char *log_level_to_str(Logger::Level level);
+
 std::unique_ptr<Logger> Logger::_instance;
 std::once_flag Logger::_init_flag;
 
-Logger::Logger(const std::string &log_file_path) {
-  _fd = open(log_file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+Logger::Logger(const std::string &log_file_path)
+    : _writer_pid(-1),
+      _wake_fd(-1),
+      _level(Level::Debug),
+      _async(false),
+      _stopping(false),
+      _writer_sleeping(false),
+      _dropped(0),
+      _reported_dropped(0) {
+  _fd = open(log_file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+             0644);
   if (_fd == -1) {
     throw std::runtime_error("Logger(): Failed to open log file");
   }
 }
 
+Logger::Logger(const int fd)
+    : _fd(fd),
+      _writer_pid(-1),
+      _wake_fd(-1),
+      _level(Level::Debug),
+      _async(false),
+      _stopping(false),
+      _writer_sleeping(false),
+      _dropped(0),
+      _reported_dropped(0) {}
+
 Logger::~Logger() {
+  stop_async();
   info("Log file closed");
   close(_fd);
 }
@@ -45,6 +72,16 @@ void Logger::init(const std::string &file_path) {
   get_instance().info("Log file `" + file_path + "` created");
 }
 
+/**
+ * @brief Log to a file that is already open, inherited by the daemon
+ *        re-executed by `reexec`, which may no longer be allowed to open it.
+ */
+void Logger::init(const int fd) {
+  std::call_once(_init_flag, [&]() {
+    _instance = std::unique_ptr<Logger>(new Logger(fd));
+  });
+}
+
 Logger &Logger::get_instance() {
   if (!_instance) {
     throw std::runtime_error(
@@ -53,40 +90,269 @@ Logger &Logger::get_instance() {
   return *_instance;
 }
 
-void Logger::log(Level level, const std::string &message) {
-  std::stringstream log_line_ss;
+/**
+ * @brief Hand the writing of log lines to a background thread. Lines are
+ *        queued in a ring of LOG_RING_SIZE slots, and dropped when it is
+ *        full.
+ *
+ * The writer thread blocks every signal, so that they are only delivered to
+ * the threads that handle them, or to the signalfd of a worker.
+ *
+ * @note Must be called once the daemon forked, threads do not survive fork.
+ */
+void Logger::start_async() {
+  sigset_t all_signals;
+  sigset_t saved_mask;
 
-  const auto now = std::chrono::system_clock::now();
-  const auto in_time_t = std::chrono::system_clock::to_time_t(now);
-  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      now.time_since_epoch()) %
-                  1000;
+  if (_async) {
+    return;
+  }
+  _wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (_wake_fd == -1) {
+    throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+  }
+  _ring = std::make_unique<MpscRing<log_slot_t>>(LOG_RING_SIZE);
+  _stopping = false;
+  _writer_pid = getpid();
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+  _writer = std::thread(&Logger::writer_loop, this);
+  pthread_sigmask(SIG_SETMASK, &saved_mask, nullptr);
+  _async.store(true, std::memory_order_release);
+}
+
+/**
+ * @brief Write every queued line, then go back to synchronous writes.
+ */
+void Logger::stop_async() {
+  const uint64_t wake_up = 1;
+
+  if (!_async.exchange(false)) {
+    return;
+  }
+  if (getpid() != _writer_pid) {
+    // Forked child: the writer thread only exists in the parent
+    _writer.detach();
+    return;
+  }
+  _stopping = true;
+  Socket::write(_wake_fd, reinterpret_cast<const char *>(&wake_up),
+                sizeof(wake_up));
+  _writer.join();
+  close(_wake_fd);
+  _wake_fd = -1;
+}
+
+int Logger::get_fd() const { return _fd; }
+
+Logger::Level Logger::get_level() const {
+  return _level.load(std::memory_order_relaxed);
+}
 
-  log_line_ss << '['
-              << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H:%M:%S")
-              << '.' << std::setw(3) << std::setfill('0') << ms.count() << "] "
-              << '[' << level << "] "
-              << "[pid=" << getpid() << "] " << message;
-  if (message[message.length() - 1] != '\n') {
-    log_line_ss << std::endl;
+/**
+ * @brief Set the minimum level of the lines written, lower ones are ignored.
+ */
+void Logger::set_level(Level level) {
+  _level.store(level, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Parse a level name (debug, info, warning or error, case-insensitive).
+ *
+ * @return false if name is not a level
+ */
+bool Logger::parse_level(std::string name, Level &level) {
+  static const std::pair<const char *, Level> levels[] = {
+      {"debug", Level::Debug},
+      {"info", Level::Info},
+      {"warning", Level::Warning},
+      {"warn", Level::Warning},
+      {"error", Level::Error},
+  };
+
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  for (const auto &[level_name, value] : levels) {
+    if (name == level_name) {
+      level = value;
+      return true;
+    }
   }
+  return false;
+}
 
+void Logger::log(Level level, const std::string &message) {
+  if (!is_enabled(level)) {
+    return;
+  }
+  const pid_t pid = getpid();
+
+  if (!_async.load(std::memory_order_acquire) || pid != _writer_pid) {
+    log_sync(level, pid, message);
+    return;
+  }
+  if (!_ring->try_push([&](log_slot_t &slot) {
+        slot.level = level;
+        slot.length = format_line(slot.line, level, pid, message);
+      })) {
+    _dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  wake_writer();
+}
+
+uint64_t Logger::get_dropped() const {
+  return _dropped.load(std::memory_order_relaxed);
+}
+
+void Logger::log_sync(Level level, pid_t pid, const std::string &message) {
+  char prefix[LOG_LINE_MAX];
+  std::string line(prefix, format_prefix(prefix, sizeof(prefix), level, pid));
+
+  line += message;
+  if (message.empty() || message.back() != '\n') {
+    line += '\n';
+  }
   std::lock_guard lock(_mutex);
-  if (Socket::write(_fd, log_line_ss.str()) == -1) {
+  if (Socket::write(_fd, line) == -1) {
     throw std::runtime_error("Logger::log(): Failed to write to file");
   }
+  echo(level, line.data(), line.size());
+}
+
+/*
+ * Writes the queued lines LOG_BATCH_SIZE at a time, straight from their
+ * slots, and sleeps on _wake_fd once the ring is empty.
+ */
+void Logger::writer_loop() {
+  struct iovec iov[LOG_BATCH_SIZE];
+  uint64_t wake_up;
+
+  while (true) {
+    size_t count = 0;
+    log_slot_t *slot;
+
+    while (count < LOG_BATCH_SIZE && (slot = _ring->peek(count)) != nullptr) {
+      iov[count++] = {slot->line, slot->length};
+    }
+    if (count > 0) {
+      if (writev(_fd, iov, static_cast<int>(count)) == -1) {
+        perror("Logger: writev");
+      }
+      for (size_t i = 0; i < count; i++) {
+        slot = _ring->peek(i);
+        echo(slot->level, slot->line, slot->length);
+      }
+      _ring->release(count);
+      report_dropped();
+      continue;
+    }
+    if (_stopping) {
+      report_dropped();
+      return;
+    }
+    _writer_sleeping = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_ring->peek(0) != nullptr || _stopping) {
+      _writer_sleeping = false;
+      continue;
+    }
+    Socket::read(_wake_fd, reinterpret_cast<char *>(&wake_up),
+                 sizeof(wake_up));
+  }
+}
+
+/*
+ * The writer flags itself as sleeping before checking the ring one last time,
+ * so either it sees the new line or the producer sees the flag.
+ */
+void Logger::wake_writer() {
+  const uint64_t wake_up = 1;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_writer_sleeping.load(std::memory_order_relaxed) &&
+      _writer_sleeping.exchange(false)) {
+    Socket::write(_wake_fd, reinterpret_cast<const char *>(&wake_up),
+                  sizeof(wake_up));
+  }
+}
+
+void Logger::report_dropped() {
+  const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+  char line[LOG_LINE_MAX];
+
+  if (dropped == _reported_dropped) {
+    return;
+  }
+  const size_t length = format_line(
+      line, Level::Warning, _writer_pid,
+      "Logger: " + std::to_string(dropped - _reported_dropped) +
+          " messages dropped, queue full");
+  _reported_dropped = dropped;
+  Socket::write(_fd, line, length);
+}
+
+void Logger::echo(Level level, const char *line, size_t length) const {
   if (level == Level::Error) {
-    std::cerr << log_level_to_color(level) << log_line_ss.str() << COLOR_RESET
-              << std::flush;
+    std::cerr << log_level_to_color(level);
+    std::cerr.write(line, static_cast<std::streamsize>(length));
+    std::cerr << COLOR_RESET << std::flush;
   }
 #ifdef LOG_TO_STDOUT
   else {
-    std::cout << log_level_to_color(level) << log_line_ss.str() << COLOR_RESET
-              << std::flush;
+    std::cout << log_level_to_color(level);
+    std::cout.write(line, static_cast<std::streamsize>(length));
+    std::cout << COLOR_RESET << std::flush;
   }
 #endif
 }
 
+/*
+ * The date only changes once per second, so each thread keeps it formatted
+ * instead of going through localtime (and its lock) for every line.
+ */
+size_t Logger::format_prefix(char *buffer, size_t size, Level level,
+                             pid_t pid) {
+  thread_local time_t cached_second = -1;
+  thread_local char cached_date[32];
+  const auto now = std::chrono::system_clock::now();
+  const time_t second = std::chrono::system_clock::to_time_t(now);
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now.time_since_epoch()) %
+                  1000;
+
+  if (second != cached_second) {
+    struct tm local_time;
+    localtime_r(&second, &local_time);
+    strftime(cached_date, sizeof(cached_date), "%Y-%m-%d %H:%M:%S",
+             &local_time);
+    cached_second = second;
+  }
+  const int ret =
+      snprintf(buffer, size, "[%s.%03d] [%s] [pid=%d] ", cached_date,
+               static_cast<int>(ms.count()), log_level_to_str(level), pid);
+  return std::min(static_cast<size_t>(ret), size - 1);
+}
+
+/*
+ * Format a whole line into a LOG_LINE_MAX buffer. Longer messages are
+ * truncated and end with "...".
+ */
+size_t Logger::format_line(char *buffer, Level level, pid_t pid,
+                           const std::string &message) {
+  size_t length = format_prefix(buffer, LOG_LINE_MAX, level, pid);
+  const size_t copied = std::min(message.size(), LOG_LINE_MAX - 1 - length);
+
+  memcpy(buffer + length, message.data(), copied);
+  length += copied;
+  if (copied < message.size()) {
+    memcpy(buffer + length - 3, "...", 3);
+  }
+  if (buffer[length - 1] != '\n') {
+    buffer[length++] = '\n';
+  }
+  return length;
+}
+
 void Logger::debug(const std::string &message) { log(Level::Debug, message); }
 
 void Logger::info(const std::string &message) { log(Level::Info, message); }
@@ -111,22 +377,20 @@ std::string Logger::log_level_to_color(Level level) const {
 }
 
 std::ostream &operator<<(std::ostream &os, const Logger::Level &level) {
+  return os << log_level_to_str(level);
+}
+
+static const char *log_level_to_str(Logger::Level level) {
   switch (level) {
   case Logger::Level::Debug:
-    os << "DEBUG";
-    break;
+    return "DEBUG";
   case Logger::Level::Info:
-    os << "INFO";
-    break;
+    return "INFO";
   case Logger::Level::Warning:
-    os << "WARNING";
-    break;
+    return "WARNING";
   case Logger::Level::Error:
-    os << "ERROR";
-    break;
+    return "ERROR";
   default:
-    os << "UNKNOWN";
-    break;
+    return "UNKNOWN";
   }
-  return os;
 }
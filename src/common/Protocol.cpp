@@ -0,0 +1,78 @@
+#include "common/Protocol.hpp"
+
+#include <cstring>
+#include <stdexcept>
+extern "C" {
+#include <arpa/inet.h>
+}
+
+void encode_frame_header(char *header, const FrameType type,
+                         const uint32_t request_id, const size_t length) {
+  const uint32_t net_length = htonl(static_cast<uint32_t>(length));
+  const uint32_t net_request_id = htonl(request_id);
+
+  std::memcpy(header, &net_length, sizeof(net_length));
+  std::memcpy(header + 4, &net_request_id, sizeof(net_request_id));
+  header[8] = static_cast<char>(type);
+}
+
+std::string encode_frame(const FrameType type, const uint32_t request_id,
+                         const std::string &payload) {
+  std::string frame(FRAME_HEADER_SIZE, '\0');
+
+  encode_frame_header(frame.data(), type, request_id, payload.size());
+  frame += payload;
+  return frame;
+}
+
+FrameDecoder::FrameDecoder() : _offset(0) {}
+
+void FrameDecoder::feed(const char *data, const size_t size) {
+  // Drop the frames already decoded before the buffer grows
+  if (_offset != 0) {
+    _buffer.erase(0, _offset);
+    _offset = 0;
+  }
+  _buffer.append(data, size);
+}
+
+/**
+ * @brief Extract the next complete frame from the buffered data.
+ *
+ * @return false if more data is needed
+ * @throws std::runtime_error if the stream is not made of valid frames
+ */
+bool FrameDecoder::next_frame(frame_t &frame) {
+  uint32_t length;
+  uint32_t request_id;
+
+  if (_buffer.size() - _offset < FRAME_HEADER_SIZE) {
+    return false;
+  }
+  const char *header = _buffer.data() + _offset;
+  std::memcpy(&length, header, sizeof(length));
+  std::memcpy(&request_id, header + 4, sizeof(request_id));
+  length = ntohl(length);
+  const auto type = static_cast<uint8_t>(header[8]);
+  if (length > FRAME_MAX_PAYLOAD) {
+    throw std::runtime_error("next_frame: frame too large (" +
+                             std::to_string(length) + " bytes)");
+  }
+  if (type < static_cast<uint8_t>(FrameType::Request) ||
+      type > static_cast<uint8_t>(FrameType::End)) {
+    throw std::runtime_error("next_frame: unknown frame type " +
+                             std::to_string(type));
+  }
+  if (_buffer.size() - _offset < FRAME_HEADER_SIZE + length) {
+    return false;
+  }
+  frame.type = static_cast<FrameType>(type);
+  frame.request_id = ntohl(request_id);
+  frame.payload.assign(header + FRAME_HEADER_SIZE, length);
+  _offset += FRAME_HEADER_SIZE + length;
+  if (_offset == _buffer.size()) {
+    _buffer.clear();
+    _offset = 0;
+  }
+  return true;
+}
@@ -9,16 +9,25 @@
 #include <unistd.h>
 
 UnixSocket::UnixSocket(const std::string &path_name)
-    : Socket(socket(AF_UNIX, SOCK_STREAM, 0)) {
+    : Socket(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
   if (_fd == -1) {
-    Logger::get_instance().error(
+    LOG_ERROR(
         std::string("UnixSocket::UnixSocket(): socket creation failed: ") +
         strerror(errno));
     throw std::runtime_error(std::string("socket: ") + strerror(errno));
   }
-  Logger::get_instance().info(
-      "UnixSocket::UnixSocket(): Socket successfully created fd=" +
-      std::to_string(_fd));
+  LOG_INFO("UnixSocket::UnixSocket(): Socket successfully created fd=" +
+           std::to_string(_fd));
+  memset(&_addr, 0, sizeof(sockaddr_un));
+  _addr.sun_family = AF_UNIX;
+  strncpy(_addr.sun_path, path_name.c_str(), sizeof(_addr.sun_path) - 1);
+}
+
+/*
+ * Wrap a socket that is already open, bound to path_name.
+ */
+UnixSocket::UnixSocket(const int fd, const std::string &path_name)
+    : Socket(fd) {
   memset(&_addr, 0, sizeof(sockaddr_un));
   _addr.sun_family = AF_UNIX;
   strncpy(_addr.sun_path, path_name.c_str(), sizeof(_addr.sun_path) - 1);
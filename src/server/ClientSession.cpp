@@ -1,48 +1,298 @@
 #include "server/ClientSession.hpp"
 
+#include <algorithm>
 #include <common/Logger.hpp>
 #include <cstring>
 #include <stdexcept>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <utility>
 
-char ClientSession::_buffer[SOCKET_BUFFER_SIZE];
+char ClientSession::_buffer[CLIENT_READ_BUFFER_SIZE];
 
-ClientSession::ClientSession(const int client_fd)
-    : Socket(client_fd), _reload_request(false) {}
+ClientSession::ClientSession(const int client_fd, PollFds &poll_fds,
+                             const server_config_t &server_config)
+    : Socket(client_fd),
+      _poll_fds(&poll_fds),
+      _request_id(0),
+      _response_deferred(false),
+      _output_request_id(0),
+      _outbound_size(0),
+      _outbound_offset(0),
+      _max_outbound(server_config.client_queue_size),
+      _overflow_policy(server_config.client_overflow),
+      _dropped(0),
+      _closing(false) {}
 
-std::string ClientSession::recv_command() const {
-  std::string buffer_str;
-  ssize_t ret;
-  size_t endl_pos;
+/**
+ * @brief Read everything the client sent and decode the complete requests
+ *        in it. A partial request is kept until the rest of it is read.
+ *
+ * Reading until the socket is drained lets a client pipelining many
+ * requests have them all run in a single wakeup.
+ *
+ * @throws std::runtime_error if the client disconnected or did not speak the
+ *         protocol
+ */
+std::vector<frame_t> ClientSession::recv_requests() {
+  std::vector<frame_t> requests;
+  frame_t frame;
+  bool received = false;
 
-  ret = read(_buffer, sizeof(_buffer));
-  if (ret == -1) {
-    Logger::get_instance().error("Failed to read command from client fd=" +
-                                 std::to_string(_fd) + ": " + strerror(errno));
-    throw std::runtime_error("read_command()");
+  while (true) {
+    ssize_t ret = read(_buffer, sizeof(_buffer));
+    if (ret == -1) {
+      if (errno == EAGAIN) {
+        break;
+      }
+      LOG_ERROR("Failed to read command from client fd=" +
+                std::to_string(_fd) + ": " + strerror(errno));
+      throw std::runtime_error("recv_requests()");
+    }
+    if (ret == 0) {
+      // Run what was read first, the disconnection is seen on the next read
+      if (received) {
+        break;
+      }
+      throw std::runtime_error("client disconnected");
+    }
+    _decoder.feed(_buffer, ret);
+    received = true;
+    if (static_cast<size_t>(ret) < sizeof(_buffer)) {
+      break;
+    }
   }
-  if (ret == 0) {
-    throw std::runtime_error("client disconnected");
+  try {
+    while (_decoder.next_frame(frame)) {
+      if (frame.type != FrameType::Request) {
+        throw std::runtime_error("recv_requests: unexpected frame type");
+      }
+      LOG_INFO("Request " + std::to_string(frame.request_id) + " from fd=" +
+               std::to_string(_fd) + ": `" + frame.payload + '`');
+      requests.push_back(std::move(frame));
+    }
+  } catch (const std::runtime_error &e) {
+    LOG_WARN("Client fd=" + std::to_string(_fd) + ": " + e.what());
+    throw;
   }
-  buffer_str = std::string(_buffer, ret);
-  endl_pos = buffer_str.find('\n');
-  if (endl_pos != std::string::npos) {
-    buffer_str.erase(endl_pos);
+  return requests;
+}
+
+void ClientSession::begin_request(const uint32_t request_id) {
+  _request_id = request_id;
+  _response_deferred = false;
+}
+
+/**
+ * @brief Close the response to the current request, unless it was deferred.
+ */
+void ClientSession::end_request() {
+  if (!_response_deferred) {
+    end_response(_request_id);
+  }
+}
+
+/**
+ * @brief Leave the response to the current request open, it is completed
+ *        later with send_response() and end_response().
+ */
+void ClientSession::defer_response() {
+  _response_deferred = true;
+}
+
+/**
+ * @brief Send the response to the current request. Responses are never
+ *        dropped, whatever the overflow policy.
+ */
+void ClientSession::send_response(const std::string &response) {
+  send_response(_request_id, response);
+}
+
+void ClientSession::send_response(const uint32_t request_id,
+                                  const std::string &response) {
+  char header[FRAME_HEADER_SIZE];
+
+  for (size_t offset = 0; offset < response.size();
+       offset += FRAME_MAX_PAYLOAD) {
+    const size_t len = std::min<size_t>(response.size() - offset,
+                                        FRAME_MAX_PAYLOAD);
+    encode_frame_header(header, FrameType::Response, request_id, len);
+    struct iovec iov[2] = {
+        {header, FRAME_HEADER_SIZE},
+        {const_cast<char *>(response.data()) + offset, len},
+    };
+    enqueue(iov, 2, false);
+  }
+}
+
+void ClientSession::end_response(const uint32_t request_id) {
+  char header[FRAME_HEADER_SIZE];
+  struct iovec iov = {header, FRAME_HEADER_SIZE};
+
+  encode_frame_header(header, FrameType::End, request_id, 0);
+  enqueue(&iov, 1, false);
+}
+
+/**
+ * @brief Send the output of an attached process. It is subject to the
+ *        overflow policy once the outbound queue is full.
+ *
+ * Each call is queued as one frame, so dropping queued output never leaves
+ * a partial frame behind.
+ */
+void ClientSession::send_output(const struct iovec *iov, int iovcnt) {
+  char header[FRAME_HEADER_SIZE];
+  struct iovec framed[CLIENT_FLUSH_IOV_MAX];
+  size_t len = 0;
+
+  iovcnt = std::min(iovcnt, CLIENT_FLUSH_IOV_MAX - 1);
+  for (int i = 0; i < iovcnt; i++) {
+    framed[i + 1] = iov[i];
+    len += iov[i].iov_len;
+  }
+  encode_frame_header(header, FrameType::Output, _output_request_id, len);
+  framed[0] = {header, FRAME_HEADER_SIZE};
+  enqueue(framed, iovcnt + 1, true);
+}
+
+/**
+ * @brief Write as much of the outbound queue as the socket accepts.
+ *
+ * @return false if the client can no longer be written to
+ */
+bool ClientSession::flush() {
+  struct iovec iov[CLIENT_FLUSH_IOV_MAX];
+
+  while (!_outbound.empty()) {
+    int iovcnt = 0;
+    for (auto it = _outbound.begin();
+         it != _outbound.end() && iovcnt < CLIENT_FLUSH_IOV_MAX; ++it) {
+      const size_t offset = iovcnt == 0 ? _outbound_offset : 0;
+      iov[iovcnt++] = {it->data.data() + offset, it->data.size() - offset};
+    }
+    ssize_t ret = writev(_fd, iov, iovcnt);
+    if (ret == -1) {
+      return errno == EAGAIN;
+    }
+    _outbound_size -= ret;
+    _outbound_offset += ret;
+    while (!_outbound.empty() &&
+           _outbound_offset >= _outbound.front().data.size()) {
+      _outbound_offset -= _outbound.front().data.size();
+      _outbound.pop_front();
+    }
   }
-  Logger::get_instance().info("Read " + std::to_string(ret) +
-                              " bytes from fd=" + std::to_string(_fd) + ": `" +
-                              buffer_str + '`');
-  return buffer_str;
+  _poll_fds->modify_poll_fd(_fd, EPOLLIN);
+  return true;
+}
+
+uint32_t ClientSession::get_request_id() const { return _request_id; }
+
+uint32_t ClientSession::get_output_request_id() const {
+  return _output_request_id;
+}
+
+/**
+ * @brief Set the request the output of attached processes is sent for.
+ */
+void ClientSession::set_output_request(const uint32_t request_id) {
+  _output_request_id = request_id;
+}
+
+void ClientSession::set_server_config(const server_config_t &server_config) {
+  _max_outbound = server_config.client_queue_size;
+  _overflow_policy = server_config.client_overflow;
 }
 
-void ClientSession::send_response(const std::string &response) const {
-  if (write(response) == -1) {
-    throw std::runtime_error("send_response()");
+/*
+ * Write directly while nothing is queued, so the common case does not copy
+ * anything. Otherwise, the data goes after the queued one to keep the order.
+ */
+void ClientSession::enqueue(const struct iovec *iov, int iovcnt,
+                            bool droppable) {
+  size_t len = 0;
+  size_t sent = 0;
+
+  if (_closing) {
+    return;
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  if (_outbound.empty()) {
+    ssize_t ret = writev(_fd, iov, iovcnt);
+    if (ret == -1 && errno != EAGAIN) {
+      LOG_WARN("Client fd=" + std::to_string(_fd) + ": write failed: " +
+               strerror(errno));
+      close_session();
+      return;
+    }
+    sent = ret == -1 ? 0 : ret;
+    if (sent == len) {
+      return;
+    }
+  }
+  if (droppable && _outbound_size + len - sent > _max_outbound &&
+      !make_room(len - sent)) {
+    return;
+  }
+  chunk_t chunk = {{}, droppable && sent == 0};
+  chunk.data.reserve(len - sent);
+  for (int i = 0; i < iovcnt; i++) {
+    const size_t skip = std::min(sent, iov[i].iov_len);
+    chunk.data.append(static_cast<const char *>(iov[i].iov_base) + skip,
+                      iov[i].iov_len - skip);
+    sent -= skip;
   }
+  if (_outbound.empty()) {
+    _poll_fds->modify_poll_fd(_fd, EPOLLIN | EPOLLOUT);
+  }
+  _outbound_size += chunk.data.size();
+  _outbound.push_back(std::move(chunk));
 }
 
-bool ClientSession::get_reload_request() const { return _reload_request; }
+/*
+ * Apply the overflow policy before queueing len more bytes.
+ *
+ * Return true if the new data can be queued.
+ */
+bool ClientSession::make_room(size_t len) {
+  if (_overflow_policy == OverflowPolicy::Disconnect) {
+    LOG_WARN("Client fd=" + std::to_string(_fd) +
+             ": outbound queue full, disconnecting");
+    close_session();
+    return false;
+  }
+  if (_overflow_policy == OverflowPolicy::DropOldest && !_outbound.empty()) {
+    // The front chunk may be partially written already, keep it
+    for (auto it = _outbound.begin() + 1;
+         it != _outbound.end() && _outbound_size + len > _max_outbound;) {
+      if (!it->droppable) {
+        ++it;
+        continue;
+      }
+      _outbound_size -= it->data.size();
+      _dropped += it->data.size();
+      it = _outbound.erase(it);
+    }
+  }
+  if (_outbound_size + len <= _max_outbound) {
+    return true;
+  }
+  _dropped += len;
+  LOG_DEBUG("Client fd=" + std::to_string(_fd) + ": outbound queue full, " +
+            std::to_string(_dropped) + " bytes dropped");
+  return false;
+}
 
-void ClientSession::set_reload_request(const bool reload) {
-  _reload_request = reload;
+/*
+ * Shut the socket down so the event loop sees the client disconnect, and
+ * stop queueing anything for it in the meantime.
+ */
+void ClientSession::close_session() {
+  _closing = true;
+  _outbound.clear();
+  _outbound_size = 0;
+  _outbound_offset = 0;
+  shutdown(_fd, SHUT_RDWR);
 }
@@ -1,26 +1,38 @@
 #include "server/ConfigParser.hpp"
 
+#include "common/socket/UnixSocket.hpp"
 #include "common/utils.hpp"
 
+#include <algorithm>
+#include <arpa/inet.h>
 #include <csignal>
+#include <cstring>
 #include <filesystem>
+#include <thread>
 #include <unistd.h>
 #include <unordered_set>
 #include <yaml-cpp/yaml.h>
 
 #define PROCESS_NAME_MAX_LENGTH 64
+#define OUTPUT_BUFFER_DEFAULT_SIZE (64UL << 10)
+#define CLIENT_QUEUE_DEFAULT_SIZE (1UL << 20)
+
+extern char **environ; // envp
 
 static process_config_t parse_process_config(std::string &&name,
                                              const YAML::Node &config_node);
 static void parse_cmd(const YAML::Node &config_node,
                       process_config_t &process_config);
 static void parse_cmd_path(process_config_t &process_config);
+static void build_envp(process_config_t &process_config);
 static void parse_workingdir(const YAML::Node &config_node,
                              process_config_t &process_config);
 static void parse_stdout(const YAML::Node &config_node,
                          process_config_t &process_config);
 static void parse_stderr(const YAML::Node &config_node,
                          process_config_t &process_config);
+static void parse_output_buffer(const YAML::Node &config_node,
+                                process_config_t &process_config);
 static void parse_stopsignal(const YAML::Node &config_node,
                              process_config_t &process_config);
 static void parse_numprocs(const YAML::Node &config_node,
@@ -31,6 +43,10 @@ static void parse_startretries(const YAML::Node &config_node,
                                process_config_t &process_config);
 static void parse_stoptime(const YAML::Node &config_node,
                            process_config_t &process_config);
+static void parse_start_limits(const YAML::Node &config_node,
+                               process_config_t &process_config);
+static void parse_restart_batch(const YAML::Node &config_node,
+                                process_config_t &process_config);
 static void parse_umask(const YAML::Node &config_node,
                         process_config_t &process_config);
 static void parse_autostart(const YAML::Node &config_node,
@@ -41,6 +57,24 @@ static void parse_env(const YAML::Node &config_node,
                       process_config_t &process_config);
 static void parse_exitcodes(const YAML::Node &config_node,
                             process_config_t &process_config);
+static std::chrono::milliseconds parse_duration(const YAML::Node &node,
+                                                const std::string &field);
+static size_t parse_size(const YAML::Node &node, const std::string &field);
+static double parse_rate(const YAML::Node &node, const std::string &field);
+static void parse_client_queue_size(const YAML::Node &config_node,
+                                    server_config_t &server_config);
+static void parse_client_overflow(const YAML::Node &config_node,
+                                  server_config_t &server_config);
+static void parse_loglevel(const YAML::Node &config_node,
+                           server_config_t &server_config);
+static void parse_server_start_limits(const YAML::Node &config_node,
+                                      server_config_t &server_config);
+static void parse_workers(const YAML::Node &config_node,
+                          server_config_t &server_config);
+static void parse_sample_interval(const YAML::Node &config_node,
+                                  server_config_t &server_config);
+static void parse_metrics(const YAML::Node &config_node,
+                          server_config_t &server_config);
 static bool is_valid_process_name(const std::string &name);
 static bool is_directory(std::string path);
 static bool is_file_writeable(std::string path);
@@ -48,6 +82,10 @@ static bool is_file_writeable(std::string path);
 ConfigParser::ConfigParser(std::string config_path)
     : _config_path(std::move(config_path)) {}
 
+const std::string &ConfigParser::get_config_path() const {
+  return _config_path;
+}
+
 std::unordered_map<std::string, process_config_t> ConfigParser::parse() const {
   std::unordered_map<std::string, process_config_t> process_configs;
   std::unordered_set<std::string> seen_names;
@@ -78,6 +116,26 @@ std::unordered_map<std::string, process_config_t> ConfigParser::parse() const {
   return process_configs;
 }
 
+/**
+ * @brief Parse the optional `server` section, holding the daemon settings.
+ */
+server_config_t ConfigParser::parse_server() const {
+  server_config_t server_config;
+
+  YAML::Node root = YAML::LoadFile(_config_path);
+  const YAML::Node server_node =
+      root["server"] ? root["server"] : YAML::Node(YAML::NodeType::Map);
+
+  parse_client_queue_size(server_node, server_config);
+  parse_client_overflow(server_node, server_config);
+  parse_loglevel(server_node, server_config);
+  parse_server_start_limits(server_node, server_config);
+  parse_workers(server_node, server_config);
+  parse_sample_interval(server_node, server_config);
+  parse_metrics(server_node, server_config);
+  return server_config;
+}
+
 static process_config_t parse_process_config(std::string &&name,
                                              const YAML::Node &config_node) {
   process_config_t process_config;
@@ -86,20 +144,24 @@ static process_config_t parse_process_config(std::string &&name,
   process_config.cmd =
       std::unique_ptr<wordexp_t, WordexpDestructor>(new wordexp_t);
   parse_cmd(config_node, process_config);
-  parse_cmd_path(process_config);
   parse_workingdir(config_node, process_config);
   parse_stdout(config_node, process_config);
   parse_stderr(config_node, process_config);
+  parse_output_buffer(config_node, process_config);
   parse_stopsignal(config_node, process_config);
   parse_numprocs(config_node, process_config);
   parse_starttime(config_node, process_config);
   parse_startretries(config_node, process_config);
   parse_stoptime(config_node, process_config);
+  parse_start_limits(config_node, process_config);
+  parse_restart_batch(config_node, process_config);
   parse_umask(config_node, process_config);
   parse_autostart(config_node, process_config);
   parse_autorestart(config_node, process_config);
   parse_env(config_node, process_config);
   parse_exitcodes(config_node, process_config);
+  build_envp(process_config);
+  parse_cmd_path(process_config);
   return process_config;
 }
 
@@ -125,7 +187,12 @@ static void parse_cmd_path(process_config_t &process_config) {
     return;
   }
 
-  char *env_path = std::getenv("PATH");
+  const char *env_path = nullptr;
+  for (const char *entry : process_config.envp) {
+    if (entry != nullptr && strncmp(entry, "PATH=", 5) == 0) {
+      env_path = entry + 5;
+    }
+  }
   if (env_path == nullptr) {
     throw std::runtime_error("Error: please define the PATH env variable");
   }
@@ -141,6 +208,37 @@ static void parse_cmd_path(process_config_t &process_config) {
   throw std::runtime_error("Error: command not found: " + cmd);
 }
 
+/*
+ * The environment of the daemon, overridden by the one from the config. The
+ * command is looked up in the PATH of this environment.
+ */
+static void build_envp(process_config_t &process_config) {
+  std::vector<std::string> &entries = process_config.envp_entries;
+
+  for (char **entry = environ; *entry != nullptr; entry++) {
+    const char *separator = strchr(*entry, '=');
+    const size_t name_len =
+        separator ? static_cast<size_t>(separator - *entry) : strlen(*entry);
+    const bool overridden = std::any_of(
+        process_config.env.begin(), process_config.env.end(),
+        [&](const std::pair<std::string, std::string> &override) {
+          return override.first.size() == name_len &&
+                 override.first.compare(0, name_len, *entry, name_len) == 0;
+        });
+    if (!overridden) {
+      entries.emplace_back(*entry);
+    }
+  }
+  for (const auto &[name, value] : process_config.env) {
+    entries.push_back(name + '=' + value);
+  }
+  process_config.envp.reserve(entries.size() + 1);
+  for (std::string &entry : entries) {
+    process_config.envp.push_back(entry.data());
+  }
+  process_config.envp.push_back(nullptr);
+}
+
 static void parse_workingdir(const YAML::Node &config_node,
                              process_config_t &process_config) {
   if (config_node["workingdir"]) {
@@ -176,6 +274,14 @@ static void parse_stderr(const YAML::Node &config_node,
   }
 }
 
+static void parse_output_buffer(const YAML::Node &config_node,
+                                process_config_t &process_config) {
+  process_config.output_buffer =
+      config_node["output_buffer"]
+          ? parse_size(config_node["output_buffer"], "output_buffer")
+          : OUTPUT_BUFFER_DEFAULT_SIZE;
+}
+
 static void parse_stopsignal(const YAML::Node &config_node,
                              process_config_t &process_config) {
   if (!config_node["stopsignal"]) {
@@ -212,9 +318,10 @@ static void parse_numprocs(const YAML::Node &config_node,
 
 static void parse_starttime(const YAML::Node &config_node,
                             process_config_t &process_config) {
-  process_config.starttime = config_node["starttime"]
-                                 ? config_node["starttime"].as<unsigned long>()
-                                 : 0;
+  process_config.starttime =
+      config_node["starttime"]
+          ? parse_duration(config_node["starttime"], "starttime")
+          : std::chrono::milliseconds(0);
 }
 
 static void parse_startretries(const YAML::Node &config_node,
@@ -228,12 +335,46 @@ static void parse_startretries(const YAML::Node &config_node,
 static void parse_stoptime(const YAML::Node &config_node,
                            process_config_t &process_config) {
   process_config.stoptime =
-      config_node["stoptime"] ? config_node["stoptime"].as<unsigned long>() : 3;
-  if (process_config.stoptime == 0) {
+      config_node["stoptime"]
+          ? parse_duration(config_node["stoptime"], "stoptime")
+          : std::chrono::seconds(3);
+  if (process_config.stoptime.count() == 0) {
     throw std::runtime_error("ProgramConfig: Invalid stoptime value (0)");
   }
 }
 
+/*
+ * 0 (the default) leaves starts of the group unlimited, the global limits from
+ * the server section still apply.
+ */
+static void parse_start_limits(const YAML::Node &config_node,
+                               process_config_t &process_config) {
+  process_config.max_concurrent_starts =
+      config_node["max_concurrent_starts"]
+          ? config_node["max_concurrent_starts"].as<unsigned long>()
+          : 0;
+  process_config.start_rate =
+      config_node["start_rate"]
+          ? parse_rate(config_node["start_rate"], "start_rate")
+          : 0;
+  process_config.start_jitter =
+      config_node["start_jitter"]
+          ? parse_duration(config_node["start_jitter"], "start_jitter")
+          : std::chrono::milliseconds(0);
+}
+
+/*
+ * Number of instances `restart` restarts at a time, each batch once the
+ * previous one is running. 0 (the default) restarts them all at once.
+ */
+static void parse_restart_batch(const YAML::Node &config_node,
+                                process_config_t &process_config) {
+  process_config.restart_batch =
+      config_node["restart_batch"]
+          ? config_node["restart_batch"].as<unsigned long>()
+          : 0;
+}
+
 static void parse_umask(const YAML::Node &config_node,
                         process_config_t &process_config) {
   process_config.umask =
@@ -293,6 +434,197 @@ static void parse_exitcodes(const YAML::Node &config_node,
   }
 }
 
+static void parse_client_queue_size(const YAML::Node &config_node,
+                                    server_config_t &server_config) {
+  server_config.client_queue_size =
+      config_node["client_queue_size"]
+          ? parse_size(config_node["client_queue_size"], "client_queue_size")
+          : CLIENT_QUEUE_DEFAULT_SIZE;
+  if (server_config.client_queue_size == 0) {
+    throw std::runtime_error("ServerConfig: Invalid client_queue_size value "
+                             "(0)");
+  }
+}
+
+static void parse_client_overflow(const YAML::Node &config_node,
+                                  server_config_t &server_config) {
+  if (!config_node["client_overflow"]) {
+    server_config.client_overflow = OverflowPolicy::DropOldest;
+    return;
+  }
+  std::string value = config_node["client_overflow"].as<std::string>();
+  std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+  if (value == "drop_oldest") {
+    server_config.client_overflow = OverflowPolicy::DropOldest;
+  } else if (value == "drop_newest") {
+    server_config.client_overflow = OverflowPolicy::DropNewest;
+  } else if (value == "disconnect") {
+    server_config.client_overflow = OverflowPolicy::Disconnect;
+  } else {
+    throw std::runtime_error("ServerConfig: Invalid client_overflow value (" +
+                             value + ")");
+  }
+}
+
+static void parse_loglevel(const YAML::Node &config_node,
+                           server_config_t &server_config) {
+  if (!config_node["loglevel"]) {
+    server_config.loglevel = Logger::Level::Debug;
+    return;
+  }
+  const std::string value = config_node["loglevel"].as<std::string>();
+  if (!Logger::parse_level(value, server_config.loglevel)) {
+    throw std::runtime_error("ServerConfig: Invalid loglevel value (" + value +
+                             ")");
+  }
+}
+
+static void parse_server_start_limits(const YAML::Node &config_node,
+                                      server_config_t &server_config) {
+  server_config.max_concurrent_starts =
+      config_node["max_concurrent_starts"]
+          ? config_node["max_concurrent_starts"].as<unsigned long>()
+          : 0;
+  server_config.start_rate =
+      config_node["start_rate"]
+          ? parse_rate(config_node["start_rate"], "start_rate")
+          : 0;
+}
+
+/*
+ * Number of threads running the FSM, one per CPU by default.
+ */
+static void parse_workers(const YAML::Node &config_node,
+                          server_config_t &server_config) {
+  server_config.workers =
+      config_node["workers"]
+          ? config_node["workers"].as<unsigned long>()
+          : std::max(1U, std::thread::hardware_concurrency());
+  if (server_config.workers == 0) {
+    throw std::runtime_error("ServerConfig: Invalid workers value (0)");
+  }
+}
+
+static void parse_sample_interval(const YAML::Node &config_node,
+                                  server_config_t &server_config) {
+  server_config.sample_interval =
+      config_node["sample_interval"]
+          ? parse_duration(config_node["sample_interval"], "sample_interval")
+          : std::chrono::seconds(5);
+}
+
+/*
+ * The metrics are served either on a unix socket, given as an absolute path,
+ * or on a TCP port of the loopback interface, given as `127.0.0.1:9464` or
+ * `localhost:9464`: they are not meant to be exposed on the network.
+ */
+static void parse_metrics(const YAML::Node &config_node,
+                          server_config_t &server_config) {
+  if (!config_node["metrics"]) {
+    server_config.metrics.clear();
+    return;
+  }
+  const std::string value = config_node["metrics"].as<std::string>();
+  if (value.empty() || value.front() == '/') {
+    if (value == SOCKET_PATH_NAME) {
+      throw std::runtime_error("ServerConfig: Invalid metrics value (" +
+                               value + "), it is the control socket");
+    }
+    server_config.metrics = value;
+    return;
+  }
+  const size_t colon = value.rfind(':');
+  const std::string host = value.substr(0, colon);
+  const std::string port =
+      colon == std::string::npos ? "" : value.substr(colon + 1);
+  struct in_addr addr;
+  if (port.empty() || port.size() > 5 ||
+      !std::all_of(port.begin(), port.end(), ::isdigit) ||
+      std::stoul(port) == 0 || std::stoul(port) > 65535 ||
+      (host != "localhost" &&
+       (inet_pton(AF_INET, host.c_str(), &addr) != 1 ||
+        (ntohl(addr.s_addr) >> 24) != 127))) {
+    throw std::runtime_error("ServerConfig: Invalid metrics value (" + value +
+                             "), expected a socket path or a loopback "
+                             "host:port");
+  }
+  server_config.metrics = value;
+}
+
+/**
+ * @brief Parse a duration such as `250ms` or `2s`. A bare number is a number
+ * of seconds.
+ */
+static std::chrono::milliseconds parse_duration(const YAML::Node &node,
+                                                const std::string &field) {
+  const std::string value = node.as<std::string>();
+  size_t unit_pos = 0;
+
+  while (unit_pos < value.size() && std::isdigit(value[unit_pos])) {
+    unit_pos++;
+  }
+  const std::string unit = value.substr(unit_pos);
+  if (unit_pos == 0 || (!unit.empty() && unit != "s" && unit != "ms")) {
+    throw std::runtime_error("ProgramConfig: Invalid " + field + " value (" +
+                             value + ")");
+  }
+  const unsigned long count = std::stoul(value.substr(0, unit_pos));
+  if (unit == "ms") {
+    return std::chrono::milliseconds(count);
+  }
+  return std::chrono::seconds(count);
+}
+
+/**
+ * @brief Parse a size such as `256KiB` or `1MiB`. A bare number is a number
+ * of bytes.
+ */
+static size_t parse_size(const YAML::Node &node, const std::string &field) {
+  static const std::unordered_map<std::string, size_t> units = {
+      {"", 1},
+      {"B", 1},
+      {"K", 1UL << 10},
+      {"KiB", 1UL << 10},
+      {"M", 1UL << 20},
+      {"MiB", 1UL << 20},
+  };
+  const std::string value = node.as<std::string>();
+  size_t unit_pos = 0;
+
+  while (unit_pos < value.size() && std::isdigit(value[unit_pos])) {
+    unit_pos++;
+  }
+  const auto unit = units.find(value.substr(unit_pos));
+  if (unit_pos == 0 || unit == units.end()) {
+    throw std::runtime_error("Config: Invalid " + field + " value (" +
+                             value + ")");
+  }
+  return std::stoul(value.substr(0, unit_pos)) * unit->second;
+}
+
+/**
+ * @brief Parse a rate such as `20/s` or `300/m` into a number of events per
+ * second. A bare number is per second.
+ */
+static double parse_rate(const YAML::Node &node, const std::string &field) {
+  const std::string value = node.as<std::string>();
+  size_t unit_pos = 0;
+  double count;
+
+  try {
+    count = std::stod(value, &unit_pos);
+  } catch (const std::exception &) {
+    unit_pos = 0;
+  }
+  const std::string unit = value.substr(unit_pos);
+  if (unit_pos == 0 || !(count >= 0) ||
+      (!unit.empty() && unit != "/s" && unit != "/m")) {
+    throw std::runtime_error("Config: Invalid " + field + " value (" + value +
+                             ")");
+  }
+  return unit == "/m" ? count / 60 : count;
+}
+
 static bool is_valid_process_name(const std::string &name) {
   if (name.empty() && name.size() <= PROCESS_NAME_MAX_LENGTH) {
     return false;
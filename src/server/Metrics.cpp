@@ -0,0 +1,165 @@
+#include "server/Metrics.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iterator>
+#include <sstream>
+
+#define METRICS_PREFIX "taskmasterd_program_"
+
+static void write_family(std::ostream &os, const std::string &name,
+                         const char *type, const char *help);
+static std::string format_seconds(uint64_t microseconds);
+
+Histogram::Histogram(std::initializer_list<double> bounds)
+    : _buckets(new std::atomic<uint64_t>[bounds.size() + 1]), _sum(0) {
+  for (double bound : bounds) {
+    _bounds.push_back(static_cast<uint64_t>(bound * 1000000));
+  }
+  for (size_t i = 0; i <= _bounds.size(); i++) {
+    _buckets[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::observe(const std::chrono::microseconds duration) {
+  const uint64_t value =
+      static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+  size_t bucket = 0;
+
+  while (bucket < _bounds.size() && value > _bounds[bucket]) {
+    bucket++;
+  }
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+/*
+ * The buckets are stored apart and summed up here into the cumulative
+ * buckets of the exposition format, so _count always matches +Inf.
+ */
+void Histogram::write(std::ostream &os, const std::string &name,
+                      const std::string &labels) const {
+  uint64_t count = 0;
+
+  for (size_t i = 0; i <= _bounds.size(); i++) {
+    count += _buckets[i].load(std::memory_order_relaxed);
+    os << name << "_bucket{" << labels << ",le=\"";
+    if (i == _bounds.size()) {
+      os << "+Inf";
+    } else {
+      os << format_seconds(_bounds[i]);
+    }
+    os << "\"} " << count << '\n';
+  }
+  os << name << "_sum{" << labels << "} "
+     << format_seconds(_sum.load(std::memory_order_relaxed)) << '\n'
+     << name << "_count{" << labels << "} " << count << '\n';
+}
+
+/**
+ * @brief Write the metrics in the Prometheus text exposition format, every
+ *        sample of a family following its HELP and TYPE lines.
+ *
+ * Program names are made of alphanumerics and underscores, so they need no
+ * escaping as label values.
+ */
+std::string
+render_metrics(const std::vector<program_metrics_view_t> &programs) {
+  static const struct {
+    const char *name;
+    const char *help;
+    std::atomic<uint64_t> program_metrics_t::*counter;
+  } counters[] = {
+      {"starts_total", "Processes spawned", &program_metrics_t::starts},
+      {"restarts_total", "Processes spawned again after they exited",
+       &program_metrics_t::restarts},
+      {"unexpected_exits_total",
+       "Exits with an unexpected status code or signal",
+       &program_metrics_t::unexpected_exits},
+      {"aborts_total", "Processes given up after startretries failed starts",
+       &program_metrics_t::aborts},
+  };
+  std::ostringstream oss;
+
+  for (const auto &counter : counters) {
+    const std::string name = std::string(METRICS_PREFIX) + counter.name;
+    write_family(oss, name, "counter", counter.help);
+    for (const program_metrics_view_t &program : programs) {
+      oss << name << "{program=\"" << program.name << "\"} "
+          << (program.metrics->*counter.counter)
+                 .load(std::memory_order_relaxed)
+          << '\n';
+    }
+  }
+  write_family(oss, METRICS_PREFIX "output_bytes_total", "counter",
+               "Bytes of output forwarded");
+  for (const program_metrics_view_t &program : programs) {
+    oss << METRICS_PREFIX "output_bytes_total{program=\"" << program.name
+        << "\",stream=\"stdout\"} "
+        << program.metrics->stdout_bytes.load(std::memory_order_relaxed)
+        << '\n'
+        << METRICS_PREFIX "output_bytes_total{program=\"" << program.name
+        << "\",stream=\"stderr\"} "
+        << program.metrics->stderr_bytes.load(std::memory_order_relaxed)
+        << '\n';
+  }
+  write_family(oss, METRICS_PREFIX "processes", "gauge",
+               "Processes in each state");
+  for (const program_metrics_view_t &program : programs) {
+    for (size_t state = 0; state < std::size(program.states); state++) {
+      std::string state_name =
+          process_state_str(static_cast<Process::State>(state));
+      // `(Running)` becomes `running`
+      state_name = state_name.substr(1, state_name.size() - 2);
+      state_name[0] = static_cast<char>(std::tolower(state_name[0]));
+      oss << METRICS_PREFIX "processes{program=\"" << program.name
+          << "\",state=\"" << state_name << "\"} " << program.states[state]
+          << '\n';
+    }
+  }
+  write_family(oss, METRICS_PREFIX "attached_clients", "gauge",
+               "Clients attached to the output of the processes");
+  for (const program_metrics_view_t &program : programs) {
+    oss << METRICS_PREFIX "attached_clients{program=\"" << program.name
+        << "\"} " << program.attached_clients << '\n';
+  }
+  write_family(oss, METRICS_PREFIX "spawn_duration_seconds", "histogram",
+               "Time from the clone() of a process to its execve()");
+  for (const program_metrics_view_t &program : programs) {
+    program.metrics->spawn_latency.write(
+        oss, METRICS_PREFIX "spawn_duration_seconds",
+        "program=\"" + program.name + '"');
+  }
+  write_family(oss, METRICS_PREFIX "stop_duration_seconds", "histogram",
+               "Time from the stop signal of a process to its exit");
+  for (const program_metrics_view_t &program : programs) {
+    program.metrics->stop_latency.write(
+        oss, METRICS_PREFIX "stop_duration_seconds",
+        "program=\"" + program.name + '"');
+  }
+  return oss.str();
+}
+
+static void write_family(std::ostream &os, const std::string &name,
+                         const char *type, const char *help) {
+  os << "# HELP " << name << ' ' << help << '\n'
+     << "# TYPE " << name << ' ' << type << '\n';
+}
+
+/*
+ * @return microseconds as seconds, without the trailing zeros
+ */
+static std::string format_seconds(const uint64_t microseconds) {
+  char buffer[32];
+
+  snprintf(buffer, sizeof(buffer), "%llu.%06llu",
+           static_cast<unsigned long long>(microseconds / 1000000),
+           static_cast<unsigned long long>(microseconds % 1000000));
+  std::string seconds(buffer);
+  seconds.erase(seconds.find_last_not_of('0') + 1);
+  if (seconds.back() == '.') {
+    seconds.pop_back();
+  }
+  return seconds;
+}
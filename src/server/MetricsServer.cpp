@@ -0,0 +1,220 @@
+#include "server/MetricsServer.hpp"
+
+#include "common/Logger.hpp"
+#include "common/socket/UnixSocket.hpp"
+#include <cstring>
+#include <stdexcept>
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+static int listen_unix(const std::string &path);
+static int listen_tcp(const std::string &address);
+
+/**
+ * @param address a unix socket path, or a loopback host:port, as validated
+ *        by the config parser
+ * @param render called for each scrape
+ */
+MetricsServer::MetricsServer(const std::string &address, PollFds &poll_fds,
+                             render_t render)
+    : _address(address),
+      _fd(-1),
+      _poll_fds(poll_fds),
+      _render(std::move(render)) {
+  if (address.front() == '/') {
+    _fd = listen_unix(address);
+    _unix_path = address;
+  } else {
+    _fd = listen_tcp(address);
+  }
+  _poll_fds.add_poll_fd(_fd, EPOLLIN,
+                        {PollFds::FdType::MetricsServer, this});
+  LOG_INFO("Serving metrics on " + address + " (fd=" + std::to_string(_fd) +
+           ")");
+}
+
+MetricsServer::~MetricsServer() {
+  while (!_connections.empty()) {
+    close_connection(_connections.begin()->first);
+  }
+  _poll_fds.remove_poll_fd(_fd);
+  close(_fd);
+  if (!_unix_path.empty()) {
+    unlink(_unix_path.c_str());
+  }
+}
+
+void MetricsServer::accept_connection() {
+  const int fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (fd == -1) {
+    LOG_WARN(std::string("MetricsServer: accept4: ") + strerror(errno));
+    return;
+  }
+  if (_connections.size() >= METRICS_MAX_CONNECTIONS) {
+    LOG_WARN("MetricsServer: too many connections, closing fd=" +
+             std::to_string(fd));
+    close(fd);
+    return;
+  }
+  _connections.emplace(fd, connection_t{"", "", 0});
+  _poll_fds.add_poll_fd(fd, EPOLLIN, {PollFds::FdType::MetricsClient, this});
+}
+
+/*
+ * Read the request until its blank line, then write the response as the
+ * socket accepts it.
+ */
+void MetricsServer::handle_connection(const PollFds::event_t &event) {
+  const int fd = event.entry->fd;
+  const auto it = _connections.find(fd);
+  char buffer[SOCKET_BUFFER_SIZE];
+
+  if (it == _connections.end()) {
+    return;
+  }
+  connection_t &connection = it->second;
+  if (event.events & EPOLLOUT) {
+    if (!flush(fd, connection)) {
+      close_connection(fd);
+    }
+    return;
+  }
+  if (event.events & EPOLLIN) {
+    const ssize_t ret = read(fd, buffer, sizeof(buffer));
+    if (ret <= 0) {
+      if (ret == 0 || errno != EAGAIN) {
+        close_connection(fd);
+      }
+      return;
+    }
+    connection.request.append(buffer, ret);
+    if (connection.request.find("\r\n\r\n") != std::string::npos ||
+        connection.request.find("\n\n") != std::string::npos) {
+      respond(fd, connection);
+    } else if (connection.request.size() > METRICS_MAX_REQUEST_SIZE) {
+      close_connection(fd);
+    }
+  } else if (event.events & (EPOLLHUP | EPOLLERR)) {
+    close_connection(fd);
+  }
+}
+
+const std::string &MetricsServer::get_address() const { return _address; }
+
+void MetricsServer::respond(const int fd, connection_t &connection) {
+  const std::string &request = connection.request;
+  const size_t path_end = request.find(' ', 4);
+  const std::string path =
+      path_end == std::string::npos ? "" : request.substr(4, path_end - 4);
+  std::string status = "200 OK";
+  std::string body;
+
+  if (request.compare(0, 4, "GET ") != 0) {
+    status = "405 Method Not Allowed";
+  } else if (path != "/metrics" && path != "/") {
+    status = "404 Not Found";
+  } else {
+    body = _render();
+  }
+  connection.response = "HTTP/1.0 " + status +
+                        "\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: " +
+                        std::to_string(body.size()) +
+                        "\r\n"
+                        "Connection: close\r\n\r\n" +
+                        body;
+  if (!flush(fd, connection)) {
+    close_connection(fd);
+  } else {
+    _poll_fds.modify_poll_fd(fd, EPOLLOUT);
+  }
+}
+
+/*
+ * @return false once the response is fully sent, or on error
+ */
+bool MetricsServer::flush(const int fd, connection_t &connection) {
+  while (connection.sent < connection.response.size()) {
+    const ssize_t ret =
+        send(fd, connection.response.data() + connection.sent,
+             connection.response.size() - connection.sent, MSG_NOSIGNAL);
+    if (ret == -1) {
+      return errno == EAGAIN;
+    }
+    connection.sent += ret;
+  }
+  return false;
+}
+
+void MetricsServer::close_connection(const int fd) {
+  _poll_fds.remove_poll_fd(fd);
+  close(fd);
+  _connections.erase(fd);
+}
+
+static int listen_unix(const std::string &path) {
+  sockaddr_un addr = {};
+  struct stat st;
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    close(fd);
+    throw std::runtime_error("MetricsServer: socket path too long");
+  }
+  std::strcpy(addr.sun_path, path.c_str());
+  // Only a socket left by a previous daemon is replaced, never another file
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      close(fd);
+      throw std::runtime_error("MetricsServer: `" + path +
+                               "` exists and is not a socket");
+    }
+    unlink(path.c_str());
+  }
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 ||
+      ::listen(fd, BACKLOG) == -1) {
+    const int error = errno;
+    close(fd);
+    throw std::runtime_error(std::string("MetricsServer: ") + strerror(error));
+  }
+  return fd;
+}
+
+static int listen_tcp(const std::string &address) {
+  const size_t colon = address.rfind(':');
+  std::string host = address.substr(0, colon);
+  sockaddr_in addr = {};
+  const int enable = 1;
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+  if (host == "localhost") {
+    host = "127.0.0.1";
+  }
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(std::stoul(address.substr(colon + 1)));
+  inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+  // A `reexec` binds again right after the previous daemon closed it
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 ||
+      ::listen(fd, BACKLOG) == -1) {
+    const int error = errno;
+    close(fd);
+    throw std::runtime_error(std::string("MetricsServer: ") + strerror(error));
+  }
+  return fd;
+}
@@ -0,0 +1,56 @@
+#include "server/OutputBuffer.hpp"
+
+#include <algorithm>
+
+OutputBuffer::OutputBuffer(size_t capacity)
+    : _data(capacity), _head(0), _size(0) {}
+
+/**
+ * @brief Describe the next len bytes of the ring, overwriting the oldest
+ *        output once it is full.
+ *
+ * @param iov filled with the regions to read into, the second one is only
+ * used when the ring wraps around
+ * @param len number of bytes to reserve, at most the capacity
+ * @return the number of iovec filled
+ */
+int OutputBuffer::reserve(struct iovec (&iov)[2], size_t len) {
+  const size_t first = std::min(len, _data.size() - _head);
+
+  iov[0] = {_data.data() + _head, first};
+  if (first == len) {
+    return 1;
+  }
+  iov[1] = {_data.data(), len - first};
+  return 2;
+}
+
+/**
+ * @brief Mark len bytes of the last reserve() as written.
+ */
+void OutputBuffer::commit(size_t len) {
+  _head = (_head + len) % _data.size();
+  _size = std::min(_size + len, _data.size());
+}
+
+/**
+ * @brief Return the last bytes of output, oldest first.
+ */
+std::string OutputBuffer::tail(size_t bytes) const {
+  const size_t len = std::min(bytes, _size);
+  if (len == 0) {
+    return {};
+  }
+  const size_t start = (_head + _data.size() - len) % _data.size();
+  const size_t first = std::min(len, _data.size() - start);
+  std::string output;
+
+  output.reserve(len);
+  output.append(_data.data() + start, first);
+  output.append(_data.data(), len - first);
+  return output;
+}
+
+size_t OutputBuffer::get_capacity() const { return _data.size(); }
+
+size_t OutputBuffer::get_size() const { return _size; }
@@ -2,58 +2,148 @@
 
 #include "common/Logger.hpp"
 
-#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <unistd.h>
 
-PollFds::PollFds() {}
+PollFds::PollFds() : _epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {
+  if (_epoll_fd == -1) {
+    throw std::runtime_error(std::string("epoll_create1: ") +
+                             strerror(errno));
+  }
+}
+
+PollFds::~PollFds() { close(_epoll_fd); }
 
-void PollFds::add_poll_fd(pollfd fd, metadata_t metadata) {
+/**
+ * @brief Register fd in the epoll set.
+ *
+ * @param events epoll events to watch (add EPOLLET for edge-triggered fds,
+ *               whose handler must drain them until EAGAIN)
+ * @param metadata the fd type and its owning object, handed back with every
+ *                 event of this fd
+ */
+void PollFds::add_poll_fd(int fd, uint32_t events, metadata_t metadata) {
   std::lock_guard lock(_mutex);
-  const auto it =
-      std::find_if(_poll_fds.begin(), _poll_fds.end(),
-                   [fd](pollfd poll_fd) { return fd.fd == poll_fd.fd; });
-  if (it != _poll_fds.end()) {
-    Logger::get_instance().warn("add_poll_fd: fd=" + std::to_string(fd.fd) +
-                                " already in _poll_fds");
-  }
-  Logger::get_instance().info("Add fd=" + std::to_string(fd.fd) +
-                              " to poll_fds");
-  _poll_fds.emplace_back(fd);
-  _metadata.emplace_back(metadata);
+  if (_entries.find(fd) != _entries.end()) {
+    LOG_WARN("add_poll_fd: fd=" + std::to_string(fd) + " already in _poll_fds");
+    return;
+  }
+  auto entry = std::unique_ptr<entry_t>(
+      new entry_t{fd, events, metadata, {false}, false});
+  epoll_event event = {};
+  event.events = events;
+  event.data.ptr = entry.get();
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    throw std::runtime_error("add_poll_fd(): epoll_ctl fd=" +
+                             std::to_string(fd) + ": " + strerror(errno));
+  }
+  LOG_INFO("Add fd=" + std::to_string(fd) + " to poll_fds");
+  _entries.emplace(fd, std::move(entry));
 }
 
+/**
+ * @note Must be called before fd is closed. The entry stays readable until
+ * the next wait(), so events of the current batch can still be checked
+ * against entry_t::removed.
+ */
 void PollFds::remove_poll_fd(const int fd) {
   std::lock_guard lock(_mutex);
-  const auto it =
-      std::find_if(_poll_fds.begin(), _poll_fds.end(),
-                   [fd](pollfd poll_fd) { return fd == poll_fd.fd; });
-  if (it == _poll_fds.end()) {
+  const auto it = _entries.find(fd);
+  if (it == _entries.end()) {
     throw std::invalid_argument("remove_poll_fd(): invalid fd=" +
                                 std::to_string(fd));
   }
-  Logger::get_instance().info("Remove fd=" + std::to_string(fd) +
-                              " from poll_fds");
-  const long index = std::distance(_poll_fds.begin(), it);
-  _poll_fds.erase(it);
-  _metadata.erase(_metadata.begin() + index);
+  LOG_INFO("Remove fd=" + std::to_string(fd) + " from poll_fds");
+  epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  it->second->removed = true;
+  _removed_entries.push_back(std::move(it->second));
+  _entries.erase(it);
+}
+
+/**
+ * @brief Remove every fd owned by owner, before the owner is destroyed.
+ *
+ * @return the removed fds, for the caller to close
+ */
+std::vector<int> PollFds::remove_owner_fds(const void *owner) {
+  std::vector<int> fds;
+  std::lock_guard lock(_mutex);
+  for (auto it = _entries.begin(); it != _entries.end();) {
+    if (it->second->metadata.owner != owner) {
+      ++it;
+      continue;
+    }
+    LOG_INFO("Remove fd=" + std::to_string(it->first) + " from poll_fds");
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+    fds.push_back(it->first);
+    it->second->removed = true;
+    _removed_entries.push_back(std::move(it->second));
+    it = _entries.erase(it);
+  }
+  return fds;
 }
 
+/**
+ * @brief Flag fd as stale: its owner is done with it, and it should be closed
+ * once drained.
+ *
+ * The fd is re-armed so that an edge-triggered fd which already reached EOF
+ * reports a new event carrying the stale flag.
+ */
 void PollFds::stale_poll_fd(int fd) {
   std::lock_guard lock(_mutex);
-  const auto it =
-      std::find_if(_poll_fds.begin(), _poll_fds.end(),
-                   [fd](pollfd poll_fd) { return fd == poll_fd.fd; });
-  if (it == _poll_fds.end()) {
+  const auto it = _entries.find(fd);
+  if (it == _entries.end()) {
     throw std::invalid_argument("stale_poll_fd(): invalid fd=" +
                                 std::to_string(fd));
   }
-  Logger::get_instance().info("stale_poll_fd: Stale fd=" + std::to_string(fd));
-  const long index = std::distance(_poll_fds.begin(), it);
-  _metadata[index].stale = true;
+  LOG_INFO("stale_poll_fd: Stale fd=" + std::to_string(fd));
+  it->second->stale = true;
+  epoll_event event = {};
+  event.events = it->second->events;
+  event.data.ptr = it->second.get();
+  epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &event);
 }
 
-PollFds::snapshot_t PollFds::get_snapshot() {
+/**
+ * @brief Replace the epoll events watched on fd.
+ */
+void PollFds::modify_poll_fd(int fd, uint32_t events) {
   std::lock_guard lock(_mutex);
-  return {_poll_fds, _metadata};
+  const auto it = _entries.find(fd);
+  if (it == _entries.end()) {
+    throw std::invalid_argument("modify_poll_fd(): invalid fd=" +
+                                std::to_string(fd));
+  }
+  it->second->events = events;
+  epoll_event event = {};
+  event.events = events;
+  event.data.ptr = it->second.get();
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+    throw std::runtime_error("modify_poll_fd(): epoll_ctl fd=" +
+                             std::to_string(fd) + ": " + strerror(errno));
+  }
+}
+
+/**
+ * @brief Block until at least one fd is ready or timeout (in ms) expires.
+ *
+ * @param events filled with the ready fds
+ * @return the number of ready fds, or -1 on error (errno is set)
+ */
+int PollFds::wait(std::vector<event_t> &events, int timeout) {
+  epoll_event ready[POLLFDS_MAX_EVENTS];
+
+  events.clear();
+  {
+    std::lock_guard lock(_mutex);
+    _removed_entries.clear();
+  }
+  int result = epoll_wait(_epoll_fd, ready, POLLFDS_MAX_EVENTS, timeout);
+  for (int i = 0; i < result; i++) {
+    events.push_back(
+        {ready[i].events, static_cast<entry_t *>(ready[i].data.ptr)});
+  }
+  return result;
 }
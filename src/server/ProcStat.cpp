@@ -0,0 +1,96 @@
+#include "server/ProcStat.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+#define PROC_STAT_SIZE 1024
+
+static ssize_t read_proc_file(pid_t pid, const char *name, char *buffer,
+                              size_t size);
+
+/**
+ * @return false if the process does not exist anymore
+ */
+bool read_proc_stat(const pid_t pid, proc_stat_t &stat) {
+  char buffer[PROC_STAT_SIZE];
+  uint64_t fields[24] = {};
+
+  if (read_proc_file(pid, "stat", buffer, sizeof(buffer)) <= 0) {
+    return false;
+  }
+  // The command name, in parentheses, may contain spaces: fields are counted
+  // from the 3rd one, after the name
+  const char *field = std::strrchr(buffer, ')');
+  if (field == nullptr) {
+    return false;
+  }
+  for (int i = 3; i < 24; i++) {
+    field = std::strchr(field + 1, ' ');
+    if (field == nullptr) {
+      return false;
+    }
+    // The state is a letter, and a few fields may be negative
+    fields[i] = std::strtoull(field + 1, nullptr, 10);
+  }
+  stat.utime = fields[14];
+  stat.stime = fields[15];
+  stat.num_threads = static_cast<long>(fields[20]);
+  stat.starttime = fields[22];
+  stat.vsize = fields[23];
+  return true;
+}
+
+/**
+ * @return false if the process does not exist anymore
+ */
+bool read_proc_statm(const pid_t pid, proc_statm_t &statm) {
+  char buffer[PROC_STAT_SIZE];
+  char *end;
+
+  if (read_proc_file(pid, "statm", buffer, sizeof(buffer)) <= 0) {
+    return false;
+  }
+  statm.size = std::strtoull(buffer, &end, 10);
+  statm.resident = std::strtoull(end, &end, 10);
+  statm.shared = std::strtoull(end, nullptr, 10);
+  return true;
+}
+
+uint64_t ticks_to_microseconds(const uint64_t ticks) {
+  static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+  return ticks * 1000000 / ticks_per_second;
+}
+
+uint64_t pages_to_bytes(const uint64_t pages) {
+  static const long page_size = sysconf(_SC_PAGESIZE);
+
+  return pages * page_size;
+}
+
+/*
+ * Read a file of /proc/<pid> in a single read(), which the kernel fills
+ * atomically for these files.
+ *
+ * @return the size read, null-terminated in buffer
+ */
+static ssize_t read_proc_file(const pid_t pid, const char *name, char *buffer,
+                              const size_t size) {
+  const std::string path = "/proc/" + std::to_string(pid) + '/' + name;
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return -1;
+  }
+  const ssize_t ret = read(fd, buffer, size - 1);
+  close(fd);
+  if (ret > 0) {
+    buffer[ret] = '\0';
+  }
+  return ret;
+}
@@ -2,7 +2,13 @@
 
 #include "common/Logger.hpp"
 #include "common/socket/Socket.hpp"
+#include "server/ClientSession.hpp"
 #include "server/ConfigParser.hpp"
+#include "server/Metrics.hpp"
+#include "server/ReexecState.hpp"
+#include "server/StatusSnapshot.hpp"
+#include "server/Tracer.hpp"
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstdlib>
@@ -10,61 +16,122 @@
 #include <iostream>
 extern "C" {
 #include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 }
 
-static void redirect_output(int pipe_fd, int output_fd);
+typedef struct spawn_args_s {
+  const char *path;
+  char *const *argv;
+  char *const *envp;
+  const char *workingdir;
+  mode_t umask;
+  int stdout_fd;
+  int stderr_fd;
+  int error;
+  const char *failed_call;
+} spawn_args_t;
+
+static int spawn_trampoline(void *arg);
+[[noreturn]] static void spawn_failure(spawn_args_t *args,
+                                       const char *failed_call);
+static int redirect_output(int pipe_fd, int output_fd);
 
-extern char **environ; // envp
 
 Process::Process(std::shared_ptr<const process_config_t> process_config,
-                 int stdout_fd, int stderr_fd)
+                 std::shared_ptr<program_metrics_s> metrics,
+                 const size_t instance, int stdout_fd, int stderr_fd)
     : _process_config(process_config),
+      _metrics(std::move(metrics)),
+      _instance(instance),
       _pid(-1),
+      _pidfd(-1),
       _num_retries(0),
       _state(State::Waiting),
       _previous_state(State::Waiting),
-      _status{.running = false, .killed = false, .exitstatus = -1},
+      _status{.running = false,
+              .killed = false,
+              .exitstatus = -1,
+              .termsig = 0},
+      _usage{},
+      _sample{},
       _pending_command(Command::None),
       _stdout_pipe{-1, -1},
       _stderr_pipe{-1, -1},
       _stdout_fd(stdout_fd),
-      _stderr_fd(stderr_fd) {}
+      _stderr_fd(stderr_fd),
+      _output_buffer(process_config->output_buffer),
+      _splice_output(true),
+      _start_queued(false),
+      _retired(false) {}
 
 void Process::start() {
-  Logger::get_instance().info(str() + ": Starting...");
-  if (pipe(_stdout_pipe) == -1) {
+  prepare_start();
+  finish_start(spawn(*_process_config, _stdout_pipe[PIPE_WRITE],
+                     _stderr_pipe[PIPE_WRITE]));
+}
+
+/*
+ * First half of start(): create the pipes the child will write to.
+ */
+void Process::prepare_start() {
+  LOG_INFO(str() + ": Starting...");
+  if (pipe2(_stdout_pipe, O_CLOEXEC) == -1) {
     throw std::runtime_error("Error: Process() failed to create stdout pipe");
   }
-  if (pipe(_stderr_pipe) == -1) {
-    throw std::runtime_error("Error: Process() failed to create stderr pipe");
-  }
-  _pid = fork();
-  if (_pid == -1) {
-    throw std::runtime_error(std::string("fork: ") + strerror(errno));
-  }
-  if (_pid > 0) {
-    // parent process
+  if (pipe2(_stderr_pipe, O_CLOEXEC) == -1) {
+    close(_stdout_pipe[PIPE_READ]);
     close(_stdout_pipe[PIPE_WRITE]);
+    _stdout_pipe[PIPE_READ] = -1;
     _stdout_pipe[PIPE_WRITE] = -1;
-    close(_stderr_pipe[PIPE_WRITE]);
-    _stderr_pipe[PIPE_WRITE] = -1;
-    _start_timestamp = std::chrono::steady_clock::now();
-    _status.killed = false;
-    Logger::get_instance().info(str() + ": Started");
+    throw std::runtime_error("Error: Process() failed to create stderr pipe");
+  }
+}
+
+/*
+ * Second half of start(), once the child is spawned.
+ *
+ * @param pid the child, or -1 if it could not be spawned: the process is then
+ * considered as exited right away
+ */
+void Process::finish_start(pid_t pid) {
+  _pid = pid;
+  close(_stdout_pipe[PIPE_WRITE]);
+  _stdout_pipe[PIPE_WRITE] = -1;
+  close(_stderr_pipe[PIPE_WRITE]);
+  _stderr_pipe[PIPE_WRITE] = -1;
+  // The read ends are edge-triggered in the event loop and drained until
+  // EAGAIN
+  fcntl(_stdout_pipe[PIPE_READ], F_SETFL, O_NONBLOCK);
+  fcntl(_stderr_pipe[PIPE_READ], F_SETFL, O_NONBLOCK);
+  _start_timestamp = std::chrono::steady_clock::now();
+  _status.running = pid != -1;
+  _status.killed = false;
+  _usage = {};
+  _sample = {};
+  if (pid == -1) {
+    close(_stdout_pipe[PIPE_READ]);
+    close(_stderr_pipe[PIPE_READ]);
+    release_pipes();
+    LOG_ERROR(str() + ": failed to start");
     return;
   }
-  close(_stdout_pipe[PIPE_READ]);
-  close(_stderr_pipe[PIPE_READ]);
-  close(_stdout_fd);
-  close(_stderr_fd);
-  setup();
-  execve(_process_config->cmd_path.c_str(), _process_config->cmd->we_wordv,
-         environ);
-  std::exit(errno);
+  _metrics->starts.fetch_add(1, std::memory_order_relaxed);
+  LOG_INFO(str() + ": Started");
+}
+
+/*
+ * Forget the read ends of the pipes, now owned by whoever closes them.
+ */
+void Process::release_pipes() {
+  _stdout_pipe[PIPE_READ] = -1;
+  _stderr_pipe[PIPE_READ] = -1;
 }
 
 void Process::stop(const int sig) {
@@ -73,13 +140,13 @@ void Process::stop(const int sig) {
     throw std::runtime_error(
         "Process::stop(): trying to kill process with pid -1");
   }
-  if (::kill(_pid, sig) == -1) {
+  if (send_signal(sig) == -1) {
     _pid = -1;
     _status.running = false;
     throw std::runtime_error(std::string("kill: ") + strerror(errno));
   }
   _stop_timestamp = std::chrono::steady_clock::now();
-  Logger::get_instance().info(str() + ": Stopped");
+  LOG_INFO(str() + ": Stopped");
 }
 
 void Process::kill() {
@@ -89,43 +156,86 @@ void Process::kill() {
     throw std::runtime_error(
         "Process::kill(): trying to kill process with pid -1");
   }
-  if (::kill(_pid, SIGKILL) == -1) {
+  if (send_signal(SIGKILL) == -1) {
     _pid = -1;
     _status.running = false;
     throw std::runtime_error(std::string("kill: ") + strerror(errno));
   }
-  Logger::get_instance().info(str() + ": Killed");
+  LOG_INFO(str() + ": Killed");
 }
 
 void Process::update_status(void) {
+  struct rusage rusage;
   int status;
 
-  pid_t result = waitpid(_pid, &status, WNOHANG);
+  if (_pidfd != -1) {
+    // Its pidfd only tells that it exited, its new parent reaped it
+    LOG_INFO(str() + ": exited, status unknown");
+    _pidfd = -1;
+    _status.running = false;
+    _pid = -1;
+    _status.exitstatus = -1;
+    _status.termsig = 0;
+    return;
+  }
+  pid_t result = wait4(_pid, &status, WNOHANG, &rusage);
   if (result == -1) {
-    // Here waitpid returned an error, it may be due to
+    // Here wait4 returned an error, it may be due to
     // this function being called without the process being started.
     _status.running = false;
     _pid = -1;
-    throw std::runtime_error(std::string("waitpid: ") + strerror(errno));
+    throw std::runtime_error(std::string("wait4: ") + strerror(errno));
   }
   if (result == 0) {
     _status.running = true;
     return;
   }
   _status.running = false;
-  _pid = -1;
-  _status.exitstatus = WEXITSTATUS(status);
+  _usage = {
+      static_cast<uint64_t>(rusage.ru_utime.tv_sec) * 1000000 +
+          rusage.ru_utime.tv_usec,
+      static_cast<uint64_t>(rusage.ru_stime.tv_sec) * 1000000 +
+          rusage.ru_stime.tv_usec,
+      static_cast<uint64_t>(rusage.ru_maxrss),
+      static_cast<uint64_t>(rusage.ru_nvcsw),
+      static_cast<uint64_t>(rusage.ru_nivcsw),
+  };
+  if (WIFSIGNALED(status)) {
+    _status.exitstatus = -1;
+    _status.termsig = WTERMSIG(status);
+  } else {
+    _status.exitstatus = WEXITSTATUS(status);
+    _status.termsig = 0;
+  }
+  if (_stop_timestamp >= _start_timestamp) {
+    _metrics->stop_latency.observe(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - _stop_timestamp));
+  }
   if (exited_unexpectedly()) {
-    Logger::get_instance().info(str() +
-                                ": exited with unexpected status code " +
-                                std::to_string(_status.exitstatus));
+    _metrics->unexpected_exits.fetch_add(1, std::memory_order_relaxed);
+  }
+  const std::string expected =
+      exited_unexpectedly() ? "unexpected" : "expected";
+  if (_status.termsig != 0) {
+    LOG_INFO(str() + ": killed by " + expected + " signal " +
+             std::to_string(_status.termsig) + " (" +
+             strsignal(_status.termsig) + ")");
   } else {
-    Logger::get_instance().info(str() + ": exited with expected status code " +
-                                std::to_string(_status.exitstatus));
+    LOG_INFO(str() + ": exited with " + expected + " status code " +
+             std::to_string(_status.exitstatus));
   }
+  _pid = -1;
 }
 
+/*
+ * A signal is expected only if it was sent by stop(), the exit codes tell
+ * for a normal exit.
+ */
 bool Process::exited_unexpectedly() const {
+  if (_status.termsig != 0) {
+    return _stop_timestamp < _start_timestamp;
+  }
   return std::find(_process_config->exitcodes.begin(),
                    _process_config->exitcodes.end(),
                    _status.exitstatus) == _process_config->exitcodes.end();
@@ -145,96 +255,183 @@ bool Process::check_autorestart() const {
   return false;
 }
 
-ssize_t Process::read_stdout() {
-  return forward_output(_stdout_pipe[PIPE_READ], _stdout_fd);
+/*
+ * read_fd is one of the stdout pipes of the process: the current one, or the
+ * one of a previous run that is still being drained.
+ */
+ssize_t Process::read_stdout(int read_fd) {
+  const ssize_t ret = forward_output(read_fd, _stdout_fd);
+
+  if (ret > 0) {
+    _metrics->stdout_bytes.fetch_add(ret, std::memory_order_relaxed);
+  }
+  return ret;
 }
 
-ssize_t Process::read_stderr() {
-  return forward_output(_stderr_pipe[PIPE_READ], _stderr_fd);
+ssize_t Process::read_stderr(int read_fd) {
+  const ssize_t ret = forward_output(read_fd, _stderr_fd);
+
+  if (ret > 0) {
+    _metrics->stderr_bytes.fetch_add(ret, std::memory_order_relaxed);
+  }
+  return ret;
 }
 
-void Process::attach_client(int fd) {
-  if (std::find(_attached_client.begin(), _attached_client.end(), fd) !=
+void Process::attach_client(ClientSession *client) {
+  const int fd = client->get_fd();
+
+  if (std::find(_attached_client.begin(), _attached_client.end(), client) !=
       _attached_client.end()) {
-    Logger::get_instance().warn("Client fd=" + std::to_string(fd) +
-                                " already attached to `" +
-                                _process_config->name + '`');
+    LOG_WARN("Client fd=" + std::to_string(fd) + " already attached to `" +
+             _process_config->name + '`');
   } else {
-    _attached_client.push_back(fd);
-    Logger::get_instance().info("Client fd=" + std::to_string(fd) +
-                                " attached to `" + _process_config->name + '`');
+    _attached_client.push_back(client);
+    LOG_INFO("Client fd=" + std::to_string(fd) + " attached to `" +
+             _process_config->name + '`');
   }
 }
 
-void Process::detach_client(int fd) {
+/**
+ * @return false if the client was not attached
+ */
+bool Process::detach_client(ClientSession *client) {
   auto client_it =
-      std::find(_attached_client.begin(), _attached_client.end(), fd);
+      std::find(_attached_client.begin(), _attached_client.end(), client);
   if (client_it == _attached_client.end()) {
-    Logger::get_instance().warn("Client fd=" + std::to_string(fd) +
-                                " not attached to `" + _process_config->name +
-                                '`');
-  } else {
-    _attached_client.erase(client_it);
-    Logger::get_instance().info("Client fd=" + std::to_string(fd) +
-                                " detached to `" + _process_config->name + '`');
+    return false;
   }
+  _attached_client.erase(client_it);
+  LOG_INFO("Client fd=" + std::to_string(client->get_fd()) + " detached to `" +
+           _process_config->name + '`');
+  return true;
 }
 
 void Process::send_message_to_client(const std::string &message) {
-  for (auto client_fd : _attached_client) {
-    Socket::write(client_fd, message);
+  struct iovec iov = {const_cast<char *>(message.data()), message.size()};
+
+  for (auto client : _attached_client) {
+    client->send_output(&iov, 1);
   }
 }
 
-void Process::close_outputs() {
-  close(_stdout_pipe[PIPE_READ]);
-  _stdout_pipe[PIPE_READ] = -1;
-  close(_stderr_pipe[PIPE_READ]);
-  _stderr_pipe[PIPE_READ] = -1;
+/**
+ * @brief Return up to the last bytes of output kept in memory.
+ */
+std::string Process::tail_output(size_t bytes) const {
+  return _output_buffer.tail(bytes);
 }
 
 std::string Process::str() const {
   return "proc [" + _process_config->name + "](" + std::to_string(_pid) + ")";
 }
 
-unsigned long Process::get_runtime(void) {
-  long runtime = std::chrono::duration_cast<std::chrono::seconds>(
-                     std::chrono::steady_clock::now() - _start_timestamp)
-                     .count();
-  if (runtime < 0) {
-    return 0;
+/**
+ * @brief Record what the daemon re-executed by `reexec` needs to take the
+ *        process over, see restore_state().
+ */
+void Process::save_state(reexec_process_s &state) const {
+  state.pid = _pid;
+  state.state = _state;
+  state.previous_state = _previous_state;
+  state.pending_command = _pending_command;
+  state.num_retries = _num_retries;
+  state.start_queued = _start_queued;
+  state.status = _status;
+  state.start_timestamp = _start_timestamp;
+  state.stop_timestamp = _stop_timestamp;
+  state.stdout_pipe = _stdout_pipe[PIPE_READ];
+  state.stderr_pipe = _stderr_pipe[PIPE_READ];
+  state.attached_clients.clear();
+  for (const ClientSession *client : _attached_client) {
+    state.attached_clients.push_back(client->get_fd());
   }
-  return static_cast<unsigned long>(runtime);
 }
 
-unsigned long Process::get_stoptime(void) {
-  long stoptime = std::chrono::duration_cast<std::chrono::seconds>(
-                      std::chrono::steady_clock::now() - _stop_timestamp)
-                      .count();
-  if (stoptime < 0) {
-    return 0;
+/**
+ * @brief Take over the process saved by the daemon before a `reexec`. Its
+ *        child, if still running, is still a child of this daemon, and the
+ *        read ends of its pipes were inherited.
+ *
+ * A start that was queued but not spawned yet is issued again.
+ */
+void Process::restore_state(
+    const reexec_process_s &state,
+    const std::vector<ClientSession *> &attached_clients) {
+  _pid = state.pid;
+  _state = state.state;
+  _previous_state = state.previous_state;
+  _pending_command = state.pending_command;
+  _num_retries = state.num_retries;
+  _status = state.status;
+  _start_timestamp = state.start_timestamp;
+  _stop_timestamp = state.stop_timestamp;
+  _stdout_pipe[PIPE_READ] = state.stdout_pipe;
+  _stderr_pipe[PIPE_READ] = state.stderr_pipe;
+  _attached_client = attached_clients;
+  if (state.start_queued) {
+    _state = State::Stopped;
+    _previous_state = State::Stopped;
+    _pending_command = Command::Start;
   }
-  return static_cast<unsigned long>(stoptime);
+}
+
+std::chrono::milliseconds Process::get_runtime(void) const {
+  const auto runtime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - _start_timestamp);
+  return std::max(runtime, std::chrono::milliseconds(0));
+}
+
+std::chrono::milliseconds Process::get_stoptime(void) const {
+  const auto stoptime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - _stop_timestamp);
+  return std::max(stoptime, std::chrono::milliseconds(0));
+}
+
+size_t Process::get_instance() const { return _instance; }
+
+program_metrics_s &Process::get_metrics() const { return *_metrics; }
+
+size_t Process::get_num_attached_clients() const {
+  return _attached_client.size();
 }
 
 pid_t Process::get_pid() const { return _pid; }
 
+int Process::get_pidfd() const { return _pidfd; }
+
 const process_config_t &Process::get_process_config() const {
   return *_process_config;
 }
 
+std::shared_ptr<const process_config_t>
+Process::get_shared_process_config() const {
+  return _process_config;
+}
+
 std::chrono::steady_clock::time_point Process::get_start_timestamp() const {
   return _start_timestamp;
 }
 
+std::chrono::steady_clock::time_point Process::get_stop_timestamp() const {
+  return _stop_timestamp;
+}
+
 size_t Process::get_num_retries() const { return _num_retries; }
 
 Process::State Process::get_state() const { return _state; }
 
 Process::State Process::get_previous_state() const { return _previous_state; }
 
+bool Process::is_start_queued() const { return _start_queued; }
+
+bool Process::is_retired() const { return _retired; }
+
 Process::status_t Process::get_status() const { return _status; }
 
+Process::usage_t Process::get_usage() const { return _usage; }
+
+Process::sample_t Process::get_sample() const { return _sample; }
+
 Process::Command Process::get_pending_command() const {
   return _pending_command;
 }
@@ -251,88 +448,258 @@ void Process::set_state(State state) { _state = state; }
 
 void Process::set_previous_state(State state) { _previous_state = state; }
 
+void Process::set_start_queued(bool start_queued) {
+  _start_queued = start_queued;
+}
+
+/*
+ * A retired process was removed from the config by a reload: it is stopped
+ * and never started again, then destroyed.
+ */
+void Process::set_retired(bool retired) { _retired = retired; }
+
 void Process::set_pending_command(Command pending_command) {
   _pending_command = pending_command;
 }
 
-void Process::setup() {
-  setup_env();
-  setup_workingdir();
-  setup_outputs();
-  setup_umask();
+/**
+ * @brief Replace the config of the process, on reload. A running child keeps
+ *        running, the new config applies to how it is stopped and restarted.
+ *
+ * The kept output is dropped if output_buffer changed. Must be called by the
+ * main thread, with the worker mutex held.
+ */
+void Process::set_process_config(
+    std::shared_ptr<const process_config_t> config) {
+  if (config->output_buffer != _output_buffer.get_capacity()) {
+    _output_buffer = OutputBuffer(config->output_buffer);
+  }
+  _process_config = std::move(config);
 }
 
-void Process::setup_env() const {
-  for (std::pair<std::string, std::string> env : _process_config->env) {
-    setenv(env.first.c_str(), env.second.c_str(), 1);
-  }
+void Process::set_output_fds(int stdout_fd, int stderr_fd) {
+  _stdout_fd = stdout_fd;
+  _stderr_fd = stderr_fd;
 }
 
-void Process::setup_workingdir() const {
-  if (_process_config->workingdir.empty()) {
-    return;
-  }
-  if (chdir(_process_config->workingdir.c_str()) == -1) {
-    throw std::runtime_error(std::string("chdir:") + strerror(errno));
+/**
+ * @brief Set the pidfd of a child recovered from the journal after a crash
+ *        of the daemon, which is no longer a child of this daemon. The pidfd
+ *        is owned by the worker watching the child.
+ */
+void Process::set_pidfd(const int pidfd) { _pidfd = pidfd; }
+
+void Process::set_sample(const sample_t &sample) { _sample = sample; }
+
+/*
+ * A child that is not ours is reaped by its new parent as soon as it exits,
+ * so its pid could be reused before the worker notices: it is signaled
+ * through its pidfd.
+ */
+int Process::send_signal(const int sig) const {
+#ifdef SYS_pidfd_send_signal
+  if (_pidfd != -1) {
+    return static_cast<int>(
+        syscall(SYS_pidfd_send_signal, _pidfd, sig, nullptr, 0));
   }
+#endif
+  return ::kill(_pid, sig);
 }
 
-void Process::setup_umask() const { umask(_process_config->umask); }
-
-void Process::setup_outputs() {
-  redirect_output(_stdout_pipe[PIPE_WRITE], STDOUT_FILENO);
-  redirect_output(_stderr_pipe[PIPE_WRITE], STDERR_FILENO);
+/**
+ * @brief Launch the program with clone(CLONE_VM | CLONE_VFORK).
+ *
+ * The child shares the daemon's memory instead of copying its page tables,
+ * so the cost does not grow with the daemon's size. The daemon thread is
+ * suspended until the child calls execve() or exits. argv and envp come
+ * prebuilt with the config, so the trampoline only makes syscalls.
+ *
+ * Only the immutable config is read, so it is safe to call without the worker
+ * mutex, between prepare_start() and finish_start().
+ *
+ * @return the pid of the child. If it failed before execve(), it already
+ * exited with errno as its status, and the failure is logged here.
+ */
+pid_t Process::spawn(const process_config_t &config, int stdout_fd,
+                     int stderr_fd) {
+  const ScopedTimer timer(TracePoint::ProcessSpawn);
+  alignas(16) char stack[SPAWN_STACK_SIZE];
+  sigset_t all_signals;
+  sigset_t saved_mask;
+
+  spawn_args_t args = {
+      config.cmd_path.c_str(),
+      config.cmd->we_wordv,
+      config.envp.data(),
+      config.workingdir.empty() ? nullptr : config.workingdir.c_str(),
+      config.umask,
+      stdout_fd,
+      stderr_fd,
+      0,
+      nullptr,
+  };
+  // No signal handler of the daemon may run in the child before it resets
+  // them, they would share its memory
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+  const pid_t pid = clone(spawn_trampoline, stack + sizeof(stack),
+                          CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+  const int clone_errno = errno;
+  pthread_sigmask(SIG_SETMASK, &saved_mask, nullptr);
+  if (pid == -1) {
+    throw std::runtime_error(std::string("clone: ") + strerror(clone_errno));
+  }
+  if (args.error != 0) {
+    LOG_ERROR("proc [" + config.name + "](" + std::to_string(pid) +
+              "): " + args.failed_call + ": " + strerror(args.error));
+  }
+  return pid;
 }
 
 /**
- * @brief Read data from a pipe and forward it to the main output descriptor
- *        as well as all attached client sockets.
+ * @brief Forward data from a pipe to the main output descriptor as well as
+ *        all attached client sockets.
+ *
+ * When the process keeps an output buffer, the data goes through
+ * buffer_output(). Otherwise, without attached clients, the data is moved
+ * with splice() so it never goes through userspace. If clients are attached,
+ * or if the output does not support splice, it falls back to copy_output().
  *
  * @param read_fd   File descriptor from which to read (pipe read end).
  * @param output_fd File descriptor to forward the data to.
- * @return the number of bytes read
- *
- * @note If the read operation fails, the function prints an error using
- * perror() and returns without attempting to forward any data.
+ * @return the number of bytes forwarded, 0 on EOF, -1 on error (EAGAIN once
+ * the pipe is drained)
  */
 ssize_t Process::forward_output(int read_fd, int output_fd) {
-  char buffer[SOCKET_BUFFER_SIZE];
+  const ScopedTimer timer(TracePoint::ForwardOutput);
+
+  if (_output_buffer.get_capacity() != 0) {
+    return buffer_output(read_fd, output_fd);
+  }
+  if (!_splice_output || !_attached_client.empty()) {
+    return copy_output(read_fd, output_fd);
+  }
+  ssize_t ret = splice(read_fd, nullptr, output_fd, nullptr, OUTPUT_CHUNK_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (ret == -1 && errno == EINVAL) {
+    // output_fd does not support splice, nothing was consumed from read_fd
+    _splice_output = false;
+    return copy_output(read_fd, output_fd);
+  }
+  if (ret == -1 && errno != EAGAIN) {
+    perror("splice");
+  }
+  return ret;
+}
+
+/**
+ * @brief Fallback of forward_output() reading the pipe into a buffer and
+ *        writing it to the output and each attached client.
+ *
+ * Splicing into unix sockets is slower than a plain copy of large chunks, so
+ * this is also the path used while clients are attached.
+ */
+ssize_t Process::copy_output(int read_fd, int output_fd) {
+  char buffer[OUTPUT_CHUNK_SIZE];
   ssize_t ret;
 
-  ret = Socket::read(read_fd, buffer, SOCKET_BUFFER_SIZE);
-  if (ret == -1) {
-    perror("read");
+  ret = Socket::read(read_fd, buffer, OUTPUT_CHUNK_SIZE);
+  if (ret <= 0) {
+    if (ret == -1 && errno != EAGAIN) {
+      perror("read");
+    }
     return ret;
   }
   Socket::write(output_fd, buffer, ret);
+  struct iovec iov = {buffer, static_cast<size_t>(ret)};
   for (auto client : _attached_client) {
-    Socket::write(client, buffer, ret);
+    client->send_output(&iov, 1);
   }
   return ret;
 }
 
-static void redirect_output(int pipe_fd, int output_fd) {
-  if (dup2(pipe_fd, output_fd) == -1) {
-    throw std::runtime_error(std::string("dup2:") + strerror(errno));
+/**
+ * @brief Read data from a pipe straight into the output buffer, then write it
+ *        from there to the output and each attached client.
+ */
+ssize_t Process::buffer_output(int read_fd, int output_fd) {
+  struct iovec iov[2];
+  int iovcnt = _output_buffer.reserve(
+      iov, std::min<size_t>(OUTPUT_CHUNK_SIZE, _output_buffer.get_capacity()));
+  ssize_t ret;
+
+  ret = readv(read_fd, iov, iovcnt);
+  if (ret <= 0) {
+    if (ret == -1 && errno != EAGAIN) {
+      perror("readv");
+    }
+    return ret;
+  }
+  _output_buffer.commit(ret);
+  if (static_cast<size_t>(ret) <= iov[0].iov_len) {
+    iov[0].iov_len = ret;
+    iovcnt = 1;
+  } else {
+    iov[1].iov_len = ret - iov[0].iov_len;
+  }
+  writev(output_fd, iov, iovcnt);
+  for (auto client : _attached_client) {
+    client->send_output(iov, iovcnt);
   }
+  return ret;
 }
 
-std::ostream &operator<<(std::ostream &os, const Process &process) {
-  os << "(" << process.get_pid() << ") - " << process.get_state();
-  if (process.get_state() == Process::State::Stopped &&
-      process.get_status().exitstatus != -1) {
-    if (process.exited_unexpectedly()) {
-      os << " - exited unexpectedly";
-    }
-    if (process.get_status().killed) {
-      os << " - killed";
-    }
-    if (process.get_num_retries() > process.get_process_config().startretries &&
-        process.get_process_config().startretries != 0) {
-      os << " - aborted";
+/*
+ * Runs in the child, on its own stack but in the memory of the daemon: it
+ * must not allocate, lock or log. A failure is reported through args.
+ */
+static int spawn_trampoline(void *arg) {
+  auto *args = static_cast<spawn_args_t *>(arg);
+  struct sigaction default_action = {};
+  sigset_t empty_mask;
+
+  // Caught signals go back to their default, and the daemon ignores SIGPIPE
+  default_action.sa_handler = SIG_DFL;
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction action;
+    if (sigaction(sig, nullptr, &action) == 0 &&
+        ((action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) ||
+         sig == SIGPIPE)) {
+      sigaction(sig, &default_action, nullptr);
     }
   }
-  return os;
+  umask(args->umask);
+  if (args->workingdir != nullptr && chdir(args->workingdir) == -1) {
+    spawn_failure(args, "chdir");
+  }
+  if (redirect_output(args->stdout_fd, STDOUT_FILENO) == -1 ||
+      redirect_output(args->stderr_fd, STDERR_FILENO) == -1) {
+    spawn_failure(args, "dup2");
+  }
+  sigemptyset(&empty_mask);
+  sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+  execve(args->path, args->argv, args->envp);
+  spawn_failure(args, "execve");
+}
+
+static void spawn_failure(spawn_args_t *args, const char *failed_call) {
+  args->error = errno;
+  args->failed_call = failed_call;
+  _exit(args->error);
+}
+
+/*
+ * The pipes are close-on-exec, dup2 clears the flag on the copy.
+ */
+static int redirect_output(int pipe_fd, int output_fd) {
+  if (pipe_fd == output_fd) {
+    return fcntl(output_fd, F_SETFD, 0);
+  }
+  return dup2(pipe_fd, output_fd);
+}
+
+std::ostream &operator<<(std::ostream &os, const Process &process) {
+  return os << make_process_status(process);
 }
 
 std::ostream &operator<<(std::ostream &os, const Process::State &state) {
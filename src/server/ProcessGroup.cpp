@@ -1,32 +1,46 @@
 #include "server/ProcessGroup.hpp"
 #include "common/Logger.hpp"
+#include "server/StatusSnapshot.hpp"
 
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
 #include <unistd.h>
 
+static int open_output(const std::string &path);
+
 ProcessGroup::ProcessGroup(process_config_t &&config)
-    : _stdout_fd(-1), _stderr_fd(-1) {
+    : _metrics(std::make_shared<program_metrics_t>()),
+      _stdout_fd(-1),
+      _stderr_fd(-1) {
   _config = std::make_shared<process_config_t>(std::move(config));
-  _stdout_fd =
-      _config->stdout.empty()
-          ? open("/dev/null", O_WRONLY)
-          : open(_config->stdout.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  if (_stdout_fd == -1) {
-    throw std::runtime_error(std::string("open `") + _config->stdout +
-                             "`: " + strerror(errno));
+  _stdout_fd = open_output(_config->stdout);
+  try {
+    _stderr_fd = open_output(_config->stderr);
+  } catch (const std::runtime_error &) {
+    close(_stdout_fd);
+    throw;
   }
-  _stderr_fd =
-      _config->stderr.empty()
-          ? open("/dev/null", O_WRONLY)
-          : open(_config->stderr.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  if (_stderr_fd == -1) {
-    throw std::runtime_error(std::string("open `") + _config->stderr +
-                             "`: " + strerror(errno));
+  for (size_t i = 0; i < _config->numprocs; ++i) {
+    _process_vector.emplace_back(_config, _metrics, i, _stdout_fd,
+                                 _stderr_fd);
   }
+}
+
+/**
+ * @brief Build a group writing to output files that are already open,
+ *        inherited from the daemon before a `reexec`, so they are not
+ *        truncated again.
+ */
+ProcessGroup::ProcessGroup(process_config_t &&config, const int stdout_fd,
+                           const int stderr_fd)
+    : _metrics(std::make_shared<program_metrics_t>()),
+      _stdout_fd(stdout_fd),
+      _stderr_fd(stderr_fd) {
+  _config = std::make_shared<process_config_t>(std::move(config));
   for (size_t i = 0; i < _config->numprocs; ++i) {
-    _process_vector.emplace_back(_config, _stdout_fd, _stderr_fd);
+    _process_vector.emplace_back(_config, _metrics, i, _stdout_fd,
+                                 _stderr_fd);
   }
 }
 
@@ -39,18 +53,70 @@ process_config_t const &ProcessGroup::get_process_config() const {
   return *_config;
 }
 
-void ProcessGroup::stop(const int sig) {
-  Logger::get_instance().info("Stopping " + str());
-  for (Process &process : _process_vector) {
-    if (process.get_status().running) {
-      process.stop(sig);
-      process.send_message_to_client(process.str() + " has stopped\n");
+const program_metrics_t &ProcessGroup::get_metrics() const {
+  return *_metrics;
+}
+
+/**
+ * @brief Apply the config of a reload to the group.
+ *
+ * The output files are reopened if their path changed, before anything else
+ * so the group is left unchanged if that fails. The processes below numprocs
+ * take the new config, and processes are added if numprocs grew. The ones
+ * past numprocs are retired by the caller, and keep the config they run with.
+ *
+ * @note Must be called by the main thread, with the worker mutex held.
+ */
+void ProcessGroup::set_process_config(process_config_t &&config) {
+  int stdout_fd = _stdout_fd;
+  int stderr_fd = _stderr_fd;
+
+  if (config.stdout != _config->stdout) {
+    stdout_fd = open_output(config.stdout);
+  }
+  if (config.stderr != _config->stderr) {
+    try {
+      stderr_fd = open_output(config.stderr);
+    } catch (const std::runtime_error &) {
+      if (stdout_fd != _stdout_fd) {
+        close(stdout_fd);
+      }
+      throw;
+    }
+  }
+  if (stdout_fd != _stdout_fd) {
+    close(_stdout_fd);
+    _stdout_fd = stdout_fd;
+  }
+  if (stderr_fd != _stderr_fd) {
+    close(_stderr_fd);
+    _stderr_fd = stderr_fd;
+  }
+  _config = std::make_shared<process_config_t>(std::move(config));
+  for (size_t i = 0; i < _process_vector.size(); ++i) {
+    _process_vector[i].set_output_fds(_stdout_fd, _stderr_fd);
+    if (i < _config->numprocs) {
+      _process_vector[i].set_process_config(_config);
     }
   }
+  while (_process_vector.size() < _config->numprocs) {
+    _process_vector.emplace_back(_config, _metrics, _process_vector.size(),
+                                 _stdout_fd, _stderr_fd);
+  }
 }
 
+int ProcessGroup::get_stdout_fd() const { return _stdout_fd; }
+
+int ProcessGroup::get_stderr_fd() const { return _stderr_fd; }
+
+size_t ProcessGroup::size() const { return _process_vector.size(); }
+
+Process &ProcessGroup::back() { return _process_vector.back(); }
+
+void ProcessGroup::pop_back() { _process_vector.pop_back(); }
+
 void ProcessGroup::start() {
-  Logger::get_instance().info("Starting" + str());
+  LOG_INFO("Starting" + str());
   for (Process &process : _process_vector) {
     process.start();
   }
@@ -85,9 +151,20 @@ ProcessGroup::GroupConstIterator ProcessGroup::cend() const {
 }
 
 std::ostream &operator<<(std::ostream &os, const ProcessGroup &process_group) {
-  os << process_group.str() << std::endl;
-  for (const Process &process : process_group) {
-    os << '\t' << process << std::endl;
+  return os << *make_group_status(process_group);
+}
+
+/*
+ * Open the file the output of the group is written to, /dev/null if none.
+ */
+static int open_output(const std::string &path) {
+  const int fd = path.empty()
+                     ? open("/dev/null", O_WRONLY | O_CLOEXEC)
+                     : open(path.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("open `") + path +
+                             "`: " + strerror(errno));
   }
-  return os;
+  return fd;
 }
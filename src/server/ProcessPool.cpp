@@ -1,6 +1,7 @@
 #include "server/ProcessPool.hpp"
 
 #include <iostream>
+#include <tuple>
 #include <unordered_map>
 
 ProcessPool::ProcessPool() = default;
@@ -23,6 +24,14 @@ void ProcessPool::emplace(process_config_t &&process_config) {
   _process_pool.emplace(process_config.name, std::move(process_config));
 }
 
+void ProcessPool::emplace(process_config_t &&process_config,
+                          const int stdout_fd, const int stderr_fd) {
+  const std::string name = process_config.name;
+  _process_pool.emplace(std::piecewise_construct, std::forward_as_tuple(name),
+                        std::forward_as_tuple(std::move(process_config),
+                                              stdout_fd, stderr_fd));
+}
+
 ProcessPool::PoolIterator ProcessPool::erase(PoolIterator it) {
   return _process_pool.erase(it);
 }
@@ -31,7 +40,7 @@ ProcessPool::PoolIterator ProcessPool::find(std::string const &key) {
   return _process_pool.find(key);
 }
 
-ProcessPool::PoolType::node_type ProcessPool::extract(std::string const &key) {
+ProcessPool::NodeType ProcessPool::extract(std::string const &key) {
   return _process_pool.extract(key);
 }
 
@@ -42,8 +51,6 @@ void ProcessPool::move_from(ProcessPool &other, std::string const &key) {
 
 bool ProcessPool::empty() const { return _process_pool.empty(); }
 
-std::mutex &ProcessPool::get_mutex() { return _mutex; }
-
 std::unordered_map<std::string, ProcessGroup> &ProcessPool::get_pool() {
   return _process_pool;
 }
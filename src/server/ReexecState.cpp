@@ -0,0 +1,237 @@
+#include "server/ReexecState.hpp"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+extern "C" {
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#define REEXEC_STATE_MAGIC "taskmasterd-state"
+#define REEXEC_STATE_VERSION 1
+
+static std::string read_all(int fd);
+static void write_all(int fd, const std::string &data);
+static int64_t to_ticks(std::chrono::steady_clock::time_point time_point);
+static std::chrono::steady_clock::time_point from_ticks(int64_t ticks);
+
+/*
+ * One record per line, names quoted. steady_clock is CLOCK_MONOTONIC, which
+ * goes on across an execve, so time points are kept as they are.
+ */
+static std::ostream &operator<<(std::ostream &os,
+                                const reexec_process_t &process) {
+  os << "process " << std::quoted(process.group_name) << ' '
+     << process.instance << ' ' << process.pid << ' '
+     << static_cast<int>(process.state) << ' '
+     << static_cast<int>(process.previous_state) << ' '
+     << static_cast<int>(process.pending_command) << ' '
+     << process.num_retries << ' ' << process.start_queued << ' '
+     << process.status.running << ' ' << process.status.killed << ' '
+     << process.status.exitstatus << ' ' << to_ticks(process.start_timestamp)
+     << ' ' << to_ticks(process.stop_timestamp) << ' ' << process.stdout_pipe
+     << ' ' << process.stderr_pipe << ' ' << process.attached_clients.size();
+  for (const int fd : process.attached_clients) {
+    os << ' ' << fd;
+  }
+  return os;
+}
+
+static std::istream &operator>>(std::istream &is, reexec_process_t &process) {
+  int state;
+  int previous_state;
+  int pending_command;
+  int64_t start_timestamp;
+  int64_t stop_timestamp;
+  size_t attached;
+
+  is >> std::quoted(process.group_name) >> process.instance >> process.pid >>
+      state >> previous_state >> pending_command >> process.num_retries >>
+      process.start_queued >> process.status.running >>
+      process.status.killed >> process.status.exitstatus >> start_timestamp >>
+      stop_timestamp >> process.stdout_pipe >> process.stderr_pipe >> attached;
+  // Not saved, so that the format stays readable by the previous version
+  process.status.termsig = 0;
+  process.state = static_cast<Process::State>(state);
+  process.previous_state = static_cast<Process::State>(previous_state);
+  process.pending_command = static_cast<Process::Command>(pending_command);
+  process.start_timestamp = from_ticks(start_timestamp);
+  process.stop_timestamp = from_ticks(stop_timestamp);
+  process.attached_clients.resize(is ? attached : 0);
+  for (int &fd : process.attached_clients) {
+    is >> fd;
+  }
+  return is;
+}
+
+/**
+ * @brief Write the state to a memfd, inherited by the binary the daemon
+ *        re-executes into.
+ *
+ * @return the memfd, positioned at the start of the state
+ * @throws std::runtime_error if the memfd cannot be created or written
+ */
+int write_reexec_state(const reexec_state_t &state) {
+  std::ostringstream oss;
+
+  oss << REEXEC_STATE_MAGIC << ' ' << REEXEC_STATE_VERSION << '\n'
+      << "daemon " << state.pidfile_fd << ' ' << state.log_fd << ' '
+      << state.server_fd << ' '
+      << state.request_client_fd << ' ' << state.request_id << '\n';
+  for (const frame_t &request : state.pending_requests) {
+    oss << "request " << request.request_id << ' '
+        << std::quoted(request.payload) << '\n';
+  }
+  for (const reexec_client_t &client : state.clients) {
+    oss << "client " << client.fd << ' ' << client.output_request_id << '\n';
+  }
+  for (const reexec_group_t &group : state.groups) {
+    oss << "group " << std::quoted(group.name) << ' '
+        << std::quoted(group.stdout_path) << ' ' << group.stdout_fd << ' '
+        << std::quoted(group.stderr_path) << ' ' << group.stderr_fd << '\n';
+  }
+  for (const reexec_process_t &process : state.processes) {
+    oss << process << '\n';
+  }
+  for (const pid_t pid : state.orphans) {
+    oss << "orphan " << pid << '\n';
+  }
+  // Not close-on-exec, the new binary reads it
+  const int fd = memfd_create("taskmasterd-state", 0);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("memfd_create: ") + strerror(errno));
+  }
+  try {
+    write_all(fd, oss.str());
+  } catch (const std::runtime_error &) {
+    close(fd);
+    throw;
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/**
+ * @brief Read the state written by write_reexec_state() and close its fd.
+ *
+ * @throws std::runtime_error if the state is not valid
+ */
+reexec_state_t read_reexec_state(const int fd) {
+  std::istringstream iss(read_all(fd));
+  reexec_state_t state{};
+  std::string line;
+  std::string magic;
+  int version = 0;
+
+  close(fd);
+  if (!std::getline(iss, line) ||
+      !(std::istringstream(line) >> magic >> version) ||
+      magic != REEXEC_STATE_MAGIC || version != REEXEC_STATE_VERSION) {
+    throw std::runtime_error("read_reexec_state: unknown state format");
+  }
+  while (std::getline(iss, line)) {
+    std::istringstream record(line);
+    std::string type;
+    record >> type;
+    if (type == "daemon") {
+      record >> state.pidfile_fd >> state.log_fd >> state.server_fd >>
+          state.request_client_fd >> state.request_id;
+    } else if (type == "request") {
+      frame_t request{FrameType::Request, 0, {}};
+      record >> request.request_id >> std::quoted(request.payload);
+      state.pending_requests.push_back(std::move(request));
+    } else if (type == "client") {
+      reexec_client_t client{};
+      record >> client.fd >> client.output_request_id;
+      state.clients.push_back(client);
+    } else if (type == "group") {
+      reexec_group_t group{};
+      record >> std::quoted(group.name) >> std::quoted(group.stdout_path) >>
+          group.stdout_fd >> std::quoted(group.stderr_path) >> group.stderr_fd;
+      state.groups.push_back(std::move(group));
+    } else if (type == "process") {
+      reexec_process_t process{};
+      record >> process;
+      state.processes.push_back(std::move(process));
+    } else if (type == "orphan") {
+      pid_t pid;
+      record >> pid;
+      state.orphans.push_back(pid);
+    }
+    if (!record) {
+      throw std::runtime_error("read_reexec_state: invalid record `" + line +
+                               '`');
+    }
+  }
+  return state;
+}
+
+/**
+ * @brief The fds the new binary inherits.
+ */
+std::vector<int> get_reexec_fds(const reexec_state_t &state) {
+  std::vector<int> fds = {state.log_fd, state.server_fd};
+
+  if (state.pidfile_fd != -1) {
+    fds.push_back(state.pidfile_fd);
+  }
+  for (const reexec_client_t &client : state.clients) {
+    fds.push_back(client.fd);
+  }
+  for (const reexec_group_t &group : state.groups) {
+    fds.push_back(group.stdout_fd);
+    fds.push_back(group.stderr_fd);
+  }
+  for (const reexec_process_t &process : state.processes) {
+    if (process.stdout_pipe != -1) {
+      fds.push_back(process.stdout_pipe);
+      fds.push_back(process.stderr_pipe);
+    }
+  }
+  return fds;
+}
+
+static std::string read_all(const int fd) {
+  std::string data;
+  char buffer[4096];
+  ssize_t ret;
+
+  while ((ret = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (ret == -1 && errno != EINTR) {
+      throw std::runtime_error(std::string("read_reexec_state: read: ") +
+                               strerror(errno));
+    }
+    if (ret > 0) {
+      data.append(buffer, ret);
+    }
+  }
+  return data;
+}
+
+static void write_all(const int fd, const std::string &data) {
+  size_t written = 0;
+
+  while (written < data.size()) {
+    const ssize_t ret =
+        write(fd, data.data() + written, data.size() - written);
+    if (ret == -1 && errno != EINTR) {
+      throw std::runtime_error(std::string("write_reexec_state: write: ") +
+                               strerror(errno));
+    }
+    if (ret > 0) {
+      written += ret;
+    }
+  }
+}
+
+static int64_t to_ticks(
+    const std::chrono::steady_clock::time_point time_point) {
+  return time_point.time_since_epoch().count();
+}
+
+static std::chrono::steady_clock::time_point from_ticks(const int64_t ticks) {
+  return std::chrono::steady_clock::time_point(
+      std::chrono::steady_clock::duration(ticks));
+}
@@ -0,0 +1,168 @@
+#include "server/SpawnScheduler.hpp"
+
+#include "common/socket/Socket.hpp"
+#include "server/Process.hpp"
+#include "server/WakeUp.hpp"
+
+#include <algorithm>
+#include <climits>
+
+SpawnScheduler::SpawnScheduler(spawn_limits_t &global)
+    : _global(global),
+      _next_admission(clock::time_point::max()),
+      _random(std::random_device{}()) {}
+
+/**
+ * @brief Set the global limits, 0 meaning unlimited. Slots already held are
+ * kept.
+ */
+void SpawnScheduler::set_limits(spawn_limits_t &global,
+                                unsigned long max_concurrent_starts,
+                                double start_rate) {
+  global.max_concurrent_starts = max_concurrent_starts;
+  global.start_interval = rate_to_interval(start_rate).count();
+}
+
+void SpawnScheduler::enqueue(Process *process, clock::time_point now) {
+  const auto jitter = process->get_process_config().start_jitter;
+  clock::time_point not_before = now;
+
+  if (jitter.count() > 0) {
+    std::uniform_int_distribution<long long> delay(0, jitter.count());
+    not_before += std::chrono::milliseconds(delay(_random));
+  }
+  _queue.push_back({process, not_before});
+}
+
+/**
+ * @brief Give back the slot of a process leaving the Starting state, or drop
+ * it from the queue if it was not admitted yet.
+ */
+void SpawnScheduler::release(Process *process) {
+  if (_starting.erase(process) == 0) {
+    _queue.remove_if([process](const queued_t &queued) {
+      return queued.process == process;
+    });
+    return;
+  }
+  release_global_slot();
+  auto group = _groups.find(process->get_process_config().name);
+  if (group != _groups.end() && group->second.starting > 0) {
+    group->second.starting--;
+  }
+}
+
+/**
+ * @brief Admit every queued process allowed to start now.
+ *
+ * @param admitted filled with the processes to spawn
+ */
+void SpawnScheduler::admit(clock::time_point now,
+                           std::vector<Process *> &admitted) {
+  _next_admission = clock::time_point::max();
+  for (auto it = _queue.begin(); it != _queue.end();) {
+    const process_config_t &config = it->process->get_process_config();
+    limiter_t &group =
+        _groups.try_emplace(config.name, limiter_t{0, clock::time_point::min()})
+            .first->second;
+    if (now < it->not_before) {
+      _next_admission = std::min(_next_admission, it->not_before);
+      ++it;
+      continue;
+    }
+    if (config.max_concurrent_starts != 0 &&
+        group.starting >= config.max_concurrent_starts) {
+      ++it;
+      continue;
+    }
+    if (now < group.next_start) {
+      _next_admission = std::min(_next_admission, group.next_start);
+      ++it;
+      continue;
+    }
+    if (!take_global_slot(now)) {
+      return;
+    }
+    take_slot(group, rate_to_interval(config.start_rate), now);
+    _starting.insert(it->process);
+    admitted.push_back(it->process);
+    it = _queue.erase(it);
+  }
+}
+
+/**
+ * @return the number of milliseconds until a queued process may be admitted
+ * (rounded up), or -1 if it only depends on a slot being released
+ */
+int SpawnScheduler::get_timeout(clock::time_point now) const {
+  if (_queue.empty() || _next_admission == clock::time_point::max()) {
+    return -1;
+  }
+  if (_next_admission <= now) {
+    return 0;
+  }
+  const long long timeout =
+      std::chrono::ceil<std::chrono::milliseconds>(_next_admission - now)
+          .count();
+  return static_cast<int>(std::min<long long>(timeout, INT_MAX));
+}
+
+/*
+ * @return false if the global limits are reached. Admission then resumes at
+ * _next_admission for the rate, or when another worker releases a slot.
+ */
+bool SpawnScheduler::take_global_slot(clock::time_point now) {
+  const unsigned long max_concurrent_starts = _global.max_concurrent_starts;
+  unsigned long starting = _global.starting;
+
+  do {
+    if (max_concurrent_starts != 0 && starting >= max_concurrent_starts) {
+      _global.slot_wanted = true;
+      // A slot released before the flag was set did not wake anyone up
+      starting = _global.starting;
+      if (starting >= max_concurrent_starts) {
+        return false;
+      }
+    }
+  } while (!_global.starting.compare_exchange_weak(starting, starting + 1));
+  const clock::rep interval = _global.start_interval;
+  clock::rep next_start = _global.next_start;
+  const clock::rep now_rep = now.time_since_epoch().count();
+  do {
+    if (now_rep < next_start) {
+      _next_admission =
+          std::min(_next_admission,
+                   clock::time_point(clock::duration(next_start)));
+      release_global_slot();
+      return false;
+    }
+  } while (interval != 0 && !_global.next_start.compare_exchange_weak(
+                                next_start, now_rep + interval));
+  return true;
+}
+
+void SpawnScheduler::release_global_slot() {
+  _global.starting--;
+  if (_global.slot_wanted.exchange(false)) {
+    for (int fd : _global.wake_up_fds) {
+      Socket::write(fd, WAKE_UP_STRING);
+    }
+  }
+}
+
+SpawnScheduler::clock::duration SpawnScheduler::rate_to_interval(double rate) {
+  if (rate <= 0) {
+    return clock::duration::zero();
+  }
+  return std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(1 / rate));
+}
+
+/*
+ * Starts are spaced by interval, without bursts after an idle period.
+ */
+void SpawnScheduler::take_slot(limiter_t &limiter, clock::duration interval,
+                               clock::time_point now) {
+  limiter.starting++;
+  limiter.next_start = std::max(limiter.next_start, now) + interval;
+}
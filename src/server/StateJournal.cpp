@@ -0,0 +1,378 @@
+#include "server/StateJournal.hpp"
+
+#include "common/Logger.hpp"
+#include "server/ProcStat.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#define JOURNAL_UPDATE 1
+#define JOURNAL_REMOVE 2
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_SIZE 40
+
+typedef struct journal_header_s {
+  char magic[8];
+  // Pids and steady_clock time points only mean something within a boot
+  char boot_id[BOOT_ID_SIZE];
+} journal_header_t;
+
+typedef struct journal_record_s {
+  uint32_t length;   // of the record and its name, 0 past the last record
+  uint32_t checksum; // of what follows, so a torn record is not replayed
+  uint64_t pid_start_time;
+  int64_t start_timestamp;
+  int64_t stop_timestamp;
+  int32_t pid;
+  uint32_t instance;
+  uint32_t num_retries;
+  uint8_t type;
+  uint8_t state;
+  uint8_t pending_command;
+  uint8_t start_queued;
+  // Followed by the group name, null-terminated and padded to 8 bytes
+} journal_record_t;
+
+static std::string read_boot_id();
+static std::string get_entry_key(const std::string &group_name,
+                                 size_t instance);
+static bool is_same_entry(const journal_entry_t &left,
+                          const journal_entry_t &right);
+static size_t get_record_size(const journal_entry_t &entry);
+static void encode_record(char *dest, const journal_entry_t &entry,
+                          uint8_t type);
+static uint32_t checksum(const char *data, size_t size);
+
+/**
+ * @brief Open the journal at path, replaying what it holds, and start a new
+ *        file with the latest entries.
+ *
+ * A journal written before the last boot is dropped.
+ *
+ * @throws std::runtime_error if the new file cannot be written
+ */
+StateJournal::StateJournal(const std::string &path)
+    : _path(path),
+      _boot_id(read_boot_id()),
+      _fd(-1),
+      _map(nullptr),
+      _size(0),
+      _offset(0) {
+  load();
+  compact();
+}
+
+StateJournal::~StateJournal() { unmap(); }
+
+/**
+ * @brief The latest entry of each process, as replayed when opened.
+ */
+std::vector<journal_entry_t> StateJournal::get_entries() {
+  std::lock_guard lock(_mutex);
+  std::vector<journal_entry_t> entries;
+
+  entries.reserve(_entries.size());
+  for (const auto &[_, entry] : _entries) {
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+/**
+ * @brief Record the state of a process, if it changed since its last entry.
+ *
+ * The start time of a new pid is read from /proc, so it must be called
+ * before the child is reaped.
+ */
+void StateJournal::update(const journal_entry_t &entry) {
+  std::lock_guard lock(_mutex);
+  const std::string key = get_entry_key(entry.group_name, entry.instance);
+  const auto latest = _entries.find(key);
+  journal_entry_t updated = entry;
+
+  if (latest != _entries.end() && latest->second.pid == entry.pid) {
+    updated.pid_start_time = latest->second.pid_start_time;
+    if (is_same_entry(latest->second, updated)) {
+      return;
+    }
+  } else if (entry.pid != -1) {
+    updated.pid_start_time = get_pid_start_time(entry.pid);
+  }
+  _entries[key] = updated;
+  append(updated, JOURNAL_UPDATE);
+}
+
+/**
+ * @brief Forget a process removed from the config.
+ */
+void StateJournal::remove(const std::string &group_name,
+                          const size_t instance) {
+  std::lock_guard lock(_mutex);
+  const auto latest = _entries.find(get_entry_key(group_name, instance));
+
+  if (latest == _entries.end()) {
+    return;
+  }
+  const journal_entry_t entry = latest->second;
+  _entries.erase(latest);
+  append(entry, JOURNAL_REMOVE);
+}
+
+/**
+ * @return the start time of a process in clock ticks since boot, 0 if it
+ * does not exist
+ */
+uint64_t StateJournal::get_pid_start_time(const pid_t pid) {
+  proc_stat_t stat;
+
+  return read_proc_stat(pid, stat) ? stat.starttime : 0;
+}
+
+/*
+ * Replay the journal: the last record of each process wins. Replay stops at
+ * the first record that is torn.
+ */
+void StateJournal::load() {
+  journal_header_t header;
+  struct stat st;
+  const int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      throw std::runtime_error("open `" + _path + "`: " + strerror(errno));
+    }
+    return;
+  }
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(journal_header_t)) {
+    close(fd);
+    return;
+  }
+  const size_t size = st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    throw std::runtime_error("mmap `" + _path + "`: " + strerror(errno));
+  }
+  const char *data = static_cast<const char *>(map);
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      std::strncmp(header.boot_id, _boot_id.c_str(), BOOT_ID_SIZE) != 0) {
+    LOG_INFO("StateJournal: `" + _path + "` is from a previous boot, dropped");
+    munmap(map, size);
+    return;
+  }
+  size_t offset = sizeof(journal_header_t);
+  while (offset + sizeof(journal_record_t) <= size) {
+    journal_record_t record;
+    std::memcpy(&record, data + offset, sizeof(record));
+    if (record.length == 0) {
+      break;
+    }
+    if (record.length < sizeof(record) + 8 || record.length % 8 != 0 ||
+        record.length > size - offset ||
+        record.checksum != checksum(data + offset + 8, record.length - 8)) {
+      LOG_WARN("StateJournal: torn record at offset " +
+               std::to_string(offset) + ", replay stopped");
+      break;
+    }
+    const char *name = data + offset + sizeof(record);
+    const std::string group_name(
+        name, strnlen(name, record.length - sizeof(record)));
+    const std::string key = get_entry_key(group_name, record.instance);
+    if (record.type == JOURNAL_REMOVE) {
+      _entries.erase(key);
+    } else {
+      _entries[key] = {
+          group_name,
+          record.instance,
+          record.pid,
+          record.pid_start_time,
+          static_cast<Process::State>(record.state),
+          static_cast<Process::Command>(record.pending_command),
+          record.num_retries,
+          record.start_queued != 0,
+          std::chrono::steady_clock::time_point(
+              std::chrono::steady_clock::duration(record.start_timestamp)),
+          std::chrono::steady_clock::time_point(
+              std::chrono::steady_clock::duration(record.stop_timestamp)),
+      };
+    }
+    offset += record.length;
+  }
+  munmap(map, size);
+}
+
+/*
+ * Write the latest entries to a new file, at most a quarter full, and rename
+ * it over the journal. A crash in between leaves the old journal in place.
+ */
+void StateJournal::compact() {
+  const std::string tmp_path = _path + ".tmp";
+  journal_header_t header{};
+  size_t used = sizeof(journal_header_t);
+  size_t size = JOURNAL_MIN_SIZE;
+
+  for (const auto &[_, entry] : _entries) {
+    used += get_record_size(entry);
+  }
+  while (size < used * 4) {
+    size *= 2;
+  }
+  const int fd =
+      open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("open `" + tmp_path + "`: " + strerror(errno));
+  }
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    const int error = errno;
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("compact `" + _path + "`: " + strerror(error));
+  }
+  char *data = static_cast<char *>(map);
+  std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  std::strncpy(header.boot_id, _boot_id.c_str(), BOOT_ID_SIZE - 1);
+  std::memcpy(data, &header, sizeof(header));
+  size_t offset = sizeof(journal_header_t);
+  for (const auto &[_, entry] : _entries) {
+    encode_record(data + offset, entry, JOURNAL_UPDATE);
+    offset += get_record_size(entry);
+  }
+  if (rename(tmp_path.c_str(), _path.c_str()) == -1) {
+    const int error = errno;
+    munmap(map, size);
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw std::runtime_error("rename `" + tmp_path + "`: " + strerror(error));
+  }
+  unmap();
+  _fd = fd;
+  _map = data;
+  _size = size;
+  _offset = offset;
+}
+
+/*
+ * Must be called with the mutex held, once _entries is up to date: when the
+ * record does not fit, compacting writes it along with the others. If that
+ * fails, the journal stops recording.
+ */
+void StateJournal::append(const journal_entry_t &entry, const uint8_t type) {
+  const size_t size = get_record_size(entry);
+
+  if (_map == nullptr) {
+    return;
+  }
+  if (_offset + size <= _size) {
+    encode_record(_map + _offset, entry, type);
+    _offset += size;
+    return;
+  }
+  try {
+    compact();
+  } catch (const std::runtime_error &e) {
+    LOG_ERROR(std::string("StateJournal: ") + e.what() +
+              ", no longer journaling");
+    unmap();
+  }
+}
+
+void StateJournal::unmap() {
+  if (_map != nullptr) {
+    munmap(_map, _size);
+    _map = nullptr;
+  }
+  if (_fd != -1) {
+    close(_fd);
+    _fd = -1;
+  }
+}
+
+/*
+ * Empty if it cannot be read, journals are then never dropped.
+ */
+static std::string read_boot_id() {
+  char buffer[BOOT_ID_SIZE] = {};
+  const int fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return "";
+  }
+  const ssize_t size = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (size <= 0) {
+    return "";
+  }
+  return std::string(buffer, strcspn(buffer, "\n"));
+}
+
+static std::string get_entry_key(const std::string &group_name,
+                                 const size_t instance) {
+  return group_name + ':' + std::to_string(instance);
+}
+
+static bool is_same_entry(const journal_entry_t &left,
+                          const journal_entry_t &right) {
+  return left.pid == right.pid && left.state == right.state &&
+         left.pending_command == right.pending_command &&
+         left.num_retries == right.num_retries &&
+         left.start_queued == right.start_queued &&
+         left.start_timestamp == right.start_timestamp &&
+         left.stop_timestamp == right.stop_timestamp;
+}
+
+static size_t get_record_size(const journal_entry_t &entry) {
+  return sizeof(journal_record_t) + (entry.group_name.size() + 8) / 8 * 8;
+}
+
+/*
+ * The checksum is written last: a record cut short by a crash fails it.
+ */
+static void encode_record(char *dest, const journal_entry_t &entry,
+                          const uint8_t type) {
+  const size_t size = get_record_size(entry);
+  journal_record_t record{};
+
+  record.length = static_cast<uint32_t>(size);
+  record.pid_start_time = entry.pid_start_time;
+  record.start_timestamp = entry.start_timestamp.time_since_epoch().count();
+  record.stop_timestamp = entry.stop_timestamp.time_since_epoch().count();
+  record.pid = entry.pid;
+  record.instance = static_cast<uint32_t>(entry.instance);
+  record.num_retries = static_cast<uint32_t>(entry.num_retries);
+  record.type = type;
+  record.state = static_cast<uint8_t>(entry.state);
+  record.pending_command = static_cast<uint8_t>(entry.pending_command);
+  record.start_queued = entry.start_queued;
+  std::memcpy(dest + sizeof(record), entry.group_name.c_str(),
+              entry.group_name.size());
+  std::memset(dest + sizeof(record) + entry.group_name.size(), 0,
+              size - sizeof(record) - entry.group_name.size());
+  std::memcpy(dest, &record, sizeof(record));
+  record.checksum = checksum(dest + 8, size - 8);
+  std::memcpy(dest + 4, &record.checksum, sizeof(record.checksum));
+}
+
+/*
+ * FNV-1a
+ */
+static uint32_t checksum(const char *data, const size_t size) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
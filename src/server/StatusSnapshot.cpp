@@ -0,0 +1,154 @@
+#include "server/StatusSnapshot.hpp"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+static std::string format_time(uint64_t microseconds);
+static std::string format_size(uint64_t bytes);
+
+process_status_t make_process_status(const Process &process) {
+  const process_config_t &config = process.get_process_config();
+  const Process::status_t status = process.get_status();
+  const bool exited = status.exitstatus != -1 || status.termsig != 0;
+
+  return {
+      process.get_pid(),
+      process.get_state(),
+      process.is_start_queued(),
+      exited,
+      exited && process.exited_unexpectedly(),
+      status.killed,
+      process.get_num_retries() > config.startretries &&
+          config.startretries != 0,
+      status.termsig,
+      process.get_usage(),
+      process.get_sample(),
+  };
+}
+
+std::shared_ptr<const group_status_t>
+make_group_status(const ProcessGroup &process_group) {
+  auto group_status = std::make_shared<group_status_t>();
+
+  group_status->name = process_group.get_process_config().name;
+  group_status->numprocs = process_group.get_process_config().numprocs;
+  for (const Process &process : process_group) {
+    group_status->processes.push_back(make_process_status(process));
+  }
+  return group_status;
+}
+
+/*
+ * -v adds what the sampler last read from /proc while the process runs, and
+ * its resource usage once it exited.
+ */
+void write_process_status(std::ostream &os, const process_status_t &status,
+                          const bool verbose) {
+  os << "(" << status.pid << ") - " << status.state;
+  if (status.queued) {
+    os << " - queued";
+  }
+  if (status.state == Process::State::Stopped && status.exited) {
+    if (status.termsig != 0) {
+      os << " - signal " << status.termsig << " ("
+         << sigabbrev_np(status.termsig) << ')';
+    }
+    if (status.exited_unexpectedly) {
+      os << " - exited unexpectedly";
+    }
+    if (status.killed) {
+      os << " - killed";
+    }
+    if (status.aborted) {
+      os << " - aborted";
+    }
+  }
+  if (!verbose) {
+    return;
+  }
+  if (status.pid != -1 &&
+      status.sample.timestamp.time_since_epoch().count() != 0) {
+    const Process::sample_t &sample = status.sample;
+    os << " - cpu " << std::fixed << std::setprecision(1) << sample.cpu_percent
+       << "%, user " << format_time(sample.user_time) << ", sys "
+       << format_time(sample.system_time) << ", rss "
+       << format_size(sample.rss) << ", shared " << format_size(sample.shared)
+       << ", vsz " << format_size(sample.vsize) << ", threads "
+       << sample.threads;
+  } else if (status.state == Process::State::Stopped && status.exited) {
+    const Process::usage_t &usage = status.usage;
+    os << " - user " << format_time(usage.user_time) << ", sys "
+       << format_time(usage.system_time) << ", maxrss "
+       << format_size(usage.max_rss * 1024) << ", ctxsw "
+       << usage.voluntary_switches << '/' << usage.involuntary_switches;
+  }
+}
+
+void write_group_status(std::ostream &os, const group_status_t &status,
+                        const bool verbose) {
+  size_t queued = 0;
+  size_t starting = 0;
+  size_t running = 0;
+
+  for (const process_status_t &process : status.processes) {
+    if (process.queued) {
+      queued++;
+    } else if (process.state == Process::State::Starting) {
+      starting++;
+    } else if (process.state == Process::State::Running) {
+      running++;
+    }
+  }
+  os << "pgroup [" << status.name << "]#" << status.numprocs;
+  if (queued != 0 || starting != 0) {
+    // Progress of a (re)start spread by the spawn scheduler
+    os << " - " << running << '/' << status.numprocs << " running, "
+       << starting << " starting, " << queued << " queued";
+  }
+  os << std::endl;
+  for (const process_status_t &process : status.processes) {
+    os << '\t';
+    write_process_status(os, process, verbose);
+    os << std::endl;
+  }
+}
+
+std::ostream &operator<<(std::ostream &os, const process_status_t &status) {
+  write_process_status(os, status, false);
+  return os;
+}
+
+std::ostream &operator<<(std::ostream &os, const group_status_t &status) {
+  write_group_status(os, status, false);
+  return os;
+}
+
+/*
+ * @param microseconds a CPU time, shown as 1.25s
+ */
+static std::string format_time(const uint64_t microseconds) {
+  std::ostringstream oss;
+
+  oss << std::fixed << std::setprecision(2)
+      << static_cast<double>(microseconds) / 1000000 << 's';
+  return oss.str();
+}
+
+/*
+ * @return a size in bytes as 12.3MiB
+ */
+static std::string format_size(const uint64_t bytes) {
+  static const char *const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  double size = static_cast<double>(bytes);
+  size_t unit = 0;
+  std::ostringstream oss;
+
+  while (size >= 1024 && unit + 1 < sizeof(units) / sizeof(*units)) {
+    size /= 1024;
+    unit++;
+  }
+  oss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << size
+      << units[unit];
+  return oss.str();
+}
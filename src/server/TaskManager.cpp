@@ -3,77 +3,1102 @@
 #include "common/Logger.hpp"
 #include "common/socket/Socket.hpp"
 #include "server/ConfigParser.hpp"
+#include "server/Metrics.hpp"
+#include "server/ProcStat.hpp"
 #include "server/Process.hpp"
+#include "server/ReexecState.hpp"
+#include "server/Tracer.hpp"
+#include "server/WakeUp.hpp"
+#include <algorithm>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <thread>
+#include <unistd.h>
 
-TaskManager::TaskManager(ProcessPool &process_pool, PollFds &poll_fds)
-    : _process_pool(process_pool),
+#define MAX_STEPS_PER_EVENT 8
+
+static int pidfd_open(pid_t pid);
+static int pidfd_send_signal(int pidfd, int sig);
+static int open_survivor(pid_t pid, uint64_t start_time);
+static int create_sigchld_fd();
+static int earliest_timeout(int left, int right);
+
+TaskManager::TaskManager(PollFds &poll_fds,
+                         SpawnScheduler::spawn_limits_t &spawn_limits)
+    : _sweep_requested(true),
       _stop_token(true),
+      _suspended(false),
       _poll_fds(poll_fds),
-      _wake_up_fd(-1) {}
+      _wake_up_fd(-1),
+      _notify_pipe{-1, -1},
+      _commands(COMMAND_QUEUE_SIZE),
+      _sigchld_fd(-1),
+      _scheduler(spawn_limits),
+      _sample_interval(0),
+      _status_snapshot(std::make_shared<status_snapshot_t>()),
+      _journal(nullptr) {
+  if (pipe2(_notify_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    throw std::runtime_error(
+        "Error: TaskManager() failed to create notify pipe");
+  }
+  _event_fds.add_poll_fd(_notify_pipe[PIPE_READ], EPOLLIN,
+                         {PollFds::FdType::WakeUp, nullptr});
+  spawn_limits.wake_up_fds.push_back(_notify_pipe[PIPE_WRITE]);
+  if (is_pidfd_supported()) {
+    return;
+  }
+  LOG_WARN(std::string("TaskManager(): pidfd_open unavailable (") +
+           strerror(errno) + "), falling back to signalfd(SIGCHLD)");
+  _sigchld_fd = create_sigchld_fd();
+  _event_fds.add_poll_fd(_sigchld_fd, EPOLLIN,
+                         {PollFds::FdType::ChildExit, nullptr});
+}
 
 TaskManager::~TaskManager() {
   _stop_token = true;
+  notify();
   if (_worker_thread.joinable()) {
     _worker_thread.join();
   } else {
-    Logger::get_instance().error(
-        "Worker thread is not joinable which is a bit weird");
+    LOG_ERROR("Worker thread is not joinable which is a bit weird");
   }
+  for (const auto &[_, child] : _children) {
+    if (child.pidfd != -1) {
+      close(child.pidfd);
+    }
+  }
+  if (_sigchld_fd != -1) {
+    close(_sigchld_fd);
+  }
+  close(_notify_pipe[PIPE_READ]);
+  close(_notify_pipe[PIPE_WRITE]);
 }
 
 void TaskManager::start() {
-  Logger::get_instance().debug("Starting TaskManager");
+  LOG_DEBUG("Starting TaskManager");
   if (_wake_up_fd == -1) {
     throw std::runtime_error("TaskManager::start: wake up fd not set");
   }
   _stop_token = false;
+  _suspended = false;
   _worker_thread = std::thread(&TaskManager::work, this);
 }
 
-void TaskManager::stop() { _stop_token = true; }
+void TaskManager::stop() {
+  _stop_token = true;
+  notify();
+}
+
+/**
+ * @brief Stop the worker thread, leaving the processes as they are, before
+ *        the daemon re-executes. It may be started again if that fails.
+ *
+ * The thread stops between two iterations, so no spawn is in flight. The
+ * commands queued since are set on their processes, whose pending command
+ * is handed over, so that the next daemon runs them.
+ */
+void TaskManager::suspend() {
+  _suspended = true;
+  _stop_token = true;
+  notify();
+  if (_worker_thread.joinable()) {
+    _worker_thread.join();
+  }
+  std::lock_guard lock(_mutex);
+  apply_pending_commands();
+}
+
+/**
+ * @brief Wake the worker thread up so it handles queued commands and starts.
+ *
+ * @note The notify pipe is non-blocking: if it is full, a wake up is already
+ * pending and the write can safely be dropped.
+ */
+void TaskManager::notify() const {
+  Socket::write(_notify_pipe[PIPE_WRITE], WAKE_UP_STRING);
+}
+
+/**
+ * @brief Queue a command for one process of a group, or for all of them
+ *        when instance is -1, without waiting for the worker mutex.
+ *
+ * The worker is not woken up, so that the commands of a request are queued
+ * before a single notify().
+ *
+ * @param batch when not 0, a Restart of the whole group is rolled out this
+ *        many processes at a time, and its result is reported under
+ *        rollout_id, see take_rollout_results()
+ * @note Only the main thread queues commands.
+ * @return false if the command queue is full
+ */
+bool TaskManager::queue_command(const std::string &process_name,
+                                const long instance, Process::Command command,
+                                const unsigned long batch,
+                                const uint64_t rollout_id) {
+  return _commands.try_push([&](command_t &slot) {
+    slot.process_name = process_name;
+    slot.instance = instance;
+    slot.command = command;
+    slot.batch = batch;
+    slot.rollout_id = rollout_id;
+  });
+}
 
 bool TaskManager::is_thread_alive() const { return (!_stop_token); }
 
+/*
+ * Without pidfds, children are reaped from a signalfd(SIGCHLD) that sees the
+ * children of every worker, so only one worker can run.
+ */
+bool TaskManager::is_pidfd_supported() {
+  int self_pidfd = pidfd_open(getpid());
+  if (self_pidfd == -1) {
+    return false;
+  }
+  close(self_pidfd);
+  return true;
+}
+
 void TaskManager::set_wake_up_fd(int wake_up_fd) { _wake_up_fd = wake_up_fd; }
 
+/*
+ * The journal the worker records the state of its processes to, nullptr if
+ * none.
+ */
+void TaskManager::set_journal(StateJournal *journal) { _journal = journal; }
+
+/**
+ * @brief Set how often the running processes are read from /proc, 0 to stop
+ *        sampling them.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::set_sample_interval(
+    const std::chrono::milliseconds sample_interval) {
+  if (sample_interval != _sample_interval) {
+    _sample_interval = sample_interval;
+    _next_sample = std::chrono::steady_clock::now();
+  }
+}
+
+/**
+ * @brief Make the worker run the FSM of a group, from the next iteration.
+ *
+ * @note Must be called with the worker mutex held once the worker is started.
+ */
+void TaskManager::assign_process_group(ProcessGroup &process_group) {
+  const std::string &name = process_group.get_process_config().name;
+
+  _process_groups[name] = &process_group;
+  _dirty_groups.insert(name);
+  publish_status();
+  _sweep_requested = true;
+  notify();
+}
+
+/**
+ * @brief Detach the processes of a group that is about to be destroyed.
+ *
+ * Children that are still alive keep being watched so they get reaped, but
+ * their exit is no longer reported to the (destroyed) Process.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::release_process_group(ProcessGroup &process_group) {
+  const std::string &name = process_group.get_process_config().name;
+  const auto assigned = _process_groups.find(name);
+  if (assigned != _process_groups.end() && assigned->second == &process_group) {
+    _process_groups.erase(assigned);
+    _dirty_groups.insert(name);
+    publish_status();
+    end_rollout(name, "Rolling restart of `" + name + "` cancelled\n");
+  }
+  for (Process &process : process_group) {
+    release_process(process);
+  }
+}
+
+/**
+ * @brief Detach a single process that is about to be destroyed, see
+ *        release_process_group().
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::release_process(Process &process) {
+  if (_journal != nullptr) {
+    _journal->remove(process.get_process_config().name,
+                     process.get_instance());
+  }
+  auto child = _children.find(process.get_pid());
+  if (child != _children.end() && child->second.process == &process) {
+    child->second.process = nullptr;
+  }
+  _timers.cancel(&process);
+  _scheduler.release(&process);
+  _ready.erase(std::remove(_ready.begin(), _ready.end(), &process),
+               _ready.end());
+  _retired.erase(std::remove(_retired.begin(), _retired.end(), &process),
+                 _retired.end());
+  leave_rollout(process);
+  // A spawn in flight is killed once it completes, see finish_spawns()
+  for (spawn_t &spawn : _spawns) {
+    if (spawn.process == &process) {
+      spawn.process = nullptr;
+    }
+  }
+  for (probe_t &probe : _probes) {
+    if (probe.process == &process) {
+      probe.process = nullptr;
+    }
+  }
+}
+
+/**
+ * @brief Publish the status of a group again, after the main thread removed
+ *        some of its processes.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::refresh_status(const ProcessGroup &process_group) {
+  _dirty_groups.insert(process_group.get_process_config().name);
+  publish_status();
+}
+
+/**
+ * @brief Stop the processes of a group removed from the config by a reload,
+ *        with its stopsignal and stoptime. The group is no longer reachable
+ *        by name, and the main thread is woken up as its processes stop.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::retire_process_group(ProcessGroup &process_group) {
+  const std::string &name = process_group.get_process_config().name;
+  const auto assigned = _process_groups.find(name);
+  if (assigned != _process_groups.end() && assigned->second == &process_group) {
+    _process_groups.erase(assigned);
+    _dirty_groups.insert(name);
+    publish_status();
+    end_rollout(name, "Rolling restart of `" + name + "` cancelled\n");
+  }
+  for (Process &process : process_group) {
+    retire_process(process);
+  }
+}
+
+/**
+ * @brief Stop a process removed from the config by a reload, see
+ *        retire_process_group().
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::retire_process(Process &process) {
+  if (process.is_retired()) {
+    return;
+  }
+  process.set_retired(true);
+  process.set_pending_command(Process::Command::Stop);
+  leave_rollout(process);
+  _retired.push_back(&process);
+  _ready.push_back(&process);
+  notify();
+}
+
+/**
+ * @brief Take back a retired process, when a reload adds the instance again
+ *        before it was destroyed.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::reinstate_process(Process &process) {
+  if (!process.is_retired()) {
+    return;
+  }
+  process.set_retired(false);
+  switch (process.get_state()) {
+  case Process::State::Exiting:
+    // Already being stopped, start it again once it is
+    process.set_pending_command(Process::Command::Restart);
+    break;
+  case Process::State::Stopped:
+    process.set_pending_command(process.get_process_config().autostart
+                                    ? Process::Command::Start
+                                    : Process::Command::None);
+    break;
+  default:
+    // Cancel the stop the process was not stepped into yet
+    process.set_pending_command(Process::Command::None);
+    break;
+  }
+  _retired.erase(std::remove(_retired.begin(), _retired.end(), &process),
+                 _retired.end());
+  _ready.push_back(&process);
+  notify();
+}
+
+/**
+ * @brief Take the results of the rolling restarts that ended since the last
+ *        call. The main thread is woken up whenever one ends.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+std::vector<TaskManager::rollout_result_t> TaskManager::take_rollout_results() {
+  return std::exchange(_rollout_results, {});
+}
+
+/**
+ * @brief Watch a process restored by the daemon after a `reexec` or a crash:
+ *        its child, the output pipes and the deadline of its state.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::adopt_process(Process &process) {
+  const process_config_t &config = process.get_process_config();
+
+  if (process.get_status().running) {
+    if (process.get_pidfd() != -1) {
+      // Not a child of this daemon, see recover_process()
+      watch_child(process.get_pid(), &process, process.get_pidfd());
+    } else {
+      register_child(process.get_pid(), &process);
+    }
+    if (process.get_state() == Process::State::Starting &&
+        config.starttime.count() != 0) {
+      _timers.arm(&process, process.get_start_timestamp() + config.starttime);
+    } else if (process.get_state() == Process::State::Exiting) {
+      _timers.arm(&process, process.get_stop_timestamp() + config.stoptime);
+    }
+  }
+  if (process.get_stdout_pipe()[PIPE_READ] != -1) {
+    _poll_fds.add_poll_fd(process.get_stdout_pipe()[PIPE_READ],
+                          EPOLLIN | EPOLLET,
+                          {PollFds::FdType::ProcessStdout, &process});
+    _poll_fds.add_poll_fd(process.get_stderr_pipe()[PIPE_READ],
+                          EPOLLIN | EPOLLET,
+                          {PollFds::FdType::ProcessStderr, &process});
+  }
+  _ready.push_back(&process);
+  _dirty_groups.insert(config.name);
+  publish_status();
+}
+
+/**
+ * @brief Reap a child restored after a `reexec` whose process no longer
+ *        exists in the config, or that the previous daemon had not reaped
+ *        yet. It is killed.
+ *
+ * @note Must be called with the worker mutex held.
+ */
+void TaskManager::adopt_orphan(const pid_t pid) {
+  ::kill(pid, SIGKILL);
+  register_child(pid, nullptr);
+}
+
+/**
+ * @return the children watched until they are reaped, whose process was
+ *         released, see release_process() and adopt_orphan()
+ *
+ * @note Must be called with the worker mutex held, or once it is suspended.
+ */
+std::vector<pid_t> TaskManager::get_orphans() const {
+  std::vector<pid_t> orphans;
+
+  for (const auto &[pid, child] : _children) {
+    if (child.process == nullptr) {
+      orphans.push_back(pid);
+    }
+  }
+  return orphans;
+}
+
+/**
+ * @brief Restore a process journaled by a daemon that crashed.
+ *
+ * A child that survived was reparented: it is watched through a pidfd, and
+ * its exit status is lost. Its output pipes died with the daemon. A child
+ * that did not is handled by the FSM as if it exited, with an unknown status.
+ * A process that was stopped stays stopped.
+ *
+ * @param process nullptr if the process is no longer in the config: its child
+ *        is then killed, as it is without pidfds
+ * @return true if the child survived
+ * @note Must be called with the worker mutex held.
+ */
+bool TaskManager::recover_process(Process *process,
+                                  const journal_entry_t &entry) {
+  reexec_process_t record{};
+  const int pidfd =
+      entry.pid != -1 ? open_survivor(entry.pid, entry.pid_start_time) : -1;
+
+  if (pidfd == -1 && _sigchld_fd != -1 && entry.pid != -1 &&
+      StateJournal::get_pid_start_time(entry.pid) == entry.pid_start_time) {
+    // It cannot be watched without pidfds, it is replaced
+    ::kill(entry.pid, SIGKILL);
+  }
+  if (process == nullptr) {
+    if (pidfd != -1) {
+      pidfd_send_signal(pidfd, SIGKILL);
+      close(pidfd);
+    }
+    return pidfd != -1;
+  }
+  record.pid = pidfd != -1 ? entry.pid : -1;
+  record.state = entry.state;
+  record.previous_state = entry.state;
+  record.pending_command = entry.pending_command;
+  record.num_retries = entry.num_retries;
+  record.start_queued = entry.start_queued;
+  record.status = {.running = pidfd != -1, .killed = false, .exitstatus = -1,
+                   .termsig = 0};
+  record.start_timestamp = entry.start_timestamp;
+  record.stop_timestamp = entry.stop_timestamp;
+  record.stdout_pipe = -1;
+  record.stderr_pipe = -1;
+  process->restore_state(record, {});
+  process->set_pidfd(pidfd);
+  adopt_process(*process);
+  return pidfd != -1;
+}
+
+std::mutex &TaskManager::get_mutex() { return _mutex; }
+
+/**
+ * @brief Latest status published by the worker. Safe to call from any thread
+ *        without the worker mutex.
+ */
+std::shared_ptr<const status_snapshot_t>
+TaskManager::get_status_snapshot() const {
+  return std::atomic_load(&_status_snapshot);
+}
+
 void TaskManager::work() {
+  std::vector<PollFds::event_t> events;
+  int timeout;
+
   try {
     while (!_stop_token) {
-      std::lock_guard lock(_process_pool.get_mutex());
-      for (auto &[_, process_group] : _process_pool) {
-        for (auto &process : process_group) {
-          fsm(process);
+      {
+        std::lock_guard lock(_mutex);
+        const ScopedTimer timer(TracePoint::WorkerSweep);
+        std::vector<Process *> ready;
+        if (_sweep_requested.exchange(false)) {
+          _ready.clear();
+          for (auto &[_, process_group] : _process_groups) {
+            for (auto &process : *process_group) {
+              _ready.push_back(&process);
+            }
+          }
+          _ready.insert(_ready.end(), _retired.begin(), _retired.end());
         }
+        apply_pending_commands();
+        ready.swap(_ready);
+        for (Process *process : ready) {
+          if (!step(*process)) {
+            _ready.push_back(process);
+          }
+        }
+        advance_rollouts();
+        prepare_spawns();
+        const auto now = std::chrono::steady_clock::now();
+        prepare_samples(now);
+        publish_status();
+        timeout = _ready.empty()
+                      ? earliest_timeout(
+                            earliest_timeout(_timers.get_timeout(now),
+                                             _scheduler.get_timeout(now)),
+                            get_sample_timeout(now))
+                      : 0;
+      }
+      if (!_spawns.empty()) {
+        spawn_admitted();
+        timeout = 0;
+      }
+      if (!_probes.empty()) {
+        sample_processes();
       }
+      wait_for_events(events, timeout);
+      std::lock_guard lock(_mutex);
+      handle_events(events, _ready);
+      _timers.pop_expired(std::chrono::steady_clock::now(), _ready);
     }
   } catch (std::exception &e) {
     _stop_token = true;
-    Logger::get_instance().error(
-        std::string("TaskManager::work: caught an exception: ") + e.what());
+    LOG_ERROR(std::string("TaskManager::work: caught an exception: ") +
+              e.what());
+  }
+  if (_suspended) {
+    // Taken over by the next daemon, see Taskmaster::reexec()
+    return;
   }
   exit_gracefully();
 }
 
 void TaskManager::exit_gracefully() {
+  std::vector<PollFds::event_t> events;
+  std::vector<Process *> ready;
   bool flag;
-  Logger::get_instance().debug("TaskManager exiting gracefully...");
+  LOG_DEBUG("TaskManager exiting gracefully...");
   do {
+    bool pending = false;
+    int timeout;
     flag = false;
-    std::lock_guard lock(_process_pool.get_mutex());
-    for (auto &[_, process_group] : _process_pool) {
-      for (auto &process : process_group) {
-        if (!exit_process_gracefully(process)) {
-          // The process did not exit yet, so we stay in the loop
-          flag = true;
+    {
+      std::lock_guard lock(_mutex);
+      for (auto &[name, process_group] : _process_groups) {
+        for (auto &process : *process_group) {
+          if (!exit_process_gracefully(process)) {
+            // The process did not exit yet, so we stay in the loop
+            flag = true;
+            pending |= process.get_state() != process.get_previous_state();
+          }
         }
+        _dirty_groups.insert(name);
+      }
+      for (Process *process : _retired) {
+        flag |= !exit_process_gracefully(*process);
       }
+      publish_status();
+      timeout =
+          pending ? 0 : _timers.get_timeout(std::chrono::steady_clock::now());
+    }
+    if (flag) {
+      wait_for_events(events, timeout);
+      std::lock_guard lock(_mutex);
+      handle_events(events, ready);
+      _timers.pop_expired(std::chrono::steady_clock::now(), ready);
+      ready.clear();
     }
   } while (flag);
   Socket::write(_wake_up_fd, WAKE_UP_STRING);
-  Logger::get_instance().debug("TaskManager exited gracefully");
+  LOG_DEBUG("TaskManager exited gracefully");
+}
+
+/*
+ * Run the FSM on a single process until it settles in a state, so that the
+ * task of the state it just entered is executed right away.
+ *
+ * @return false if the process did not settle within MAX_STEPS_PER_EVENT
+ */
+bool TaskManager::step(Process &process) {
+  size_t steps = 0;
+  bool settled;
+
+  _dirty_groups.insert(process.get_process_config().name);
+  do {
+    fsm(process);
+    settled = process.get_state() == process.get_previous_state();
+  } while (!settled && ++steps < MAX_STEPS_PER_EVENT);
+  journal_process(process);
+  return settled;
+}
+
+/*
+ * Record the state of a process, the journal skips it if unchanged. Must be
+ * called with the worker mutex held.
+ */
+void TaskManager::journal_process(const Process &process) {
+  if (_journal == nullptr) {
+    return;
+  }
+  _journal->update({process.get_process_config().name,
+                    process.get_instance(), process.get_pid(), 0,
+                    process.get_state(), process.get_pending_command(),
+                    process.get_num_retries(), process.is_start_queued(),
+                    process.get_start_timestamp(),
+                    process.get_stop_timestamp()});
+}
+
+/*
+ * Publish a new snapshot if the groups went through the FSM since the last
+ * one. Only the groups that did are copied again. Groups whose samples
+ * changed are copied too, without bumping the version: `status -v` reads
+ * them, and the cached short status stays valid. Must be called with the
+ * worker mutex held.
+ */
+void TaskManager::publish_status() {
+  if (_dirty_groups.empty() && _sampled_groups.empty()) {
+    return;
+  }
+  auto snapshot = std::make_shared<status_snapshot_t>(*_status_snapshot);
+  if (!_dirty_groups.empty()) {
+    snapshot->version++;
+  }
+  _sampled_groups.insert(_dirty_groups.begin(), _dirty_groups.end());
+  for (const std::string &name : _sampled_groups) {
+    const auto process_group = _process_groups.find(name);
+    if (process_group == _process_groups.end()) {
+      snapshot->groups.erase(name);
+    } else {
+      snapshot->groups[name] = make_group_status(*process_group->second);
+    }
+  }
+  _dirty_groups.clear();
+  _sampled_groups.clear();
+  std::shared_ptr<const status_snapshot_t> published = std::move(snapshot);
+  std::atomic_store(&_status_snapshot, published);
+}
+
+/*
+ * Set the commands queued since the last iteration on the processes of their
+ * group, which then go through the FSM. Must be called with the worker mutex
+ * held.
+ */
+void TaskManager::apply_pending_commands() {
+  size_t count = 0;
+
+  while (command_t *slot = _commands.peek(count)) {
+    auto process_group = _process_groups.find(slot->process_name);
+    // A new command on the group takes over its rolling restart
+    end_rollout(slot->process_name,
+                "Rolling restart of `" + slot->process_name + "` cancelled\n");
+    if (slot->batch != 0 && process_group != _process_groups.end()) {
+      start_rollout(*process_group->second, slot->batch, slot->rollout_id);
+    } else if (slot->batch != 0) {
+      // Removed by a reload after the command was queued
+      _rollout_results.push_back(
+          {slot->rollout_id,
+           "Rolling restart of `" + slot->process_name + "` cancelled\n"});
+      Socket::write(_wake_up_fd, WAKE_UP_STRING);
+    } else if (process_group != _process_groups.end()) {
+      long instance = 0;
+      for (Process &process : *process_group->second) {
+        if ((slot->instance == -1 || slot->instance == instance) &&
+            !process.is_retired()) {
+          process.set_pending_command(slot->command);
+          _ready.push_back(&process);
+        }
+        instance++;
+      }
+    }
+    if (++count == COMMAND_QUEUE_SIZE) {
+      break;
+    }
+  }
+  _commands.release(count);
+}
+
+/*
+ * Restart the processes of a group batch_size at a time: each batch is
+ * restarted once the previous one is Running, i.e. stayed up for starttime.
+ * Must be called with the worker mutex held.
+ */
+void TaskManager::start_rollout(ProcessGroup &process_group,
+                                const unsigned long batch_size,
+                                const uint64_t rollout_id) {
+  rollout_t &rollout = _rollouts[process_group.get_process_config().name];
+
+  rollout = {rollout_id, batch_size, {}, {}};
+  for (Process &process : process_group) {
+    if (!process.is_retired()) {
+      rollout.queued.push_back(&process);
+    }
+  }
+  restart_next_batch(rollout);
+}
+
+void TaskManager::restart_next_batch(rollout_t &rollout) {
+  rollout.batch.clear();
+  while (!rollout.queued.empty() && rollout.batch.size() < rollout.batch_size) {
+    Process *process = rollout.queued.front();
+    rollout.queued.pop_front();
+    process->set_pending_command(Process::Command::Restart);
+    rollout.batch.push_back(process);
+    _ready.push_back(process);
+  }
+}
+
+/*
+ * Move the rolling restarts whose batch is running to their next batch. A
+ * process of the batch that gave up starting (startretries exhausted) aborts
+ * the rollout, leaving the processes not restarted yet untouched. Must be
+ * called with the worker mutex held, after the FSM stepped.
+ */
+void TaskManager::advance_rollouts() {
+  std::vector<std::pair<std::string, std::string>> ended;
+
+  for (auto &[name, rollout] : _rollouts) {
+    bool running = true;
+    const Process *failed = nullptr;
+    for (const Process *process : rollout.batch) {
+      if (process->get_pending_command() == Process::Command::Restart) {
+        running = false;
+      } else if (process->get_state() == Process::State::Stopped &&
+                 process->get_previous_state() == Process::State::Stopped) {
+        failed = process;
+        break;
+      } else if (process->get_state() != Process::State::Running) {
+        running = false;
+      }
+    }
+    if (failed != nullptr) {
+      const ProcessGroup &process_group = *_process_groups.at(name);
+      const auto instance =
+          std::find_if(process_group.begin(), process_group.end(),
+                       [&](const Process &process) {
+                         return &process == failed;
+                       }) -
+          process_group.begin();
+      ended.emplace_back(name, "Rolling restart of `" + name + "` aborted: `" +
+                                   name + ':' + std::to_string(instance) +
+                                   "` failed to start\n");
+    } else if (running && rollout.queued.empty()) {
+      ended.emplace_back(name, "Rolling restart of `" + name + "` done\n");
+    } else if (running) {
+      restart_next_batch(rollout);
+    }
+  }
+  for (const auto &[name, message] : ended) {
+    end_rollout(name, message);
+  }
+}
+
+/*
+ * Report the end of the rolling restart of a group, if it has one, to the
+ * main thread. Must be called with the worker mutex held.
+ */
+void TaskManager::end_rollout(const std::string &process_name,
+                              const std::string &message) {
+  const auto rollout = _rollouts.find(process_name);
+
+  if (rollout == _rollouts.end()) {
+    return;
+  }
+  LOG_INFO(message.substr(0, message.size() - 1));
+  _rollout_results.push_back({rollout->second.id, message});
+  _rollouts.erase(rollout);
+  Socket::write(_wake_up_fd, WAKE_UP_STRING);
+}
+
+/*
+ * Forget a process that is going away from the rolling restart of its group.
+ * Must be called with the worker mutex held.
+ */
+void TaskManager::leave_rollout(const Process &process) {
+  const auto rollout = _rollouts.find(process.get_process_config().name);
+
+  if (rollout == _rollouts.end()) {
+    return;
+  }
+  std::vector<Process *> &batch = rollout->second.batch;
+  std::deque<Process *> &queued = rollout->second.queued;
+  batch.erase(std::remove(batch.begin(), batch.end(), &process), batch.end());
+  queued.erase(std::remove(queued.begin(), queued.end(), &process),
+               queued.end());
+}
+
+/*
+ * Block until a child exits, a command is queued, or timeout (in ms) expires.
+ *
+ * @param events filled with the ready fds
+ */
+void TaskManager::wait_for_events(std::vector<PollFds::event_t> &events,
+                                  int timeout) {
+  if (_event_fds.wait(events, timeout) == -1 && errno != EINTR) {
+    throw std::runtime_error(std::string("epoll_wait: ") + strerror(errno));
+  }
+}
+
+/*
+ * Must be called with the worker mutex held.
+ *
+ * @param exited_processes filled with the processes whose child was reaped
+ */
+void TaskManager::handle_events(const std::vector<PollFds::event_t> &events,
+                                std::vector<Process *> &exited_processes) {
+  char buffer[SOCKET_BUFFER_SIZE];
+
+  for (const PollFds::event_t &event : events) {
+    const PollFds::entry_t &entry = *event.entry;
+
+    if (entry.removed) {
+      continue;
+    }
+    switch (entry.metadata.type) {
+    case PollFds::FdType::WakeUp:
+      while (Socket::read(entry.fd, buffer, SOCKET_BUFFER_SIZE) > 0) {
+      }
+      break;
+    case PollFds::FdType::ChildExit:
+      if (entry.fd == _sigchld_fd) {
+        while (Socket::read(entry.fd, buffer, sizeof(signalfd_siginfo)) > 0) {
+        }
+        reap_children(exited_processes);
+      } else if (Process *process = reap_child(
+                     static_cast<child_t *>(entry.metadata.owner)->pid)) {
+        exited_processes.push_back(process);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/*
+ * Create the pipes of the processes admitted by the scheduler. Must be called
+ * with the worker mutex held.
+ */
+void TaskManager::prepare_spawns() {
+  std::vector<Process *> admitted;
+
+  _scheduler.admit(std::chrono::steady_clock::now(), admitted);
+  for (Process *process : admitted) {
+    process->set_start_queued(false);
+    try {
+      process->prepare_start();
+    } catch (const std::exception &e) {
+      LOG_ERROR(process->str() + ": " + e.what());
+      process->finish_start(-1);
+      _ready.push_back(process);
+      continue;
+    }
+    _spawns.push_back({process,
+                       process->get_shared_process_config(),
+                       {process->get_stdout_pipe()[PIPE_READ],
+                        process->get_stdout_pipe()[PIPE_WRITE]},
+                       {process->get_stderr_pipe()[PIPE_READ],
+                        process->get_stderr_pipe()[PIPE_WRITE]},
+                       -1,
+                       {}});
+  }
+}
+
+/*
+ * Spawn the admitted processes without holding the worker mutex, so
+ * that a large batch does not stall the event loop. Spawning only reads the
+ * config and pipes copied by prepare_spawns().
+ */
+void TaskManager::spawn_admitted() {
+  for (spawn_t &spawn : _spawns) {
+    try {
+      const auto start = std::chrono::steady_clock::now();
+      spawn.pid = Process::spawn(*spawn.config, spawn.stdout_pipe[PIPE_WRITE],
+                                 spawn.stderr_pipe[PIPE_WRITE]);
+      spawn.latency = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+    } catch (const std::exception &e) {
+      LOG_ERROR("proc [" + spawn.config->name + "]: " + e.what());
+    }
+  }
+  std::lock_guard lock(_mutex);
+  finish_spawns();
+}
+
+/*
+ * Must be called with the worker mutex held.
+ */
+void TaskManager::finish_spawns() {
+  for (spawn_t &spawn : _spawns) {
+    if (spawn.process == nullptr) {
+      // The group was released by a reload while spawning
+      for (int fd :
+           {spawn.stdout_pipe[PIPE_READ], spawn.stdout_pipe[PIPE_WRITE],
+            spawn.stderr_pipe[PIPE_READ], spawn.stderr_pipe[PIPE_WRITE]}) {
+        close(fd);
+      }
+      if (spawn.pid != -1) {
+        ::kill(spawn.pid, SIGKILL);
+        register_child(spawn.pid, nullptr);
+      }
+      continue;
+    }
+    Process &process = *spawn.process;
+    const process_config_t &config = *spawn.config;
+    process.finish_start(spawn.pid);
+    if (spawn.pid != -1) {
+      process.get_metrics().spawn_latency.observe(spawn.latency);
+    }
+    // Not reaped yet, so the journal reads the start time of this child
+    journal_process(process);
+    if (spawn.pid != -1) {
+      register_child(spawn.pid, &process);
+      if (config.starttime.count() != 0) {
+        _timers.arm(&process, process.get_start_timestamp() + config.starttime);
+      }
+      _poll_fds.add_poll_fd(process.get_stdout_pipe()[PIPE_READ],
+                            EPOLLIN | EPOLLET,
+                            {PollFds::FdType::ProcessStdout, &process});
+      _poll_fds.add_poll_fd(process.get_stderr_pipe()[PIPE_READ],
+                            EPOLLIN | EPOLLET,
+                            {PollFds::FdType::ProcessStderr, &process});
+    }
+    _ready.push_back(&process);
+  }
+  _spawns.clear();
+}
+
+/*
+ * Every sample_interval, list the running processes to read from /proc. Must
+ * be called with the worker mutex held.
+ */
+void TaskManager::prepare_samples(
+    const std::chrono::steady_clock::time_point now) {
+  if (_sample_interval.count() == 0 || now < _next_sample) {
+    return;
+  }
+  _next_sample = now + _sample_interval;
+  for (auto &[_, process_group] : _process_groups) {
+    for (Process &process : *process_group) {
+      if (process.get_pid() != -1 && process.get_status().running) {
+        _probes.push_back(
+            {&process, process.get_pid(), process.get_sample(), {}, false});
+      }
+    }
+  }
+}
+
+/*
+ * Read /proc for the processes listed by prepare_samples() without holding
+ * the worker mutex: a few hundred processes take a few milliseconds to read.
+ * The CPU usage is averaged since the previous sample.
+ */
+void TaskManager::sample_processes() {
+  for (probe_t &probe : _probes) {
+    proc_stat_t stat;
+    proc_statm_t statm;
+
+    if (!read_proc_stat(probe.pid, stat) ||
+        !read_proc_statm(probe.pid, statm)) {
+      continue;
+    }
+    Process::sample_t &sample = probe.sample;
+    sample.timestamp = std::chrono::steady_clock::now();
+    sample.user_time = ticks_to_microseconds(stat.utime);
+    sample.system_time = ticks_to_microseconds(stat.stime);
+    sample.rss = pages_to_bytes(statm.resident);
+    sample.shared = pages_to_bytes(statm.shared);
+    sample.vsize = stat.vsize;
+    sample.threads = stat.num_threads;
+    const Process::sample_t &previous = probe.previous;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        sample.timestamp - previous.timestamp);
+    if (previous.timestamp.time_since_epoch().count() != 0 &&
+        elapsed.count() > 0) {
+      const uint64_t cpu_time = sample.user_time + sample.system_time -
+                                previous.user_time - previous.system_time;
+      sample.cpu_percent = 100.0 * static_cast<double>(cpu_time) /
+                           static_cast<double>(elapsed.count());
+    }
+    probe.sampled = true;
+  }
+  std::lock_guard lock(_mutex);
+  finish_samples();
+}
+
+/*
+ * Must be called with the worker mutex held.
+ */
+void TaskManager::finish_samples() {
+  for (const probe_t &probe : _probes) {
+    // Skipped if it exited, or was restarted, while /proc was read
+    if (probe.process == nullptr || !probe.sampled ||
+        probe.process->get_pid() != probe.pid) {
+      continue;
+    }
+    probe.process->set_sample(probe.sample);
+    _sampled_groups.insert(probe.process->get_process_config().name);
+  }
+  _probes.clear();
+}
+
+/*
+ * @return the epoll timeout until the next sample, -1 if sampling is disabled
+ */
+int TaskManager::get_sample_timeout(
+    const std::chrono::steady_clock::time_point now) const {
+  if (_sample_interval.count() == 0) {
+    return -1;
+  }
+  if (now >= _next_sample) {
+    return 0;
+  }
+  // Rounded up, so that the worker does not wake up right before it
+  return static_cast<int>(
+      std::chrono::ceil<std::chrono::milliseconds>(_next_sample - now)
+          .count());
+}
+
+/*
+ * Watch the child of a freshly started process, or an orphan child if process
+ * is nullptr. Must be called with the worker mutex held.
+ */
+void TaskManager::register_child(pid_t pid, Process *process) {
+  int pidfd = -1;
+
+  if (_sigchld_fd == -1) {
+    pidfd = pidfd_open(pid);
+    if (pidfd == -1) {
+      throw std::runtime_error(std::string("pidfd_open: ") + strerror(errno));
+    }
+  }
+  watch_child(pid, process, pidfd);
+}
+
+/*
+ * Take ownership of the pidfd of a child, -1 without pidfds. Must be called
+ * with the worker mutex held.
+ */
+void TaskManager::watch_child(pid_t pid, Process *process, int pidfd) {
+  child_t &child = _children[pid] = {pid, process, pidfd};
+  if (pidfd != -1) {
+    _event_fds.add_poll_fd(pidfd, EPOLLIN,
+                           {PollFds::FdType::ChildExit, &child});
+  }
+}
+
+/*
+ * Reap a child that exited and stop watching it. Must be called with the
+ * worker mutex held.
+ *
+ * @return the process owning the child, or nullptr if it was released or is
+ * still running
+ */
+Process *TaskManager::reap_child(pid_t pid) {
+  const auto child = _children.find(pid);
+
+  if (child == _children.end()) {
+    waitpid(pid, nullptr, WNOHANG);
+    return nullptr;
+  }
+  auto [_, process, pidfd] = child->second;
+  if (process != nullptr) {
+    process->update_status();
+    if (process->get_status().running) {
+      return nullptr;
+    }
+  } else if (waitpid(pid, nullptr, WNOHANG) == 0) {
+    return nullptr;
+  }
+  if (pidfd != -1) {
+    _event_fds.remove_poll_fd(pidfd);
+    close(pidfd);
+  }
+  _children.erase(child);
+  return process;
+}
+
+/*
+ * signalfd(SIGCHLD) fallback: SIGCHLD signals coalesce, so drain every exited
+ * child. WNOWAIT leaves the child to reap_child which actually reaps it.
+ */
+void TaskManager::reap_children(std::vector<Process *> &exited_processes) {
+  siginfo_t info;
+
+  while (true) {
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 ||
+        info.si_pid == 0) {
+      return;
+    }
+    if (Process *process = reap_child(info.si_pid)) {
+      exited_processes.push_back(process);
+    }
+  }
 }
 
 /*
@@ -92,20 +1117,13 @@ bool TaskManager::exit_process_gracefully(Process &process) {
     process.set_state(Process::State::Exiting);
     break;
   case Process::State::Exiting:
-    try {
-      process.update_status();
-    } catch (std::exception &e) {
-      Logger::get_instance().error(
-          std::string(
-              "TaskManager::exit_process_gracefully: process.update_status: ") +
-          e.what());
-      break;
-    }
     if (process.get_state() != process.get_previous_state()) {
       try {
         process.stop(process.get_process_config().stopsignal);
+        _timers.arm(&process, process.get_stop_timestamp() +
+                                  process.get_process_config().stoptime);
       } catch (std::exception &e) {
-        Logger::get_instance().error(
+        LOG_ERROR(
             std::string(
                 "TaskManager::exit_process_gracefully: process.stop: ") +
             e.what());
@@ -117,7 +1135,7 @@ bool TaskManager::exit_process_gracefully(Process &process) {
         try {
           process.kill();
         } catch (std::exception &e) {
-          Logger::get_instance().error(
+          LOG_ERROR(
               std::string(
                   "TaskManager::exit_process_gracefully: process.kill: ") +
               e.what());
@@ -139,6 +1157,14 @@ void TaskManager::fsm(Process &process) {
   const process_config_t &config = process.get_process_config();
   fsm_run_task(process, config);
   fsm_transit_state(process, config);
+  if (process.get_state() != process.get_previous_state()) {
+    // The deadline of the state that was left no longer applies
+    _timers.cancel(&process);
+    if (process.get_previous_state() == Process::State::Starting) {
+      _scheduler.release(&process);
+      process.set_start_queued(false);
+    }
+  }
 }
 
 void TaskManager::fsm_run_task(Process &process,
@@ -151,7 +1177,7 @@ void TaskManager::fsm_run_task(Process &process,
     fsm_starting_task(process, config);
     break;
   case Process::State::Running:
-    fsm_running_task(process);
+    fsm_running_task();
     break;
   case Process::State::Exiting:
     fsm_exiting_task(process, config);
@@ -168,7 +1194,7 @@ void TaskManager::fsm_transit_state(Process &process,
   Process::State next_state;
   switch (process.get_state()) {
   case Process::State::Waiting:
-    if (!config.autostart) {
+    if (!config.autostart || process.is_retired()) {
       next_state = Process::State::Stopped;
     } else {
       next_state = Process::State::Starting;
@@ -177,7 +1203,11 @@ void TaskManager::fsm_transit_state(Process &process,
   case Process::State::Starting:
     next_state = Process::State::Starting;
     status = process.get_status();
-    if (config.starttime == 0) {
+    if (process.is_start_queued()) {
+      if (process.get_pending_command() == Process::Command::Stop) {
+        next_state = Process::State::Exiting;
+      }
+    } else if (config.starttime.count() == 0) {
       next_state = Process::State::Running;
     } else if (!status.running) {
       next_state = Process::State::Stopped;
@@ -207,6 +1237,9 @@ void TaskManager::fsm_transit_state(Process &process,
     break;
   case Process::State::Stopped:
     next_state = Process::State::Stopped;
+    if (process.is_retired()) {
+      break;
+    }
     if ((process.get_pending_command() == Process::Command::Start ||
          process.get_pending_command() == Process::Command::Restart) ||
         (process.get_previous_state() == Process::State::Running &&
@@ -219,9 +1252,8 @@ void TaskManager::fsm_transit_state(Process &process,
     break;
   }
   if (next_state != process.get_state()) {
-    Logger::get_instance().debug(process.str() + ": " +
-                                 process_state_str(process.get_state()) + ">" +
-                                 process_state_str(next_state));
+    LOG_DEBUG(process.str() + ": " + process_state_str(process.get_state()) +
+              ">" + process_state_str(next_state));
   }
   process.set_previous_state(process.get_state());
   process.set_state(next_state);
@@ -230,8 +1262,14 @@ void TaskManager::fsm_transit_state(Process &process,
 void TaskManager::fsm_waiting_task(void) {}
 
 void TaskManager::fsm_starting_task(Process &process,
-                                    const process_config_t &config) {
+                                    const process_config_t &) {
   if (process.get_state() != process.get_previous_state()) {
+    if (process.get_pending_command() == Process::Command::Restart ||
+        (process.get_pending_command() == Process::Command::None &&
+         process.get_previous_state() == Process::State::Stopped)) {
+      // Restarted by a command, an autorestart or a retry
+      process.get_metrics().restarts.fetch_add(1, std::memory_order_relaxed);
+    }
     if (process.get_pending_command() == Process::Command::Start ||
         process.get_pending_command() == Process::Command::Restart) {
       // If a Start/Restart command was issued, reset num_retries and clear the
@@ -239,15 +1277,19 @@ void TaskManager::fsm_starting_task(Process &process,
       process.set_num_retries(0);
       process.set_pending_command(Process::Command::None);
     }
-    process.start();
-    _poll_fds.add_poll_fd({process.get_stdout_pipe()[PIPE_READ], POLLIN, 0},
-                          {PollFds::FdType::Process, false});
-    _poll_fds.add_poll_fd({process.get_stderr_pipe()[PIPE_READ], POLLIN, 0},
-                          {PollFds::FdType::Process, false});
-    Socket::write(_wake_up_fd, WAKE_UP_STRING);
+    // The process is spawned once admitted by the scheduler, see
+    // prepare_spawns()
+    process.set_start_queued(true);
+    _scheduler.enqueue(&process, std::chrono::steady_clock::now());
+    return;
   }
-  if (config.starttime != 0) { // Wait the process only if starttime is set
-    process.update_status();
+  if (process.is_start_queued()) {
+    if (process.get_pending_command() == Process::Command::Start ||
+        process.get_pending_command() == Process::Command::Restart) {
+      // Already about to start
+      process.set_pending_command(Process::Command::None);
+    }
+    return;
   }
   if (!process.get_status().running) {
     // The process haven't run enough time to be considered successfully started
@@ -255,15 +1297,17 @@ void TaskManager::fsm_starting_task(Process &process,
   }
 }
 
-void TaskManager::fsm_running_task(Process &process) {
-  process.update_status();
-}
+void TaskManager::fsm_running_task(void) {}
 
 void TaskManager::fsm_exiting_task(Process &process,
                                    const process_config_t &config) {
-  process.update_status();
+  if (!process.get_status().running) {
+    // Its start was cancelled before it was spawned
+    return;
+  }
   if (process.get_state() != process.get_previous_state()) {
     process.stop(config.stopsignal);
+    _timers.arm(&process, process.get_stop_timestamp() + config.stoptime);
     return;
   }
   if (process.get_stoptime() >= config.stoptime &&
@@ -276,14 +1320,23 @@ void TaskManager::fsm_exiting_task(Process &process,
 
 void TaskManager::fsm_stopped_task(Process &process) {
   if (process.get_state() != process.get_previous_state() &&
-      process.get_previous_state() != Process::State::Waiting) {
+      process.get_stdout_pipe()[PIPE_READ] != -1) {
     _poll_fds.stale_poll_fd(process.get_stdout_pipe()[PIPE_READ]);
     _poll_fds.stale_poll_fd(process.get_stderr_pipe()[PIPE_READ]);
-    Socket::write(_wake_up_fd, WAKE_UP_STRING);
+    // The event loop closes them once drained
+    process.release_pipes();
+  }
+  if (process.is_retired()) {
+    if (process.get_state() != process.get_previous_state()) {
+      // The main thread destroys it, see Taskmaster::collect_retired()
+      Socket::write(_wake_up_fd, WAKE_UP_STRING);
+    }
+    return;
   }
   if (process.get_previous_state() == Process::State::Starting) {
     if (process.get_num_retries() > process.get_process_config().startretries) {
-      Logger::get_instance().info(process.str() + ": aborted");
+      process.get_metrics().aborts.fetch_add(1, std::memory_order_relaxed);
+      LOG_INFO(process.str() + ": aborted");
     }
   }
   if (process.get_pending_command() == Process::Command::Restart) {
@@ -294,3 +1347,72 @@ void TaskManager::fsm_stopped_task(Process &process) {
     process.set_pending_command(Process::Command::None);
   }
 }
+
+static int pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int pidfd_send_signal(int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+  return static_cast<int>(
+      syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0));
+#else
+  (void)pidfd;
+  (void)sig;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/*
+ * Open a pidfd to a journaled child, if it is still the same process: the
+ * start time is checked once the pidfd is open, so that the pid cannot be
+ * reused in between.
+ *
+ * @return -1 if the child exited, or pidfds are unavailable
+ */
+static int open_survivor(pid_t pid, uint64_t start_time) {
+  const int pidfd = pidfd_open(pid);
+
+  if (pidfd != -1 && StateJournal::get_pid_start_time(pid) != start_time) {
+    close(pidfd);
+    return -1;
+  }
+  return pidfd;
+}
+
+/*
+ * SIGCHLD is blocked so it is only reported through the signalfd. This runs
+ * before the workers are started, so they inherit the mask. The log writer
+ * thread, started earlier, blocks every signal, see Logger::start_async().
+ */
+static int create_sigchld_fd() {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+    throw std::runtime_error("TaskManager(): failed to block SIGCHLD");
+  }
+  int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("signalfd: ") + strerror(errno));
+  }
+  return fd;
+}
+
+/*
+ * @return the smallest of two epoll timeouts, -1 meaning no timeout
+ */
+static int earliest_timeout(int left, int right) {
+  if (left == -1 || right == -1) {
+    return std::max(left, right);
+  }
+  return std::min(left, right);
+}
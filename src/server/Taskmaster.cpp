@@ -3,9 +3,16 @@
 #include "server/PollFds.hpp"
 #include "server/Process.hpp"
 #include "server/TaskManager.hpp"
+#include "server/Tracer.hpp"
 
+#include <algorithm>
+#include <cctype>
 #include <common/Logger.hpp>
+#include <climits>
 #include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
@@ -13,118 +20,215 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 
 static bool compare_config(const process_config_t &left,
                            const process_config_t &right);
+static bool requires_restart(const process_config_t &left,
+                             const process_config_t &right);
+static bool is_retired_and_stopped(const Process &process);
 static void sighup_handler(int);
+static long parse_instance(const std::string &str);
+static std::string get_target_name(const std::string &group_name,
+                                   long instance);
+static std::string get_exe_path();
+static void set_cloexec(int fd, bool cloexec);
 
 volatile sig_atomic_t sighup_received_g = 0;
 
-Taskmaster::Taskmaster(const ConfigParser &config)
+/**
+ * @param state the state handed over by the daemon this one was re-executed
+ *        from by `reexec`, or nullptr
+ */
+Taskmaster::Taskmaster(const ConfigParser &config, const int pidfile_fd,
+                       const reexec_state_t *state)
     : _config(config),
+      _server_config(config.parse_server()),
       _command_manager(get_commands_callback()),
-      _process_pool(config.parse()),
-      _server_socket(SOCKET_PATH_NAME),
-      _task_manager(_process_pool, _poll_fds),
-      _running(true) {
-  if (pipe(_wake_up_pipe) == -1) {
+      _server_socket(state != nullptr
+                         ? UnixSocketServer(state->server_fd, SOCKET_PATH_NAME)
+                         : UnixSocketServer(SOCKET_PATH_NAME)),
+      _next_rollout_id(1),
+      _running(true),
+      _pidfile_fd(pidfile_fd),
+      _exe_path(get_exe_path()) {
+  Logger::get_instance().set_level(_server_config.loglevel);
+  for (auto &[name, process_config] : config.parse()) {
+    const reexec_group_t *group = nullptr;
+    for (size_t i = 0; state != nullptr && i < state->groups.size(); i++) {
+      if (state->groups[i].name == name) {
+        group = &state->groups[i];
+      }
+    }
+    // Output files inherited are not opened (truncated) again
+    if (group != nullptr && group->stdout_path == process_config.stdout &&
+        group->stderr_path == process_config.stderr) {
+      _process_pool.emplace(std::move(process_config), group->stdout_fd,
+                            group->stderr_fd);
+    } else {
+      _process_pool.emplace(std::move(process_config));
+    }
+  }
+  // Non-blocking, a worker holding its mutex must never block on it
+  if (pipe2(_wake_up_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
     throw std::runtime_error(
         "Error: Taskmaster() failed to create wake_up pipe");
   }
-  _task_manager.set_wake_up_fd(_wake_up_pipe[PIPE_WRITE]);
-  _poll_fds.add_poll_fd({_server_socket.get_fd(), POLLIN, 0},
-                        {PollFds::FdType::Server, false});
-  _poll_fds.add_poll_fd({_wake_up_pipe[PIPE_READ], POLLIN, 0},
-                        {PollFds::FdType::WakeUp, false});
+  SpawnScheduler::set_limits(_spawn_limits,
+                             _server_config.max_concurrent_starts,
+                             _server_config.start_rate);
+  if (_pidfile_fd != -1) {
+    // The pidfile lock makes this daemon the only one writing to it
+    try {
+      _journal = std::make_unique<StateJournal>(TASKMASTER_JOURNAL);
+    } catch (const std::runtime_error &e) {
+      LOG_WARN(std::string("Taskmaster(): no state journal: ") + e.what());
+    }
+  }
+  if (!TaskManager::is_pidfd_supported() && _server_config.workers > 1) {
+    LOG_WARN("Taskmaster(): pidfds are unavailable, running a single worker");
+    _server_config.workers = 1;
+  }
+  for (unsigned long i = 0; i < _server_config.workers; i++) {
+    _task_managers.push_back(
+        std::make_unique<TaskManager>(_poll_fds, _spawn_limits));
+    _task_managers.back()->set_wake_up_fd(_wake_up_pipe[PIPE_WRITE]);
+    _task_managers.back()->set_journal(_journal.get());
+    _task_managers.back()->set_sample_interval(_server_config.sample_interval);
+  }
+  for (auto &[name, process_group] : _process_pool) {
+    get_task_manager(name).assign_process_group(process_group);
+  }
+  _poll_fds.add_poll_fd(_server_socket.get_fd(), EPOLLIN,
+                        {PollFds::FdType::Server, &_server_socket});
+  _poll_fds.add_poll_fd(_wake_up_pipe[PIPE_READ], EPOLLIN,
+                        {PollFds::FdType::WakeUp, nullptr});
+  if (!_server_config.metrics.empty()) {
+    try {
+      _metrics_server = std::make_unique<MetricsServer>(
+          _server_config.metrics, _poll_fds,
+          [this]() { return render_metrics(); });
+    } catch (const std::exception &e) {
+      LOG_ERROR(std::string("Taskmaster(): metrics disabled: ") + e.what());
+    }
+  }
+  if (state != nullptr) {
+    restore_state(*state);
+  } else if (_journal != nullptr) {
+    recover_state();
+  }
 }
 
 void Taskmaster::loop() {
-  _task_manager.start();
+  std::vector<PollFds::event_t> events;
+
+  for (auto &task_manager : _task_managers) {
+    task_manager->start();
+  }
   set_sighup_handler();
   if (_server_socket.listen(BACKLOG) == -1) {
     return;
   }
+  if (!_pending_requests.empty()) {
+    // Pipelined after the `reexec` this daemon comes from
+    run_requests(*_current_client, std::move(_pending_requests));
+  }
   while (_running) {
-    PollFds::snapshot_t poll_fds_snapshot = _poll_fds.get_snapshot();
-    int result = poll(poll_fds_snapshot.poll_fds.data(),
-                      poll_fds_snapshot.poll_fds.size(), -1);
-    Logger::get_instance().debug("Poll returned: " + std::to_string(result));
+    int result = _poll_fds.wait(events, -1);
+    LOG_DEBUG("Poll returned: " + std::to_string(result));
     if (result == -1) {
       if (errno != EINTR) {
-        throw std::runtime_error("poll()");
+        throw std::runtime_error("epoll_wait()");
       }
       continue;
     }
-    if (!_task_manager.is_thread_alive()) {
-      Logger::get_instance().warn(
-          "Taskmaster::loop(): TaskManager thread is no longer active");
-      return;
+    for (const auto &task_manager : _task_managers) {
+      if (!task_manager->is_thread_alive()) {
+        LOG_WARN("Taskmaster::loop(): TaskManager thread is no longer active");
+        return;
+      }
     }
-    handle_poll_fds(poll_fds_snapshot);
+    handle_poll_fds(events);
     if (sighup_received_g) {
-      int res = reload_config();
-      for (auto &client_session : _client_sessions) {
-        if (client_session.get_reload_request()) {
-          if (res == 0) {
-            client_session.send_response("successful reload\n");
-            client_session.set_reload_request(false);
-          } else {
-            client_session.send_response("reload failed\n");
-            client_session.set_reload_request(false);
-          }
-        }
-      }
+      reload_config();
       sighup_received_g = 0;
     }
   }
 }
 
-void Taskmaster::handle_poll_fds(const PollFds::snapshot_t &poll_fds_snapshot) {
-  for (size_t index = 0; index < poll_fds_snapshot.poll_fds.size(); index++) {
-    const pollfd poll_fd = poll_fds_snapshot.poll_fds[index];
-    const auto [fd_type, stale] = poll_fds_snapshot.metadata[index];
+void Taskmaster::handle_poll_fds(const std::vector<PollFds::event_t> &events) {
+  const ScopedTimer timer(TracePoint::PollIteration);
 
-    if (poll_fd.revents == 0) {
+  for (const PollFds::event_t &event : events) {
+    if (event.entry->removed) {
+      // Closed by a handler earlier in this batch
       continue;
     }
-    Logger::get_instance().debug("fd=" + std::to_string(poll_fd.fd) +
-                                 " revents=" + std::to_string(poll_fd.revents));
-    switch (fd_type) {
-    case PollFds::FdType::Process:
-      handle_process_output(poll_fd, stale);
+    LOG_DEBUG("fd=" + std::to_string(event.entry->fd) + " revents=" +
+              std::to_string(event.events));
+    switch (event.entry->metadata.type) {
+    case PollFds::FdType::ProcessStdout:
+    case PollFds::FdType::ProcessStderr:
+      handle_process_output(event);
       break;
     case PollFds::FdType::Client:
-      handle_client_command(poll_fd);
+      handle_client_command(event);
       break;
     case PollFds::FdType::WakeUp:
-      handle_wake_up(poll_fd.fd);
+      handle_wake_up(event.entry->fd);
       break;
     case PollFds::FdType::Server:
       handle_connection();
       break;
+    case PollFds::FdType::ChildExit:
+      // Child exits are handled by the TaskManager
+      break;
+    case PollFds::FdType::MetricsServer:
+      _metrics_server->accept_connection();
+      break;
+    case PollFds::FdType::MetricsClient:
+      _metrics_server->handle_connection(event);
+      break;
     }
   }
 }
 
-void Taskmaster::handle_client_command(const pollfd &poll_fd) {
-  const auto it = get_client_session_from_fd(poll_fd.fd);
-  std::string cmd_line;
+void Taskmaster::handle_client_command(const PollFds::event_t &event) {
+  auto *client_session =
+      static_cast<ClientSession *>(event.entry->metadata.owner);
+  const int fd = event.entry->fd;
+  std::vector<frame_t> requests;
 
-  if (it == _client_sessions.end()) {
-    throw std::runtime_error("handle_client_command(): invalid fd");
+  if ((event.events & EPOLLOUT) && !client_session->flush()) {
+    disconnect_client(fd);
+    return;
   }
-
-  if (poll_fd.revents & POLLIN) {
+  if (event.events & EPOLLIN) {
     try {
-      cmd_line = it->recv_command();
+      requests = client_session->recv_requests();
     } catch (const std::runtime_error &e) {
-      disconnect_client(poll_fd.fd);
+      disconnect_client(fd);
       return;
     }
-    _current_client = &(*it);
-    _command_manager.run_command(cmd_line);
-  } else {
-    disconnect_client(poll_fd.fd);
+    run_requests(*client_session, {requests.begin(), requests.end()});
+  } else if (event.events & (EPOLLHUP | EPOLLERR)) {
+    disconnect_client(fd);
+  }
+}
+
+void Taskmaster::run_requests(ClientSession &client_session,
+                              std::deque<frame_t> requests) {
+  _current_client = &client_session;
+  _pending_requests = std::move(requests);
+  while (!_pending_requests.empty()) {
+    const frame_t request = std::move(_pending_requests.front());
+    _pending_requests.pop_front();
+    client_session.begin_request(request.request_id);
+    {
+      const ScopedTimer timer(TracePoint::ClientCommand);
+      _command_manager.run_command(request.payload);
+    }
+    client_session.end_request();
   }
 }
 
@@ -133,81 +237,339 @@ void Taskmaster::handle_connection() {
   if (client_fd == -1) {
     return;
   }
-  _poll_fds.add_poll_fd({client_fd, POLLIN, 0},
-                        {PollFds::FdType::Client, false});
-  _client_sessions.emplace_back(client_fd);
+  auto [client_session, _] = _client_sessions.emplace(
+      client_fd, ClientSession(client_fd, _poll_fds, _server_config));
+  _poll_fds.add_poll_fd(client_fd, EPOLLIN,
+                        {PollFds::FdType::Client, &client_session->second});
 }
 
 void Taskmaster::handle_wake_up(int fd) {
   char buffer[SOCKET_BUFFER_SIZE];
   Socket::read(fd, buffer, SOCKET_BUFFER_SIZE);
+  collect_retired();
+  collect_rollouts();
 }
 
-void Taskmaster::handle_process_output(const pollfd &poll_fd, bool stale) {
-  ssize_t ret = 0;
-  if ((poll_fd.revents & POLLIN) != 0) {
-    std::lock_guard lock(_process_pool.get_mutex());
-    for (auto &[name, processes] : _process_pool) {
-      for (auto &process : processes) {
-        if (poll_fd.fd == process.get_stdout_pipe()[PIPE_READ]) {
-          ret = process.read_stdout();
-        } else if (poll_fd.fd == process.get_stderr_pipe()[PIPE_READ]) {
-          ret = process.read_stderr();
-        }
+/*
+ * Answer the rolling restarts whose groups were all restarted, aborted or
+ * cancelled by the workers.
+ */
+void Taskmaster::collect_rollouts() {
+  if (_rollouts.empty()) {
+    return;
+  }
+  for (auto &task_manager : _task_managers) {
+    std::vector<TaskManager::rollout_result_t> results;
+    {
+      std::lock_guard lock(task_manager->get_mutex());
+      results = task_manager->take_rollout_results();
+    }
+    for (const TaskManager::rollout_result_t &result : results) {
+      const auto rollout = _rollouts.find(result.rollout_id);
+      if (rollout == _rollouts.end()) {
+        continue;
+      }
+      rollout->second.response += result.message;
+      if (--rollout->second.pending != 0) {
+        continue;
       }
+      const auto client = _client_sessions.find(rollout->second.client_fd);
+      if (client != _client_sessions.end()) {
+        client->second.send_response(rollout->second.request_id,
+                                     rollout->second.response);
+        client->second.end_response(rollout->second.request_id);
+      }
+      _rollouts.erase(rollout);
     }
   }
-  if (stale && ret <= 0) {
-    Logger::get_instance().warn(__func__ + std::string(" closing poll_fd=") +
-                                std::to_string(poll_fd.fd));
-    close(poll_fd.fd);
-    _poll_fds.remove_poll_fd(poll_fd.fd);
+}
+
+/*
+ * Gather the metrics of a scrape: the counters are atomics and the states come
+ * from the status snapshots, so no worker mutex is taken. The attached clients
+ * are only changed by this thread.
+ */
+std::string Taskmaster::render_metrics() const {
+  std::vector<std::shared_ptr<const status_snapshot_t>> snapshots;
+  std::vector<program_metrics_view_t> programs;
+
+  for (const auto &task_manager : _task_managers) {
+    snapshots.push_back(task_manager->get_status_snapshot());
+  }
+  for (const auto &[name, process_group] : _process_pool) {
+    program_metrics_view_t program = {name, &process_group.get_metrics(), {},
+                                      0};
+    const auto &groups = snapshots[get_task_manager_index(name)]->groups;
+    const auto group_status = groups.find(name);
+    if (group_status != groups.end()) {
+      for (const process_status_t &process : group_status->second->processes) {
+        program.states[static_cast<size_t>(process.state)]++;
+      }
+    }
+    for (const Process &process : process_group) {
+      program.attached_clients += process.get_num_attached_clients();
+    }
+    programs.push_back(std::move(program));
   }
+  return ::render_metrics(programs);
 }
+
+/*
+ * Process pipes are edge-triggered, so they are drained until EAGAIN or EOF.
+ *
+ * No worker mutex is needed: the owning Process is only destroyed by this
+ * thread (reload), after its pipes are removed from _poll_fds, and the output
+ * state used by forward_output is only touched by this thread.
+ */
+void Taskmaster::handle_process_output(const PollFds::event_t &event) {
+  auto *process = static_cast<Process *>(event.entry->metadata.owner);
+  const int fd = event.entry->fd;
+  ssize_t ret;
+
+  if (event.entry->metadata.type == PollFds::FdType::ProcessStdout) {
+    while ((ret = process->read_stdout(fd)) > 0) {
+    }
+  } else {
+    while ((ret = process->read_stderr(fd)) > 0) {
+    }
+  }
+  if (event.entry->stale && (ret == 0 || errno != EAGAIN)) {
+    LOG_WARN(__func__ + std::string(" closing poll_fd=") + std::to_string(fd));
+    _poll_fds.remove_poll_fd(fd);
+    close(fd);
+  }
+}
+
+/*
+ * Apply the config file again, group by group, with the smallest change:
+ * - a new group is added, a removed one is retired: stopped with its
+ *   stopsignal and stoptime, then destroyed
+ * - a numprocs change adds or retires instances at the end of the group
+ * - a change of how the program runs (cmd, workingdir, umask, env) restarts
+ *   the processes that are running
+ * - any other field applies right away, without touching the processes
+ *
+ * @return 0 on success, -1 if the config could not be parsed, or a group
+ * could not be updated
+ */
 int32_t Taskmaster::reload_config() {
+  std::unordered_map<std::string, process_config_t> configs;
   ProcessPool new_pool;
+  server_config_t server_config;
+  std::vector<std::string> removed;
+  std::vector<std::string> added;
+  int32_t ret = 0;
+
   try {
-    new_pool = ProcessPool(_config.parse());
+    configs = _config.parse();
+    server_config = _config.parse_server();
+    for (auto it = configs.begin(); it != configs.end();) {
+      if (_process_pool.find(it->first) == _process_pool.end()) {
+        new_pool.emplace(std::move(it->second));
+        it = configs.erase(it);
+      } else {
+        ++it;
+      }
+    }
   } catch (const std::exception &e) {
-    Logger::get_instance().warn(std::string("Taskmaster::reload_config: ") +
-                                e.what());
+    LOG_WARN(std::string("Taskmaster::reload_config: ") + e.what());
     return -1;
   }
+  for (const auto &[name, _] : _process_pool) {
+    if (configs.find(name) == configs.end()) {
+      removed.push_back(name);
+    }
+  }
 
-  std::lock_guard lock(_process_pool.get_mutex());
-  Logger::get_instance().info("Reloading config...");
-  for (auto it = new_pool.begin(); it != new_pool.end();) {
-    auto old_it = _process_pool.find(it->first);
-    if (old_it != _process_pool.end()) {
-      if (compare_config(old_it->second.get_process_config(),
-                         it->second.get_process_config())) {
-        Logger::get_instance().info("No need to reload " + it->second.str());
-        it = new_pool.erase(it);
-        new_pool.move_from(_process_pool, old_it->first);
-        continue;
+  {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto &task_manager : _task_managers) {
+      locks.emplace_back(task_manager->get_mutex());
+    }
+    LOG_INFO("Reloading config...");
+    for (auto &[name, config] : configs) {
+      if (reload_process_group(_process_pool.find(name)->second,
+                               std::move(config)) == -1) {
+        ret = -1;
       }
-      Logger::get_instance().info("Reloading " + it->second.str());
     }
-    ++it;
+    for (const std::string &name : removed) {
+      ProcessGroup &process_group = _process_pool.find(name)->second;
+      LOG_INFO("Removing " + process_group.str());
+      get_task_manager(name).retire_process_group(process_group);
+      _retired_groups.push_back(_process_pool.extract(name));
+    }
+    for (auto &[name, process_group] : new_pool) {
+      LOG_INFO("Adding " + process_group.str());
+      added.push_back(name);
+    }
+    if (server_config.workers != _server_config.workers) {
+      LOG_WARN("Taskmaster::reload_config: changing the number of workers "
+               "requires a restart");
+      server_config.workers = _server_config.workers;
+    }
+    if (server_config.metrics != _server_config.metrics) {
+      LOG_WARN("Taskmaster::reload_config: changing the metrics address "
+               "requires a restart");
+      server_config.metrics = _server_config.metrics;
+    }
+    _server_config = server_config;
+    SpawnScheduler::set_limits(_spawn_limits,
+                               _server_config.max_concurrent_starts,
+                               _server_config.start_rate);
+    Logger::get_instance().set_level(_server_config.loglevel);
+    for (auto &task_manager : _task_managers) {
+      task_manager->set_sample_interval(_server_config.sample_interval);
+      task_manager->notify();
+    }
+    for (auto &[_, client_session] : _client_sessions) {
+      client_session.set_server_config(_server_config);
+    }
+    for (const std::string &name : added) {
+      _process_pool.move_from(new_pool, name);
+      get_task_manager(name).assign_process_group(
+          _process_pool.find(name)->second);
+    }
+    LOG_INFO("Config successfully reloaded");
+  }
+  collect_retired();
+  return ret;
+}
+
+/*
+ * Apply the new config of a group that is kept by a reload. Must be called
+ * with the worker mutex held.
+ */
+int32_t Taskmaster::reload_process_group(ProcessGroup &process_group,
+                                         process_config_t &&config) {
+  const process_config_t &old_config = process_group.get_process_config();
+  TaskManager &task_manager = get_task_manager(config.name);
+
+  if (compare_config(old_config, config)) {
+    LOG_INFO("No need to reload " + process_group.str());
+    return 0;
   }
-  for (auto &it : _process_pool) {
-    it.second.stop(SIGKILL);
+  const bool restart = requires_restart(old_config, config);
+  const unsigned long old_numprocs = old_config.numprocs;
+  try {
+    process_group.set_process_config(std::move(config));
+  } catch (const std::runtime_error &e) {
+    LOG_WARN("Failed to reload " + process_group.str() + ": " + e.what());
+    return -1;
+  }
+  const unsigned long numprocs = process_group.get_process_config().numprocs;
+  LOG_INFO((restart ? "Restarting " : "Updating ") + process_group.str());
+  size_t instance = 0;
+  for (Process &process : process_group) {
+    if (instance >= numprocs) {
+      task_manager.retire_process(process);
+    } else if (process.is_retired()) {
+      task_manager.reinstate_process(process);
+    } else if (restart && instance < old_numprocs &&
+               (process.get_state() == Process::State::Starting ||
+                process.get_state() == Process::State::Running)) {
+      process.set_pending_command(Process::Command::Restart);
+    }
+    instance++;
   }
-  Logger::get_instance().info("Config successfully reloaded");
-  _process_pool = std::move(new_pool);
+  task_manager.assign_process_group(process_group);
   return 0;
 }
 
+/*
+ * Destroy the retired processes that stopped: the instances past numprocs,
+ * and the groups removed from the config. Called after a reload, and when a
+ * worker reports that a retired process stopped.
+ */
+void Taskmaster::collect_retired() {
+  for (auto &[name, process_group] : _process_pool) {
+    const unsigned long numprocs = process_group.get_process_config().numprocs;
+    if (process_group.size() <= numprocs) {
+      continue;
+    }
+    TaskManager &task_manager = get_task_manager(name);
+    std::lock_guard lock(task_manager.get_mutex());
+    const size_t size = process_group.size();
+    while (process_group.size() > numprocs &&
+           is_retired_and_stopped(process_group.back())) {
+      LOG_INFO("Removed " + process_group.back().str());
+      task_manager.release_process(process_group.back());
+      release_process_output(process_group.back());
+      process_group.pop_back();
+    }
+    if (process_group.size() != size) {
+      task_manager.refresh_status(process_group);
+    }
+  }
+  for (auto it = _retired_groups.begin(); it != _retired_groups.end();) {
+    ProcessGroup &process_group = it->mapped();
+    TaskManager &task_manager = get_task_manager(it->key());
+    std::lock_guard lock(task_manager.get_mutex());
+    if (!std::all_of(process_group.begin(), process_group.end(),
+                     is_retired_and_stopped)) {
+      ++it;
+      continue;
+    }
+    LOG_INFO("Removed " + process_group.str());
+    task_manager.release_process_group(process_group);
+    release_process_outputs(process_group);
+    it = _retired_groups.erase(it);
+  }
+}
+
+/*
+ * Stop forwarding the output of a group that is about to be destroyed.
+ */
+void Taskmaster::release_process_outputs(ProcessGroup &process_group) {
+  for (const Process &process : process_group) {
+    release_process_output(process);
+  }
+}
+
+void Taskmaster::release_process_output(const Process &process) {
+  for (int fd : _poll_fds.remove_owner_fds(&process)) {
+    close(fd);
+  }
+}
+
 void Taskmaster::disconnect_client(int fd) {
-  Logger::get_instance().info("Client fd=" + std::to_string(fd) +
-                              " disconnected");
+  LOG_INFO("Client fd=" + std::to_string(fd) + " disconnected");
+  detach_client(fd);
+  // Its rolling restarts go on, unanswered: the fd may be reused
+  for (auto &[_, rollout] : _rollouts) {
+    if (rollout.client_fd == fd) {
+      rollout.client_fd = -1;
+    }
+  }
   remove_client_session(fd);
   _poll_fds.remove_poll_fd(fd);
   close(fd);
 }
 
+/*
+ * Attached clients are only used by this thread, so no worker mutex is
+ * needed.
+ */
+void Taskmaster::detach_client(int fd) {
+  auto it = _client_sessions.find(fd);
+
+  if (it == _client_sessions.end()) {
+    return;
+  }
+  for (auto &[_, process_group] : _process_pool) {
+    for (auto &process : process_group) {
+      process.detach_client(&it->second);
+    }
+  }
+  for (auto &retired_group : _retired_groups) {
+    for (auto &process : retired_group.mapped()) {
+      process.detach_client(&it->second);
+    }
+  }
+}
+
 void Taskmaster::remove_client_session(int fd) {
-  auto it = get_client_session_from_fd(fd);
+  auto it = _client_sessions.find(fd);
 
   if (it == _client_sessions.end()) {
     throw std::runtime_error("disconnect_client(): invalid fd=" +
@@ -216,6 +578,18 @@ void Taskmaster::remove_client_session(int fd) {
   _client_sessions.erase(it);
 }
 
+/*
+ * Groups are sharded across the workers by name.
+ */
+TaskManager &Taskmaster::get_task_manager(const std::string &process_name) {
+  return *_task_managers[get_task_manager_index(process_name)];
+}
+
+size_t
+Taskmaster::get_task_manager_index(const std::string &process_name) const {
+  return std::hash<std::string>{}(process_name) % _task_managers.size();
+}
+
 void Taskmaster::set_sighup_handler() {
   struct sigaction sa = {};
   sa.sa_handler = sighup_handler;
@@ -224,36 +598,145 @@ void Taskmaster::set_sighup_handler() {
   if (sigaction(SIGHUP, &sa, nullptr) == -1) {
     perror("sigaction");
   }
+  // A client closing its socket must not kill the daemon mid-forward
+  sa.sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, &sa, nullptr) == -1) {
+    perror("sigaction");
+  }
 }
 
-void Taskmaster::status(const std::vector<std::string> &) {
-  std::ostringstream oss;
-  std::lock_guard lock(_process_pool.get_mutex());
+/*
+ * Served from the snapshots published by the workers, without their mutex.
+ * The arguments select groups, instances or globs, see resolve_targets().
+ * Without them, the text of the whole status is cached, and only rebuilt
+ * once a worker publishes a new snapshot.
+ */
+void Taskmaster::status(const std::vector<std::string> &args) {
+  std::vector<std::shared_ptr<const status_snapshot_t>> snapshots;
+  std::vector<uint64_t> versions;
+  bool verbose = false;
+  size_t i = 1;
 
-  oss << _process_pool;
-  _current_client->send_response(oss.str());
+  for (; i < args.size() && args[i].rfind('-', 0) == 0; i++) {
+    if (args[i] == "-v" || args[i] == "--verbose") {
+      verbose = true;
+    } else {
+      _current_client->send_response("Invalid option `" + args[i] + "`\n");
+      return;
+    }
+  }
+  for (const auto &task_manager : _task_managers) {
+    snapshots.push_back(task_manager->get_status_snapshot());
+    versions.push_back(snapshots.back()->version);
+  }
+  if (i < args.size()) {
+    std::ostringstream oss;
+    for (const target_t &target :
+         resolve_targets({args.begin() + i, args.end()})) {
+      const auto &groups =
+          snapshots[get_task_manager_index(target.group_name)]->groups;
+      const auto group_status = groups.find(target.group_name);
+      if (group_status == groups.end()) {
+        continue;
+      }
+      const auto &processes = group_status->second->processes;
+      if (target.instance == -1) {
+        write_group_status(oss, *group_status->second, verbose);
+      } else if (static_cast<size_t>(target.instance) < processes.size()) {
+        oss << "pgroup ["
+            << get_target_name(target.group_name, target.instance) << ']'
+            << std::endl
+            << '\t';
+        write_process_status(oss, processes[target.instance], verbose);
+        oss << std::endl;
+      }
+    }
+    _current_client->send_response(oss.str());
+    return;
+  }
+  // The samples change every sample_interval, only the short status is cached
+  if (verbose || versions != _status_versions || _status_text.empty()) {
+    std::ostringstream oss;
+    if (_process_pool.empty()) {
+      oss << "No process found" << std::endl;
+    }
+    for (const auto &[name, _] : _process_pool) {
+      const auto &groups = snapshots[get_task_manager_index(name)]->groups;
+      const auto group_status = groups.find(name);
+      if (group_status != groups.end()) {
+        write_group_status(oss, *group_status->second, verbose);
+      }
+    }
+    if (verbose) {
+      _current_client->send_response(oss.str());
+      return;
+    }
+    _status_text = oss.str();
+    _status_versions = std::move(versions);
+  }
+  _current_client->send_response(_status_text);
 }
 
 void Taskmaster::start(const std::vector<std::string> &args) {
-  request_command(args, Process::Command::Start);
+  request_command({args.begin() + 1, args.end()}, Process::Command::Start,
+                  false, 0);
 }
 
 void Taskmaster::stop(const std::vector<std::string> &args) {
-  request_command(args, Process::Command::Stop);
+  request_command({args.begin() + 1, args.end()}, Process::Command::Stop,
+                  false, 0);
 }
 
+/*
+ * `restart [--rolling] [--batch n] <program_name>...`: with --rolling or
+ * --batch, or with restart_batch set in the config of the group, the group is
+ * restarted a batch at a time and the response waits for the last batch.
+ */
 void Taskmaster::restart(const std::vector<std::string> &args) {
-  request_command(args, Process::Command::Restart);
+  bool rolling = false;
+  unsigned long batch = 0;
+  size_t i = 1;
+
+  for (; i < args.size() && args[i].rfind("--", 0) == 0; i++) {
+    if (args[i] == "--rolling") {
+      rolling = true;
+    } else if (args[i] == "--batch" && i + 1 < args.size()) {
+      const std::string &value = args[++i];
+      if (value.empty() ||
+          !std::all_of(value.begin(), value.end(), ::isdigit) ||
+          (batch = std::strtoul(value.c_str(), nullptr, 10)) == 0) {
+        _current_client->send_response("Invalid batch size `" + value +
+                                       "`\n");
+        return;
+      }
+      rolling = true;
+    } else {
+      _current_client->send_response("Invalid option `" + args[i] + "`\n");
+      return;
+    }
+  }
+  if (i == args.size()) {
+    _current_client->send_response("No program to restart\n");
+    return;
+  }
+  request_command({args.begin() + i, args.end()}, Process::Command::Restart,
+                  rolling, batch);
 }
 
+/*
+ * Reload right away, so that the requests pipelined after it see the new
+ * config.
+ */
 void Taskmaster::reload(const std::vector<std::string> &) {
-  sighup_received_g = 1;
-  _current_client->set_reload_request(true);
+  _current_client->send_response(reload_config() == 0 ? "successful reload\n"
+                                                      : "reload failed\n");
 }
 
 void Taskmaster::quit(const std::vector<std::string> &) {
   _running = false;
-  _task_manager.stop();
+  for (auto &task_manager : _task_managers) {
+    task_manager->stop();
+  }
   _current_client->send_response("Quitting taskmaster...\n");
 }
 
@@ -262,59 +745,485 @@ void Taskmaster::help(const std::vector<std::string> &) {
 }
 
 void Taskmaster::attach(const std::vector<std::string> &args) {
-  std::lock_guard<std::mutex> lock(_process_pool.get_mutex());
   auto process_group = _process_pool.find(args[1]);
   if (process_group == _process_pool.end()) {
-    Logger::get_instance().warn(
-        "Client fd=" + std::to_string(_current_client->get_fd()) +
-        " no such process named `" + args[1] + "`");
+    LOG_WARN("Client fd=" + std::to_string(_current_client->get_fd()) +
+             " no such process named `" + args[1] + "`");
     _current_client->send_response("No such process named `" + args[1] + "`\n");
     return;
   }
+  std::lock_guard lock(get_task_manager(args[1]).get_mutex());
+  _current_client->set_output_request(_current_client->get_request_id());
   for (auto &process : process_group->second) {
-    process.attach_client(_current_client->get_fd());
+    // Replay the backlog first, output is only forwarded by this thread so
+    // nothing can be missed or sent twice in between
+    const std::string backlog = process.tail_output(SIZE_MAX);
+    if (!backlog.empty()) {
+      _current_client->send_response(backlog);
+    }
+    process.attach_client(_current_client);
   }
 }
 
 void Taskmaster::detach(const std::vector<std::string> &args) {
-  std::lock_guard<std::mutex> lock(_process_pool.get_mutex());
   auto process_group = _process_pool.find(args[1]);
   if (process_group == _process_pool.end()) {
-    Logger::get_instance().warn(
-        "Client fd=" + std::to_string(_current_client->get_fd()) +
-        " no such process named `" + args[1] + "`");
+    LOG_WARN("Client fd=" + std::to_string(_current_client->get_fd()) +
+             " no such process named `" + args[1] + "`");
     _current_client->send_response("No such process named `" + args[1] + "`\n");
     return;
   }
+  std::lock_guard lock(get_task_manager(args[1]).get_mutex());
+  _current_client->set_output_request(_current_client->get_request_id());
   for (auto &process : process_group->second) {
-    process.detach_client(_current_client->get_fd());
+    if (!process.detach_client(_current_client)) {
+      LOG_WARN("Client fd=" + std::to_string(_current_client->get_fd()) +
+               " not attached to `" + args[1] + '`');
+    }
   }
   _current_client->send_response("Successfully detached\n");
 }
 
-void Taskmaster::request_command(const std::vector<std::string> &args,
-                                 Process::Command command) {
-  std::lock_guard lock(_process_pool.get_mutex());
-  auto process_pool_item = _process_pool.find(args[1]);
-  if (process_pool_item == _process_pool.end()) {
-    Logger::get_instance().warn(
-        "Client fd=" + std::to_string(_current_client->get_fd()) +
-        " no such process named `" + args[1] + "`");
-    _current_client->send_response("Process named `" + args[1] +
-                                   "` not exist\n");
+void Taskmaster::tail(const std::vector<std::string> &args) {
+  size_t bytes = SIZE_MAX;
+  std::string response;
+
+  // Output buffers are only accessed by this thread, see request_command()
+  auto process_group = _process_pool.find(args[1]);
+  if (process_group == _process_pool.end()) {
+    LOG_WARN("Client fd=" + std::to_string(_current_client->get_fd()) +
+             " no such process named `" + args[1] + "`");
+    _current_client->send_response("No such process named `" + args[1] + "`\n");
     return;
   }
-  for (Process &process : process_pool_item->second) {
-    process.set_pending_command(command);
+  if (args.size() == 3) {
+    try {
+      bytes = std::stoul(args[2]);
+    } catch (const std::exception &) {
+      _current_client->send_response("Invalid number of bytes `" + args[2] +
+                                     "`\n");
+      return;
+    }
+  }
+  const bool has_instances =
+      process_group->second.get_process_config().numprocs > 1;
+  for (const auto &process : process_group->second) {
+    if (has_instances) {
+      response += "==> " + process.str() + " <==\n";
+    }
+    response += process.tail_output(bytes);
+  }
+  if (response.empty()) {
+    response = "No output kept for `" + args[1] + "`\n";
+  }
+  _current_client->send_response(response);
+}
+
+/*
+ * The level set here lasts until the next reload, which applies the one from
+ * the config file again.
+ */
+void Taskmaster::loglevel(const std::vector<std::string> &args) {
+  Logger &logger = Logger::get_instance();
+  std::ostringstream oss;
+
+  if (args.size() == 2) {
+    Logger::Level level;
+    if (!Logger::parse_level(args[1], level)) {
+      _current_client->send_response("Invalid log level `" + args[1] + "`\n");
+      return;
+    }
+    logger.set_level(level);
+    LOG_INFO("Log level set to " + args[1]);
+  }
+  oss << "Log level: " << logger.get_level() << '\n';
+  _current_client->send_response(oss.str());
+}
+
+/*
+ * Show the latencies of the daemon internals recorded since the last
+ * `stats reset`, see Tracer.
+ */
+void Taskmaster::stats(const std::vector<std::string> &args) {
+  Tracer &tracer = Tracer::get_instance();
+
+  if (args.size() == 2) {
+    if (args[1] != "reset") {
+      _current_client->send_response("Invalid option `" + args[1] + "`\n");
+      return;
+    }
+    tracer.reset();
+    _current_client->send_response("Statistics reset\n");
+    return;
+  }
+  _current_client->send_response(tracer.report());
+}
+
+/*
+ * Re-execute the daemon binary, most likely upgraded, without stopping the
+ * programs: the workers are suspended, the state is written to a memfd, and
+ * the new binary takes over the children (still its own, execve keeps the
+ * pid), their output pipes and the clients, see restore_state(). The new
+ * daemon answers this request.
+ */
+void Taskmaster::reexec(const std::vector<std::string> &) {
+  const std::string &config_path = _config.get_config_path();
+  std::vector<int> fds;
+  int state_fd = -1;
+
+  for (auto &task_manager : _task_managers) {
+    task_manager->suspend();
+  }
+  if (can_reexec()) {
+    try {
+      const reexec_state_t state = save_state();
+      state_fd = write_reexec_state(state);
+      fds = get_reexec_fds(state);
+      for (const int fd : fds) {
+        set_cloexec(fd, false);
+      }
+      setenv(REEXEC_STATE_FD_ENV, std::to_string(state_fd).c_str(), 1);
+      LOG_INFO("Re-executing " + _exe_path + "...");
+      for (auto &[_, client_session] : _client_sessions) {
+        client_session.flush();
+      }
+      Logger::get_instance().stop_async();
+      char *const argv[] = {const_cast<char *>(_exe_path.c_str()),
+                            const_cast<char *>(config_path.c_str()), nullptr};
+      execv(_exe_path.c_str(), argv);
+      const int error = errno;
+      Logger::get_instance().start_async();
+      throw std::runtime_error("execv `" + _exe_path + "`: " + strerror(error));
+    } catch (const std::runtime_error &e) {
+      LOG_ERROR(std::string("Taskmaster::reexec: ") + e.what());
+      unsetenv(REEXEC_STATE_FD_ENV);
+      if (state_fd != -1) {
+        close(state_fd);
+      }
+      for (const int fd : fds) {
+        set_cloexec(fd, true);
+      }
+      _current_client->send_response(std::string("reexec failed: ") +
+                                     e.what() + '\n');
+    }
+  }
+  for (auto &task_manager : _task_managers) {
+    task_manager->start();
   }
-  _current_client->send_response("Command issued successfully\n");
 }
 
-std::vector<ClientSession>::iterator
-Taskmaster::get_client_session_from_fd(int fd) {
-  return std::find_if(
-      _client_sessions.begin(), _client_sessions.end(),
-      [fd](const ClientSession &session) { return fd == session.get_fd(); });
+/*
+ * The new daemon reads the config file again and takes each process over by
+ * group and instance, so a process still running must keep its place in it.
+ * Retired processes and rolling restarts are not handed over.
+ *
+ * @note The workers must be suspended.
+ */
+bool Taskmaster::can_reexec() {
+  std::unordered_map<std::string, process_config_t> configs;
+
+  if (!_retired_groups.empty() || !_rollouts.empty()) {
+    _current_client->send_response(
+        "A reload or rolling restart is in progress, try again\n");
+    return false;
+  }
+  try {
+    configs = _config.parse();
+  } catch (const std::exception &e) {
+    _current_client->send_response(std::string("Invalid config file: ") +
+                                   e.what() + '\n');
+    return false;
+  }
+  for (const auto &[name, process_group] : _process_pool) {
+    const auto config = configs.find(name);
+    size_t instance = 0;
+    for (const Process &process : process_group) {
+      const std::string target =
+          get_target_name(name, static_cast<long>(instance));
+      if (process.is_retired()) {
+        _current_client->send_response("`" + target +
+                                       "` is being removed, try again\n");
+        return false;
+      }
+      if (process.get_status().running &&
+          (config == configs.end() || instance >= config->second.numprocs)) {
+        _current_client->send_response(
+            "`" + target +
+            "` is running but no longer in the config file, reload first\n");
+        return false;
+      }
+      instance++;
+    }
+  }
+  return true;
+}
+
+/*
+ * @note The workers must be suspended.
+ */
+reexec_state_t Taskmaster::save_state() {
+  reexec_state_t state{};
+
+  state.pidfile_fd = _pidfile_fd;
+  state.log_fd = Logger::get_instance().get_fd();
+  state.server_fd = _server_socket.get_fd();
+  state.request_client_fd = _current_client->get_fd();
+  state.request_id = _current_client->get_request_id();
+  state.pending_requests.assign(_pending_requests.begin(),
+                                _pending_requests.end());
+  for (const auto &[fd, client_session] : _client_sessions) {
+    state.clients.push_back({fd, client_session.get_output_request_id()});
+  }
+  for (const auto &[name, process_group] : _process_pool) {
+    const process_config_t &config = process_group.get_process_config();
+    state.groups.push_back({name, config.stdout, process_group.get_stdout_fd(),
+                            config.stderr, process_group.get_stderr_fd()});
+    size_t instance = 0;
+    for (const Process &process : process_group) {
+      reexec_process_t record{};
+      record.group_name = name;
+      record.instance = instance++;
+      process.save_state(record);
+      state.processes.push_back(std::move(record));
+    }
+  }
+  for (const auto &task_manager : _task_managers) {
+    const std::vector<pid_t> orphans = task_manager->get_orphans();
+    state.orphans.insert(state.orphans.end(), orphans.begin(), orphans.end());
+  }
+  return state;
+}
+
+/*
+ * Take over what the daemon this one was re-executed from handed over. The
+ * workers are not started yet. A child whose process is no longer in the
+ * config (the file changed in between) is killed, and reaped along with the
+ * orphans the previous daemon was still waiting for.
+ */
+void Taskmaster::restore_state(const reexec_state_t &state) {
+  for (const int fd : get_reexec_fds(state)) {
+    set_cloexec(fd, true);
+  }
+  for (const reexec_client_t &client : state.clients) {
+    auto [client_session, _] = _client_sessions.emplace(
+        client.fd, ClientSession(client.fd, _poll_fds, _server_config));
+    client_session->second.set_output_request(client.output_request_id);
+    _poll_fds.add_poll_fd(client.fd, EPOLLIN,
+                          {PollFds::FdType::Client, &client_session->second});
+  }
+  for (const reexec_group_t &group : state.groups) {
+    const auto process_group = _process_pool.find(group.name);
+    if (process_group == _process_pool.end() ||
+        process_group->second.get_stdout_fd() != group.stdout_fd) {
+      close(group.stdout_fd);
+      close(group.stderr_fd);
+    }
+  }
+  for (const reexec_process_t &record : state.processes) {
+    const auto process_group = _process_pool.find(record.group_name);
+    TaskManager &task_manager = get_task_manager(record.group_name);
+    if (process_group == _process_pool.end() ||
+        record.instance >= process_group->second.size()) {
+      LOG_WARN("`" +
+               get_target_name(record.group_name,
+                               static_cast<long>(record.instance)) +
+               "` is no longer in the config file");
+      if (record.stdout_pipe != -1) {
+        close(record.stdout_pipe);
+        close(record.stderr_pipe);
+      }
+      if (record.status.running) {
+        task_manager.adopt_orphan(record.pid);
+      }
+      continue;
+    }
+    std::vector<ClientSession *> attached_clients;
+    for (const int fd : record.attached_clients) {
+      const auto client = _client_sessions.find(fd);
+      if (client != _client_sessions.end()) {
+        attached_clients.push_back(&client->second);
+      }
+    }
+    Process &process = *(process_group->second.begin() + record.instance);
+    process.restore_state(record, attached_clients);
+    task_manager.adopt_process(process);
+  }
+  // Still children of this daemon, which has to reap them
+  for (const pid_t pid : state.orphans) {
+    _task_managers[static_cast<size_t>(pid) % _task_managers.size()]
+        ->adopt_orphan(pid);
+  }
+  LOG_INFO("Took over " + std::to_string(state.processes.size()) +
+           " processes and " + std::to_string(state.clients.size()) +
+           " clients");
+  const auto client = _client_sessions.find(state.request_client_fd);
+  if (client != _client_sessions.end()) {
+    client->second.send_response(state.request_id,
+                                 "taskmasterd re-executed (pid " +
+                                     std::to_string(getpid()) + ")\n");
+    client->second.end_response(state.request_id);
+    // Run once the workers are started, see loop()
+    _current_client = &client->second;
+    _pending_requests.assign(state.pending_requests.begin(),
+                             state.pending_requests.end());
+  }
+}
+
+/*
+ * Take back the processes journaled by the daemon that ran before this one,
+ * if it crashed, see TaskManager::recover_process(). After a clean shutdown
+ * the journal is removed. The workers are not started yet.
+ */
+void Taskmaster::recover_state() {
+  const auto start = std::chrono::steady_clock::now();
+  const std::vector<journal_entry_t> entries = _journal->get_entries();
+  size_t survivors = 0;
+
+  if (entries.empty()) {
+    return;
+  }
+  for (const journal_entry_t &entry : entries) {
+    const auto process_group = _process_pool.find(entry.group_name);
+    Process *process = nullptr;
+    if (process_group != _process_pool.end() &&
+        entry.instance < process_group->second.size()) {
+      process = &*(process_group->second.begin() + entry.instance);
+    } else {
+      LOG_WARN("`" +
+               get_target_name(entry.group_name,
+                               static_cast<long>(entry.instance)) +
+               "` is no longer in the config file");
+      _journal->remove(entry.group_name, entry.instance);
+    }
+    if (get_task_manager(entry.group_name).recover_process(process, entry)) {
+      survivors++;
+    }
+  }
+  const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  LOG_INFO("Recovered " + std::to_string(entries.size()) +
+           " processes from the journal, " + std::to_string(survivors) +
+           " still running (" + std::to_string(elapsed.count()) + " us)");
+}
+
+/*
+ * Groups are only added or removed by this thread (reload), so resolving the
+ * targets does not need to wait for a TaskManager to release its mutex. All
+ * the commands are queued first, then each worker involved is woken up once.
+ *
+ * A restart of a whole group is rolled out batch processes at a time, or
+ * restart_batch when batch is 0 (at least 1 if rolling). The response is then
+ * deferred until every group rolled out, see collect_rollouts().
+ */
+void Taskmaster::request_command(const std::vector<std::string> &names,
+                                 Process::Command command, const bool rolling,
+                                 const unsigned long batch) {
+  std::vector<bool> notify(_task_managers.size(), false);
+  const uint64_t rollout_id = _next_rollout_id;
+  size_t rolled_out = 0;
+  bool issued = false;
+
+  for (const target_t &target : resolve_targets(names)) {
+    const size_t index = get_task_manager_index(target.group_name);
+    unsigned long target_batch = 0;
+    if (command == Process::Command::Restart && target.instance == -1) {
+      const unsigned long restart_batch = _process_pool.find(target.group_name)
+                                              ->second.get_process_config()
+                                              .restart_batch;
+      if (batch != 0) {
+        target_batch = batch;
+      } else {
+        target_batch = rolling ? std::max(restart_batch, 1UL) : restart_batch;
+      }
+    }
+    if (!_task_managers[index]->queue_command(
+            target.group_name, target.instance, command, target_batch,
+            target_batch != 0 ? rollout_id : 0)) {
+      const std::string name =
+          get_target_name(target.group_name, target.instance);
+      LOG_WARN("Command queue of `" + name + "` is full");
+      _current_client->send_response("Too many pending commands for `" +
+                                     name + "`, try again\n");
+      continue;
+    }
+    notify[index] = true;
+    if (target_batch != 0) {
+      rolled_out++;
+    } else {
+      issued = true;
+    }
+  }
+  for (size_t i = 0; i < _task_managers.size(); i++) {
+    if (notify[i]) {
+      _task_managers[i]->notify();
+    }
+  }
+  if (issued) {
+    _current_client->send_response("Command issued successfully\n");
+  }
+  if (rolled_out != 0) {
+    _rollouts[rollout_id] = {_current_client->get_fd(),
+                             _current_client->get_request_id(), rolled_out, ""};
+    _next_rollout_id++;
+    _current_client->defer_response();
+  }
+}
+
+/**
+ * @brief Resolve the program names of a command. A name is either a group,
+ *        `all`, a glob pattern matched against the group names, or
+ *        `group:N` for the process N (from 0) of a group.
+ *
+ * An error is sent for each name that matches nothing, and a process named
+ * several times is only returned once.
+ */
+std::vector<Taskmaster::target_t>
+Taskmaster::resolve_targets(const std::vector<std::string> &names) {
+  std::vector<target_t> targets;
+  std::unordered_set<std::string> resolved;
+  const auto add_target = [&](const std::string &group_name, long instance) {
+    if (resolved.insert(get_target_name(group_name, instance)).second) {
+      targets.push_back({group_name, instance});
+    }
+  };
+
+  for (const std::string &name : names) {
+    if (_process_pool.find(name) != _process_pool.end()) {
+      add_target(name, -1);
+      continue;
+    }
+    if (name == "all" || name.find_first_of("*?[") != std::string::npos) {
+      bool matched = false;
+      for (const auto &[group_name, _] : _process_pool) {
+        if (name == "all" ||
+            fnmatch(name.c_str(), group_name.c_str(), 0) == 0) {
+          add_target(group_name, -1);
+          matched = true;
+        }
+      }
+      if (!matched) {
+        _current_client->send_response("No process matches `" + name +
+                                       "`\n");
+      }
+      continue;
+    }
+    const size_t colon = name.rfind(':');
+    if (colon != std::string::npos) {
+      const auto process_group = _process_pool.find(name.substr(0, colon));
+      const long instance = parse_instance(name.substr(colon + 1));
+      if (process_group != _process_pool.end() && instance != -1 &&
+          static_cast<unsigned long>(instance) <
+              process_group->second.get_process_config().numprocs) {
+        add_target(process_group->first, instance);
+        continue;
+      }
+    }
+    LOG_WARN("Client fd=" + std::to_string(_current_client->get_fd()) +
+             " no such process named `" + name + "`");
+    _current_client->send_response("Process named `" + name +
+                                   "` not exist\n");
+  }
+  return targets;
 }
 
 std::unordered_map<std::string, cmd_callback_t>
@@ -339,6 +1248,14 @@ Taskmaster::get_commands_callback() {
        [this](const std::vector<std::string> &args) { attach(args); }},
       {CMD_DETACH_STR,
        [this](const std::vector<std::string> &args) { detach(args); }},
+      {CMD_TAIL_STR,
+       [this](const std::vector<std::string> &args) { tail(args); }},
+      {CMD_LOGLEVEL_STR,
+       [this](const std::vector<std::string> &args) { loglevel(args); }},
+      {CMD_REEXEC_STR,
+       [this](const std::vector<std::string> &args) { reexec(args); }},
+      {CMD_STATS_STR,
+       [this](const std::vector<std::string> &args) { stats(args); }},
   };
 }
 
@@ -354,12 +1271,91 @@ static bool compare_config(const process_config_t &left,
   }
   return left.name == right.name && left.cmd_path == right.cmd_path &&
          left.workingdir == right.workingdir && left.stdout == right.stdout &&
-         left.stderr == right.stderr && left.stopsignal == right.stopsignal &&
+         left.stderr == right.stderr &&
+         left.output_buffer == right.output_buffer &&
+         left.stopsignal == right.stopsignal &&
          left.numprocs == right.numprocs && left.starttime == right.starttime &&
-         left.stoptime == right.stoptime && left.umask == right.umask &&
-         left.autostart == right.autostart &&
+         left.startretries == right.startretries &&
+         left.stoptime == right.stoptime &&
+         left.max_concurrent_starts == right.max_concurrent_starts &&
+         left.start_rate == right.start_rate &&
+         left.start_jitter == right.start_jitter &&
+         left.restart_batch == right.restart_batch &&
+         left.umask == right.umask && left.autostart == right.autostart &&
          left.autorestart == right.autorestart && left.env == right.env &&
          left.exitcodes == right.exitcodes;
 }
 
+/*
+ * The fields a running process was started with: changing them takes a
+ * restart. The others only matter to the daemon and apply right away.
+ */
+static bool requires_restart(const process_config_t &left,
+                             const process_config_t &right) {
+  if (left.cmd->we_wordc != right.cmd->we_wordc) {
+    return true;
+  }
+  for (size_t i = 0; i < left.cmd->we_wordc; i++) {
+    if (strcmp(left.cmd->we_wordv[i], right.cmd->we_wordv[i]) != 0) {
+      return true;
+    }
+  }
+  return left.cmd_path != right.cmd_path ||
+         left.workingdir != right.workingdir || left.umask != right.umask ||
+         left.env != right.env;
+}
+
+static bool is_retired_and_stopped(const Process &process) {
+  return process.is_retired() &&
+         process.get_state() == Process::State::Stopped &&
+         !process.get_status().running;
+}
+
 static void sighup_handler(int) { sighup_received_g = 1; }
+
+/*
+ * Return the index of a process in its group, or -1 if str is not a number.
+ */
+static long parse_instance(const std::string &str) {
+  char *end;
+
+  if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0]))) {
+    return -1;
+  }
+  errno = 0;
+  const long instance = std::strtol(str.c_str(), &end, 10);
+  if (*end != '\0' || errno == ERANGE) {
+    return -1;
+  }
+  return instance;
+}
+
+static std::string get_target_name(const std::string &group_name,
+                                   const long instance) {
+  if (instance == -1) {
+    return group_name;
+  }
+  return group_name + ':' + std::to_string(instance);
+}
+
+/*
+ * The path of the running binary, where the upgraded one is installed.
+ */
+static std::string get_exe_path() {
+  char path[PATH_MAX];
+  const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+  if (len == -1) {
+    throw std::runtime_error(std::string("readlink /proc/self/exe: ") +
+                             strerror(errno));
+  }
+  return std::string(path, len);
+}
+
+static void set_cloexec(const int fd, const bool cloexec) {
+  const int flags = fcntl(fd, F_GETFD);
+
+  if (flags != -1) {
+    fcntl(fd, F_SETFD, cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+  }
+}
@@ -0,0 +1,66 @@
+#include "server/TimerQueue.hpp"
+
+#include <algorithm>
+#include <climits>
+
+TimerQueue::TimerQueue() : _generation(0) {}
+
+/**
+ * @brief Arm the timer of a process, replacing the one already armed.
+ */
+void TimerQueue::arm(Process *process, clock::time_point deadline) {
+  _armed[process] = ++_generation;
+  _heap.push({deadline, process, _generation});
+}
+
+void TimerQueue::cancel(Process *process) { _armed.erase(process); }
+
+/**
+ * @brief Disarm every timer whose deadline is reached.
+ *
+ * @param expired filled with the processes whose timer expired
+ */
+void TimerQueue::pop_expired(clock::time_point now,
+                             std::vector<Process *> &expired) {
+  while (!_heap.empty() && _heap.top().deadline <= now) {
+    const entry_t entry = _heap.top();
+    _heap.pop();
+    if (is_armed(entry)) {
+      _armed.erase(entry.process);
+      expired.push_back(entry.process);
+    }
+  }
+}
+
+/**
+ * @return the number of milliseconds until the next deadline (rounded up),
+ * or -1 if no timer is armed
+ */
+int TimerQueue::get_timeout(clock::time_point now) {
+  discard_cancelled();
+  if (_heap.empty()) {
+    return -1;
+  }
+  if (_heap.top().deadline <= now) {
+    return 0;
+  }
+  const long long timeout = std::chrono::ceil<std::chrono::milliseconds>(
+                                _heap.top().deadline - now)
+                                .count();
+  return static_cast<int>(std::min<long long>(timeout, INT_MAX));
+}
+
+bool TimerQueue::is_armed(const entry_t &entry) const {
+  const auto it = _armed.find(entry.process);
+  return it != _armed.end() && it->second == entry.generation;
+}
+
+void TimerQueue::discard_cancelled() {
+  while (!_heap.empty() && !is_armed(_heap.top())) {
+    _heap.pop();
+  }
+}
+
+bool TimerQueue::entry_s::operator>(const entry_s &other) const {
+  return deadline > other.deadline;
+}
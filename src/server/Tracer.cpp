@@ -0,0 +1,167 @@
+#include "server/Tracer.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+static size_t get_bucket(uint64_t value);
+static uint64_t get_bucket_max(size_t bucket);
+static std::string format_duration(uint64_t nanoseconds);
+
+static const char *const trace_point_names[] = {
+    "worker_sweep",   "poll_iteration", "client_command",
+    "forward_output", "process_spawn",
+};
+
+Tracer::Tracer() : _generation(0) {}
+
+Tracer &Tracer::get_instance() {
+  static Tracer instance;
+  return instance;
+}
+
+/*
+ * Only called by the thread owning the histograms, hence the plain
+ * load/store instead of read-modify-write instructions.
+ */
+void Tracer::record(const TracePoint point,
+                    const std::chrono::nanoseconds duration) {
+  thread_histograms_t &histograms = get_thread_histograms();
+  const uint64_t generation = _generation.load(std::memory_order_acquire);
+  const size_t index = static_cast<size_t>(point);
+  const uint64_t value =
+      static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+
+  if (histograms.generation.load(std::memory_order_relaxed) != generation) {
+    for (auto &counts : histograms.counts) {
+      for (auto &count : counts) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+    for (auto &max : histograms.max) {
+      max.store(0, std::memory_order_relaxed);
+    }
+    histograms.generation.store(generation, std::memory_order_release);
+  }
+  std::atomic<uint64_t> &count = histograms.counts[index][get_bucket(value)];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+  if (value > histograms.max[index].load(std::memory_order_relaxed)) {
+    histograms.max[index].store(value, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Merge the histograms of every thread recorded since the last reset.
+ *
+ * @return a line with the count, p50, p99 and max of each trace point
+ */
+std::string Tracer::report() {
+  const uint64_t generation = _generation.load(std::memory_order_acquire);
+  std::vector<std::shared_ptr<thread_histograms_t>> threads;
+  std::ostringstream oss;
+
+  {
+    std::lock_guard lock(_mutex);
+    threads = _threads;
+  }
+  oss << std::left << std::setw(16) << "point" << std::right << std::setw(12)
+      << "count" << std::setw(10) << "p50" << std::setw(10) << "p99"
+      << std::setw(10) << "max" << '\n';
+  for (size_t point = 0; point < static_cast<size_t>(TracePoint::Count);
+       point++) {
+    std::vector<uint64_t> counts(TRACE_BUCKETS, 0);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    for (const auto &histograms : threads) {
+      // Cleared by its thread the next time it records
+      if (histograms->generation.load(std::memory_order_acquire) !=
+          generation) {
+        continue;
+      }
+      for (size_t bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+        const uint64_t count =
+            histograms->counts[point][bucket].load(std::memory_order_relaxed);
+        counts[bucket] += count;
+        total += count;
+      }
+      max = std::max(max,
+                     histograms->max[point].load(std::memory_order_relaxed));
+    }
+    oss << std::left << std::setw(16) << trace_point_names[point] << std::right
+        << std::setw(12) << total;
+    for (const double quantile : {0.5, 0.99}) {
+      const uint64_t rank =
+          std::max<uint64_t>(1, static_cast<uint64_t>(quantile * total + 0.5));
+      uint64_t seen = 0;
+      size_t bucket = 0;
+      while (total != 0 && (seen += counts[bucket]) < rank) {
+        bucket++;
+      }
+      oss << std::setw(10)
+          << (total == 0 ? "-"
+                         : format_duration(
+                               std::min(get_bucket_max(bucket), max)));
+    }
+    oss << std::setw(10) << (total == 0 ? "-" : format_duration(max)) << '\n';
+  }
+  return oss.str();
+}
+
+void Tracer::reset() { _generation.fetch_add(1, std::memory_order_acq_rel); }
+
+Tracer::thread_histograms_t &Tracer::get_thread_histograms() {
+  static thread_local std::shared_ptr<thread_histograms_t> histograms;
+
+  if (histograms == nullptr) {
+    // Value-initialized: every counter starts at 0
+    histograms = std::make_shared<thread_histograms_t>();
+    histograms->generation.store(_generation.load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+    std::lock_guard lock(_mutex);
+    _threads.push_back(histograms);
+  }
+  return *histograms;
+}
+
+/*
+ * Values below TRACE_SUB_BUCKETS have a bucket each, then each power of two
+ * is split in TRACE_SUB_BUCKETS buckets.
+ */
+static size_t get_bucket(const uint64_t value) {
+  if (value < TRACE_SUB_BUCKETS) {
+    return value;
+  }
+  const int exponent = 63 - __builtin_clzll(value);
+  const int shift = exponent - TRACE_SUB_BUCKET_BITS;
+  return (shift + 1) * TRACE_SUB_BUCKETS +
+         ((value >> shift) & (TRACE_SUB_BUCKETS - 1));
+}
+
+/*
+ * @return the largest value falling in a bucket
+ */
+static uint64_t get_bucket_max(const size_t bucket) {
+  if (bucket < TRACE_SUB_BUCKETS) {
+    return bucket;
+  }
+  const size_t shift = bucket / TRACE_SUB_BUCKETS - 1;
+  const uint64_t sub_bucket = bucket % TRACE_SUB_BUCKETS;
+  return ((TRACE_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+static std::string format_duration(const uint64_t nanoseconds) {
+  static const char *const units[] = {"ns", "us", "ms", "s"};
+  double value = static_cast<double>(nanoseconds);
+  size_t unit = 0;
+  std::ostringstream oss;
+
+  while (value >= 1000 && unit + 1 < sizeof(units) / sizeof(*units)) {
+    value /= 1000;
+    unit++;
+  }
+  oss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value
+      << units[unit];
+  return oss.str();
+}
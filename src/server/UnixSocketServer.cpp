@@ -9,46 +9,53 @@
 UnixSocketServer::UnixSocketServer(const std::string &path_name)
     : UnixSocket(path_name) {
   if (unlink(path_name.c_str()) == -1 && errno != ENOENT) {
-    Logger::get_instance().error("Failed to unlink `" + path_name +
-                                 "`: " + strerror(errno));
+    LOG_ERROR("Failed to unlink `" + path_name + "`: " + strerror(errno));
     throw std::runtime_error(std::string("unix socket: ") + strerror(errno));
   }
   if (bind(_fd, reinterpret_cast<sockaddr *>(&_addr), sizeof(_addr)) == -1) {
-    Logger::get_instance().error(
-        std::string("Failed to bind the server socket: ") + strerror(errno));
+    LOG_ERROR(std::string("Failed to bind the server socket: ") +
+              strerror(errno));
     throw std::runtime_error(std::string("bind: ") + strerror(errno));
   }
   if (chmod(path_name.c_str(), 0666) == -1) {
-    Logger::get_instance().error(
-        std::string("UnixSocketServer: failed to chmod: ") + strerror(errno));
+    LOG_ERROR(std::string("UnixSocketServer: failed to chmod: ") +
+              strerror(errno));
     throw std::runtime_error(std::string("chmod: ") + strerror(errno));
   }
-  Logger::get_instance().info(
-      "Server socket successfully created (fd=" + std::to_string(_fd) + ")");
+  LOG_INFO("Server socket successfully created (fd=" + std::to_string(_fd) +
+           ")");
+}
+
+/*
+ * Take over the server socket inherited from the daemon before a `reexec`,
+ * still bound and listening, so no connection is refused in between.
+ */
+UnixSocketServer::UnixSocketServer(const int fd, const std::string &path_name)
+    : UnixSocket(fd, path_name) {
+  LOG_INFO("Server socket inherited (fd=" + std::to_string(_fd) + ")");
 }
 
 UnixSocketServer::~UnixSocketServer() {
   if (close(_fd) == -1) {
-    Logger::get_instance().error(
+    LOG_ERROR(
         std::string(
             "UnixSocketServer destructor: Failed to close server socket: ") +
         strerror(errno));
   }
   if (unlink(_addr.sun_path) == -1) {
-    Logger::get_instance().error(std::string("Failed to unlink `") +
-                                 _addr.sun_path + "`: " + strerror(errno));
+    LOG_ERROR(std::string("Failed to unlink `") + _addr.sun_path + "`: " +
+              strerror(errno));
   }
 }
 
 int UnixSocketServer::accept_client() {
-  int client_fd = accept(_fd, nullptr, nullptr);
+  int client_fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
   if (client_fd == -1) {
-    Logger::get_instance().error(
-        std::string("Failed to handle client connection: ") + strerror(errno));
+    LOG_ERROR(std::string("Failed to handle client connection: ") +
+              strerror(errno));
     return -1;
   }
-  Logger::get_instance().info("Client fd=" + std::to_string(client_fd) +
-                              " connected");
+  LOG_INFO("Client fd=" + std::to_string(client_fd) + " connected");
   return client_fd;
 }
 
@@ -57,6 +64,6 @@ int UnixSocketServer::listen(int backlog) const {
     perror("listen");
     return -1;
   }
-  Logger::get_instance().info("Start listening from incoming connection...");
+  LOG_INFO("Start listening from incoming connection...");
   return 0;
 }
@@ -1,10 +1,12 @@
 #include "common/Logger.hpp"
 #include "server/ConfigParser.hpp"
+#include "server/ReexecState.hpp"
 #include "server/Taskmaster.hpp"
 #include <csignal>
 #include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <pwd.h>
 #include <sys/fcntl.h>
 #include <sys/file.h>
@@ -15,61 +17,94 @@
 
 static int daemon();
 static int create_pidfile(uid_t uid, gid_t gid);
+static void create_state_dir(uid_t uid, gid_t gid);
 static int daemon_start(const char *daemon_user);
+static std::unique_ptr<reexec_state_t> take_reexec_state();
 
 int main(int argc, char **argv) {
-#ifndef DISABLE_DAEMON
   int pidfile_fd = -1;
-#endif
+  std::unique_ptr<reexec_state_t> reexec_state;
+
   if (argc != 2) {
     std::cerr << "usage: " << argv[0] << " <config_file>" << std::endl;
     return 0;
   }
   try {
-    Logger::init("./server.log");
+    reexec_state = take_reexec_state();
+    if (reexec_state != nullptr) {
+      Logger::init(reexec_state->log_fd);
+    } else {
+      Logger::init("./server.log");
+    }
     ConfigParser config(argv[1]);
     (void)config.parse();
 #ifndef DISABLE_DAEMON
-    Logger::get_instance().info("Starting Taskmasterd ...");
-    std::cout << "Starting Taskmasterd ..." << std::endl;
-    pidfile_fd = daemon_start(DAEMON_USER);
-    if (pidfile_fd == -1) {
-      return EXIT_FAILURE;
+    if (reexec_state != nullptr) {
+      // Re-executed by `reexec`: already a daemon, holding the pidfile
+      LOG_INFO("Taskmasterd re-executed");
+      pidfile_fd = reexec_state->pidfile_fd;
+    } else {
+      LOG_INFO("Starting Taskmasterd ...");
+      std::cout << "Starting Taskmasterd ..." << std::endl;
+      pidfile_fd = daemon_start(DAEMON_USER);
+      if (pidfile_fd == -1) {
+        return EXIT_FAILURE;
+      }
+      LOG_DEBUG("main: daemon started");
     }
-    Logger::get_instance().debug("main: daemon started");
 #endif
-    Taskmaster taskmaster(config);
+    Logger::get_instance().start_async();
+    Taskmaster taskmaster(config, pidfile_fd, reexec_state.get());
+    reexec_state.reset();
     taskmaster.loop();
   } catch (const std::exception &e) {
-    Logger::get_instance().error(e.what());
-    Logger::get_instance().info("Shutting down with failure...");
+    LOG_ERROR(e.what());
+    LOG_INFO("Shutting down with failure...");
     return EXIT_FAILURE;
   }
 #ifndef DISABLE_DAEMON
-  Logger::get_instance().info(std::string("main: closing pidfile_fd=") +
-                              std::to_string(pidfile_fd));
+  LOG_INFO(std::string("main: closing pidfile_fd=") +
+           std::to_string(pidfile_fd));
   close(pidfile_fd);
-  Logger::get_instance().debug(std::string("main: unlink ") +
-                               TASKMASTER_PIDFILE);
+  // The programs are stopped, there is nothing to recover
+  unlink(TASKMASTER_JOURNAL);
+  LOG_DEBUG(std::string("main: unlink ") + TASKMASTER_PIDFILE);
   unlink(TASKMASTER_PIDFILE);
 #endif
-  Logger::get_instance().info("Shutting down...");
+  LOG_INFO("Shutting down...");
+  Logger::get_instance().stop_async();
   return EXIT_SUCCESS;
 }
 
+/*
+ * The state handed over by the daemon this one was re-executed from, or
+ * nullptr when started normally.
+ */
+static std::unique_ptr<reexec_state_t> take_reexec_state() {
+  const char *state_fd = getenv(REEXEC_STATE_FD_ENV);
+
+  if (state_fd == nullptr) {
+    return nullptr;
+  }
+  const int fd = std::atoi(state_fd);
+  // Not passed down to the programs
+  unsetenv(REEXEC_STATE_FD_ENV);
+  return std::make_unique<reexec_state_t>(read_reexec_state(fd));
+}
+
 static int daemon_start(const char *daemon_user) {
   uid_t uid;
   gid_t gid;
 
   if (geteuid() != 0) {
-    Logger::get_instance().error("daemon_start: Daemon must start as root");
+    LOG_ERROR("daemon_start: Daemon must start as root");
     return -1;
   }
 
   struct passwd *pw = getpwnam(daemon_user);
   if (!pw) {
-    Logger::get_instance().error(std::string(
-        std::string("daemon_start: User '") + daemon_user + "' not found"));
+    LOG_ERROR(std::string(std::string("daemon_start: User '") + daemon_user +
+                          "' not found"));
     return -1;
   }
 
@@ -80,23 +115,22 @@ static int daemon_start(const char *daemon_user) {
   if (pidfd < 0) {
     return -1;
   }
+  create_state_dir(uid, gid);
 
   if (daemon() < 0) {
-    Logger::get_instance().error(
-        std::string("daemon_start: failed to daemon: ") + strerror(errno));
+    LOG_ERROR(std::string("daemon_start: failed to daemon: ") +
+              strerror(errno));
     return -1;
   }
 
   dprintf(pidfd, "%d\n", getpid());
 
   if (setgid(gid) < 0) {
-    Logger::get_instance().error(std::string("daemon_start: setgid: ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("daemon_start: setgid: ") + strerror(errno));
     return -1;
   }
   if (setuid(uid) < 0) {
-    Logger::get_instance().error(std::string("daemon_start: setgid: ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("daemon_start: setgid: ") + strerror(errno));
     return -1;
   }
 
@@ -106,18 +140,16 @@ static int daemon_start(const char *daemon_user) {
 static int daemon() {
   pid_t pid = fork();
   if (pid < 0) {
-    Logger::get_instance().error(std::string("Taskmaster::daemon: fork(): ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("Taskmaster::daemon: fork(): ") + strerror(errno));
     return -1;
   }
   if (pid > 0) {
-    Logger::get_instance().info("daemon: exiting parent process");
+    LOG_INFO("daemon: exiting parent process");
     exit(0);
   }
 
   if (setsid() < 0) {
-    Logger::get_instance().error(std::string("Taskmaster::daemon: setsid(): ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("Taskmaster::daemon: setsid(): ") + strerror(errno));
     return -1;
   }
 
@@ -128,51 +160,62 @@ static int daemon() {
   close(STDERR_FILENO);
 
   if (open("/dev/null", O_RDWR) != STDIN_FILENO) { /* 'fd' should be 0 */
-    Logger::get_instance().error("daemon: STDIN fd not equal to 0");
+    LOG_ERROR("daemon: STDIN fd not equal to 0");
     return -1;
   }
   if (dup2(STDIN_FILENO, STDOUT_FILENO) != STDOUT_FILENO) {
-    Logger::get_instance().error("daemon: STDOUT fd not equal to 1");
+    LOG_ERROR("daemon: STDOUT fd not equal to 1");
     return -1;
   }
   if (dup2(STDIN_FILENO, STDERR_FILENO) != STDERR_FILENO) {
-    Logger::get_instance().error("daemon: STDERR fd not equal to 1");
+    LOG_ERROR("daemon: STDERR fd not equal to 1");
     return -1;
   }
   return 0;
 }
 
 static int create_pidfile(uid_t uid, gid_t gid) {
-  int fd = open(TASKMASTER_PIDFILE, O_RDWR | O_CREAT, 0644);
+  // Not inherited by the programs, which would keep the lock after a crash
+  int fd = open(TASKMASTER_PIDFILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
   if (fd < 0) {
-    Logger::get_instance().error(std::string("create_pidfile: open: ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("create_pidfile: open: ") + strerror(errno));
     return -1;
   }
 
   if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
     if (errno == EWOULDBLOCK)
-      Logger::get_instance().error("create_pidfile: Daemon already running !");
+      LOG_ERROR("create_pidfile: Daemon already running !");
     else
-      Logger::get_instance().error(std::string("create_pidfile: flock: ") +
-                                   strerror(errno));
+      LOG_ERROR(std::string("create_pidfile: flock: ") + strerror(errno));
     close(fd);
     return -1;
   }
 
   if (ftruncate(fd, 0) < 0) {
-    Logger::get_instance().error(std::string("create_pidfile: ftruncate: ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("create_pidfile: ftruncate: ") + strerror(errno));
     close(fd);
     return -1;
   }
 
   if (fchown(fd, uid, gid) < 0) {
-    Logger::get_instance().error(std::string("create_pidfile: fchown: ") +
-                                 strerror(errno));
+    LOG_ERROR(std::string("create_pidfile: fchown: ") + strerror(errno));
     close(fd);
     return -1;
   }
 
   return fd;
 }
+
+/*
+ * Where the state journal is kept, see StateJournal. Without it, the daemon
+ * runs without a journal.
+ */
+static void create_state_dir(uid_t uid, gid_t gid) {
+  if (mkdir(TASKMASTER_STATE_DIR, 0755) == -1 && errno != EEXIST) {
+    LOG_WARN(std::string("create_state_dir: mkdir: ") + strerror(errno));
+    return;
+  }
+  if (chown(TASKMASTER_STATE_DIR, uid, gid) == -1) {
+    LOG_WARN(std::string("create_state_dir: chown: ") + strerror(errno));
+  }
+}
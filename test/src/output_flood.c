@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE 65536
+
+/*
+ * Write <size> MiB to stdout as fast as possible, then report the throughput
+ * on stderr. Exits with 1 if it is below <target> MB/s.
+ *
+ * usage: output_flood [size] [target]
+ */
+int main(int argc, char **argv) {
+  static char chunk[CHUNK_SIZE];
+  long size = argc > 1 ? atol(argv[1]) : 1024;
+  double target = argc > 2 ? atof(argv[2]) : 0;
+  long total = size * 1024 * 1024;
+  struct timespec start, end;
+
+  memset(chunk, 'x', CHUNK_SIZE);
+  chunk[CHUNK_SIZE - 1] = '\n';
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long written = 0; written < total;) {
+    ssize_t ret = write(STDOUT_FILENO, chunk, CHUNK_SIZE);
+    if (ret == -1) {
+      perror("write");
+      return 1;
+    }
+    written += ret;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double throughput = (total / 1e6) / elapsed;
+  fprintf(stderr, "%ld MiB in %.3fs: %.1f MB/s\n", size, elapsed, throughput);
+  return throughput < target;
+}
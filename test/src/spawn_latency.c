@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS 200
+#define STACK_SIZE (64 * 1024)
+
+extern char **environ;
+
+static char *const child_argv[] = {"/bin/true", NULL};
+
+static pid_t spawn_fork(void) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execve(child_argv[0], child_argv, environ);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t spawn_posix(void) {
+  pid_t pid;
+  if (posix_spawn(&pid, child_argv[0], NULL, NULL, child_argv, environ) != 0) {
+    return -1;
+  }
+  return pid;
+}
+
+static int trampoline(void *arg) {
+  (void)arg;
+  execve(child_argv[0], child_argv, environ);
+  _exit(127);
+}
+
+static pid_t spawn_clone(void) {
+  static char stack[STACK_SIZE];
+  return clone(trampoline, stack + STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD,
+               NULL);
+}
+
+static double bench(pid_t (*spawn)(void)) {
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    pid_t pid = spawn();
+    if (pid == -1) {
+      perror("spawn");
+      exit(1);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return ((end.tv_sec - start.tv_sec) * 1e6 +
+          (end.tv_nsec - start.tv_nsec) / 1e3) /
+         ITERATIONS;
+}
+
+/*
+ * Average latency (us) of spawning and reaping /bin/true, with fork+execve,
+ * posix_spawn and clone(CLONE_VM | CLONE_VFORK), as the heap grows.
+ *
+ * usage: spawn_latency [heap_MiB...]
+ */
+int main(int argc, char **argv) {
+  const char *default_sizes[] = {"0", "256", "1024"};
+  const char **sizes = argc > 1 ? (const char **)argv + 1 : default_sizes;
+  int count = argc > 1 ? argc - 1 : 3;
+  char *heap = NULL;
+  size_t heap_size = 0;
+
+  printf("%10s %12s %12s %12s\n", "heap(MiB)", "fork(us)", "spawn(us)",
+         "clone(us)");
+  for (int i = 0; i < count; i++) {
+    size_t size = strtoul(sizes[i], NULL, 10) << 20;
+    if (heap) {
+      munmap(heap, heap_size);
+    }
+    heap = NULL;
+    heap_size = size;
+    if (size) {
+      heap = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (heap == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+      }
+      memset(heap, 1, size);
+    }
+    printf("%10s %12.1f %12.1f %12.1f\n", sizes[i], bench(spawn_fork),
+           bench(spawn_posix), bench(spawn_clone));
+  }
+  return 0;
+}